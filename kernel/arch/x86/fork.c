@@ -7,12 +7,20 @@
 #include <arch/syscall.h>
 #include <kernel/proc.h>
 #include <kernel/sched.h>
+#include <mm/vm.h>
 #include <stddef.h>
+#include <errno.h>
+
+/*
+ * Share user page tables between parent and child on fork (see fork_pde()),
+ * rather than copying them. Only turned off to compare the two.
+ */
+bool vm_share_page_tables = true;
 
 void fork_context(struct thread *new_thread)
 {
 	struct registers *cs_regs; /* context switch registers */
-	u32 new_cr3 = (u32) new_thread->proc->space.mmu;
+	u32 new_cr3 = page_dir_cr3(new_thread->proc->space.mmu);
 	u32 *esp = (u32 *) _KSTACK_END(new_thread);
 	u32 *ebp;
 
@@ -59,77 +67,90 @@ void fork_context(struct thread *new_thread)
 	new_thread->context = cs_regs;
 }
 
-static void fork_pde(entry_t *from_pde, entry_t *to_pde, unsigned long virt)
+/*
+ * Share the page table behind from_pde with the new address space instead
+ * of copying it. Both page directory entries are made read-only, so the
+ * first write in the range it maps from either side faults and gets its own
+ * copy (see unshare_page_table()). Page reference counts are left alone
+ * until then; a shared page table holds one reference to each page no
+ * matter how many address spaces use it.
+ */
+static void fork_pde(entry_t *from_pde, entry_t *to_pde)
 {
-	struct entry_table *to_pt;
-	struct entry_table *from_pt;
-	unsigned j;
+	page_get(entry_table_page(entry_pt(from_pde)));
 
-	from_pt = entry_pt(from_pde);
+	*from_pde |= ENTRY_TABLE_SHARED;
+	entry_set_readonly(from_pde);
+
+	*to_pde = *from_pde;
+}
+
+/*
+ * With vm_share_page_tables off, give the new address space its own copy of
+ * the page table instead, the way fork worked before tables were shared:
+ * every mapped page gets another reference and is made read-only in both
+ * tables for copy-on-write.
+ *
+ * @return 0 on success, ENOMEM if the copy could not be allocated.
+ */
+static int fork_copy_pde(entry_t *from_pde, entry_t *to_pde)
+{
+	struct entry_table *from_pt = entry_pt(from_pde);
+	struct entry_table *to_pt;
+	unsigned i;
 
 	to_pt = new_entry_table();
-	if (!to_pt) {
-		panic("TODO: unmap all pages.");
-	}
+	if (!to_pt)
+		return ENOMEM;
 
-	/*
-	 * Copy the page directory entry.
-	 */
-	*to_pde = *from_pde;
+	for (i = 0; i < ENTRY_TABLE_SIZE; i++) {
+		entry_t *from = from_pt->entries + i;
+		entry_t *to = to_pt->entries + i;
 
-	/*
-	 * But use the address of the newly created page table.
-	 */
-	entry_set_addr(to_pde, __phys(to_pt));
+		if (!entry_is_present(from))
+			continue;
 
-	for (j = 0; j < ENTRY_TABLE_SIZE; j++) {
-		entry_t *from_pte = from_pt->entries + j;
-		entry_t *to_pte = to_pt->entries + j;
+		page_get(page_struct(entry_phys(from)));
+		entry_set_readonly(from);
+		*to = *from;
+	}
 
-		/*
-		 * Copy the page table entry.
-		 */
-		*to_pte = *from_pte;
+	*to_pde = *from_pde;
+	entry_set_addr(to_pde, __phys(to_pt));
 
-		/*
-		 * If the entry is mapped to a physical page, increase the
-		 * reference count on that page by 1 as it is being used
-		 * in the new address space.
-		 */
-		if (entry_is_present(from_pte)) {
-			unsigned long phys = entry_phys(from_pte);
+	return 0;
+}
 
-			/*
-			 * Increase the reference counter on the page since
-			 * another page table now points to it.
-			 */
-			page_get(page_struct(phys));
+/*
+ * A large page can't be shared the way a page table is, so each of its 4KB
+ * pages gets another reference and both page directory entries are made
+ * read-only. The first write from either side splits the large page (see
+ * split_large_page()) and copy-on-writes the 4KB page it hit.
+ */
+static void fork_large_pde(entry_t *from_pde, entry_t *to_pde)
+{
+	phys_addr_t phys = entry_large_phys(from_pde);
+	unsigned i;
 
-			/*
-			 * Mark the page readonly in both page tables so
-			 * both processes will page fault on a write and
-			 * we can copy the page.
-			 */
-			entry_set_readonly(from_pte);
-			entry_set_readonly(to_pte);
+	for (i = 0; i < ENTRY_TABLE_SIZE; i++)
+		page_get(page_struct(phys + i * X86_PAGE_SIZE));
 
-			tlb_invalidate(virt, PAGE_SIZE);
-		}
+	entry_set_readonly(from_pde);
 
-		virt += PAGE_SIZE;
-	}
+	*to_pde = *from_pde;
 }
 
 int fork_address_space(struct entry_table *to_pd, struct entry_table *from_pd)
 {
+	int error = 0;
 	unsigned i;
 
 	TRACE("to_pd=0x%08x, from_pd=0x%08x", to_pd, from_pd);
 
-	for (i = 0; i < ENTRY_TABLE_SIZE; i++) {
-		unsigned long virt = i * (PAGE_SIZE * ENTRY_TABLE_SIZE);
-		entry_t *from_pde = from_pd->entries + i;
-		entry_t *to_pde = to_pd->entries + i;
+	for (i = 0; i < PD_ENTRIES; i++) {
+		unsigned long virt = i * X86_LARGE_PAGE_SIZE;
+		entry_t *from_pde = pd_entries(from_pd) + i;
+		entry_t *to_pde = pd_entries(to_pd) + i;
 
 		if (kernel_address(virt))
 			/*
@@ -139,19 +160,28 @@ int fork_address_space(struct entry_table *to_pd, struct entry_table *from_pd)
 			 * entries.
 			 */
 			*to_pde = *from_pde;
+		else if (entry_is_present(from_pde) && entry_is_large(from_pde))
+			fork_large_pde(from_pde, to_pde);
+		else if (entry_is_present(from_pde) && !vm_share_page_tables)
+			error = fork_copy_pde(from_pde, to_pde);
 		else if (entry_is_present(from_pde))
 			/*
 			 * If it's a user address, and the page directory
-			 * entry is present, we assume that it's pointing
-			 * to a page table and we make a copy of that page
-			 * table instead.
-			 *
-			 * WARNING: using 4MB pages (PSE) will break this
-			 * code.
+			 * entry is present, it's pointing to a page table
+			 * and we share that page table.
 			 */
-			fork_pde(from_pde, to_pde, virt);
+			fork_pde(from_pde, to_pde);
+
+		if (error)
+			break;
 	}
 
-	return 0;
+	/*
+	 * The parent's page directory (or page table) entries just became
+	 * read-only. Flush the TLB once rather than invalidating page by page.
+	 */
+	tlb_flush();
+
+	return error;
 }
 
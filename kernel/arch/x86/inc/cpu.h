@@ -7,6 +7,12 @@
 
 #include <stdint.h>
 
+/**
+ * @brief Return the index of the processor we are running on. Only one
+ * processor is brought up, so this is always 0.
+ */
+#define cpu_id() 0
+
 void enable_paging(void);
 void disable_paging(void);
 void enable_protected_mode(void);
@@ -15,6 +21,24 @@ void disable_fpu(void);
 void enable_global_pages(void);
 void enable_write_protect(void);
 
+/**
+ * @brief Read the processor's time-stamp counter (the number of cycles
+ * since reset). Useful for measuring short intervals.
+ */
+static inline u64 rdtsc(void)
+{
+	u64 tsc;
+
+	__asm__ __volatile__(
+		"rdtsc"
+		: /* output */ "=A"(tsc)
+		: /* input */
+		: /* clobbers */
+	);
+
+	return tsc;
+}
+
 /**
  * @brief esp0 is a 4-byte file in the Task State Segment (TSS). It
  * identifies a region of memory to use as a stack in the event of a
@@ -29,7 +29,8 @@ void fork_context(struct thread *new_thread);
  *    2. All kernel virtual addresses in from_pd will be mapped into to_pd by
  *       only copying the page directory entries.
  *    3. All user virtual addresses in from_pd will be mapped into to_pd by 
- *       allocating a new page table for to_pd.
+ *       sharing from_pd's page tables. A private copy of a page table is
+ *       only made when either side first writes in the range it maps.
  *    4. All mapped virtual addresses will map to the _same physical page_
  *       in both address spaces.
  *    5. All userspace mappings in to_pd and from_pd will be read-only, to
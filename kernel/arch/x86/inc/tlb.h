@@ -0,0 +1,101 @@
+/**
+ * @file x86/tlb.h
+ *
+ * @brief Keeping the TLB in sync with the page tables.
+ *
+ * The kernel's mappings are global (CR4.PGE), so they survive the cr3 loads
+ * of a context switch: tlb_flush() only drops the entries of the current
+ * address space, and tlb_flush_global() is needed to drop the kernel's too.
+ *
+ * Invalidating a range one page at a time stops paying off past a few dozen
+ * pages, so ranges bigger than tlb_flush_threshold pages are flushed
+ * instead. Code that unmaps pages one by one gathers them in a tlb_batch and
+ * invalidates them all at the end, which lets it make the same choice once
+ * it knows how many there were.
+ */
+#ifndef __X86_TLB_H__
+#define __X86_TLB_H__
+
+#include <types.h>
+#include <stddef.h>
+
+struct tlb_stats {
+	unsigned long cr3_loads;      /* must stay first, see x86/macros.S */
+	unsigned long invlpgs;
+	unsigned long flushes;
+	unsigned long global_flushes;
+};
+
+extern struct tlb_stats tlb_stats;
+
+/*
+ * Invalidating more pages than this flushes the TLB instead.
+ */
+extern unsigned long tlb_flush_threshold;
+
+/**
+ * @brief Invalidate the TLB entry of the page containing addr, even if it
+ * is global.
+ */
+static inline void tlb_invalidate_page(unsigned long addr)
+{
+	__asm__ __volatile__("invlpg (%0)" : : "r"(addr) : "memory");
+	tlb_stats.invlpgs++;
+}
+
+/**
+ * @brief Flush the TLB entries of the current address space. The kernel's
+ * global entries are left alone.
+ */
+void tlb_flush(void);
+
+/**
+ * @brief Flush the whole TLB, global entries included.
+ */
+void tlb_flush_global(void);
+
+/**
+ * @brief Invalidate a set of pages in the TLB. This should be called
+ * after vm_map if you want to write to or read from the pages you just
+ * mapped.
+ */
+void tlb_invalidate(unsigned long addr, size_t size);
+
+#define TLB_BATCH_SIZE 64
+
+/**
+ * @brief Pages waiting to be invalidated.
+ */
+struct tlb_batch {
+	unsigned long pages[TLB_BATCH_SIZE];
+	unsigned num_pages;
+	bool flush;              /* too many pages, flush instead */
+	bool global;             /* some of them are global */
+};
+
+#define INITIALIZED_TLB_BATCH { .num_pages = 0, .flush = false, \
+				.global = false }
+
+/**
+ * @brief Add the page containing addr to the batch.
+ */
+void tlb_batch_add(struct tlb_batch *batch, unsigned long addr, bool global);
+
+/**
+ * @brief Make the batch flush the TLB, for changes that can't be tracked
+ * page by page.
+ */
+static inline void tlb_batch_flush(struct tlb_batch *batch, bool global)
+{
+	batch->flush = true;
+	batch->global |= global;
+}
+
+/**
+ * @brief Invalidate every page in the batch, and empty it.
+ */
+void tlb_batch_finish(struct tlb_batch *batch);
+
+void tlb_dump_stats(printf_f p);
+
+#endif /* !__X86_TLB_H__ */
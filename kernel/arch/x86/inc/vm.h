@@ -5,6 +5,7 @@
 #define __X86_VM_H__
 
 #include <arch/x86/paging.h>
+#include <arch/tlb.h>
 
 /**
  * @brief Convert the virtual address to the physical address it maps to.
@@ -13,7 +14,7 @@
  *    The physical address is the mapping exists.
  *    -1 (0xFFFFFFFF) otherwise.
  */
-#define __phys(virt) to_phys((struct entry_table *) get_cr3(), (unsigned long) (virt))
+#define __phys(virt) to_phys(current_page_dir(), (unsigned long) (virt))
 
 /**
  * @brief Convert the virtual address to the page struct that it maps to.
@@ -23,18 +24,31 @@
  *    NULL otherwise.
  */
 #define __page(virt) ({ \
-	unsigned long phys = __phys(virt); \
-	phys == (unsigned long) -1 ? NULL : page_struct(phys); \
+	phys_addr_t phys = __phys(virt); \
+	phys == (phys_addr_t) -1 ? NULL : page_struct(phys); \
 })
 
 
+/**
+ * @brief Finish setting up the MMU code once vm_init() has switched to the
+ * kernel's address space.
+ */
+void mmu_init(void);
+
 void *new_address_space(void);
 void free_address_space(void *mmu);
 
+/**
+ * @brief Stop sharing page tables with any other address space, dropping
+ * the mappings they held. Called before tearing down an address space.
+ */
+void release_shared_page_tables(void *mmu);
+
 static inline void *swap_address_space(void *new)
 {
-	void *old = (void *) (get_cr3() + CONFIG_KERNEL_VIRTUAL_START);
-	set_cr3((u32) __phys(new));
+	void *old = current_page_dir();
+	set_cr3(page_dir_cr3(new));
+	tlb_stats.cr3_loads++;
 	return old;
 }
 
@@ -43,6 +57,47 @@ static inline void *swap_address_space(void *new)
  */
 int mmu_map_page(void *page_dir, unsigned long virt, struct page *page, int flags);
 
+/**
+ * @brief Map a physically contiguous range into the virtual address space.
+ */
+int mmu_map_range(void *page_dir, unsigned long virt, phys_addr_t phys,
+		  unsigned long size, int flags);
+
+/**
+ * @brief Called by mmu_populate_range() for every page it maps.
+ *
+ * @return the page to map at virt, NULL if there is none to be had.
+ */
+typedef struct page *(*mmu_populate_f)(unsigned long virt, void *arg);
+
+/**
+ * @brief Map a page from get() at every unmapped page of [start, end),
+ * walking each page table once.
+ */
+int mmu_populate_range(void *page_dir, unsigned long start, unsigned long end,
+		       int flags, mmu_populate_f get, void *arg);
+
+/*
+ * The size of the large pages mmu_map_range() maps suitably aligned memory
+ * with.
+ */
+#define MMU_LARGE_PAGE_SIZE X86_LARGE_PAGE_SIZE
+
+/**
+ * @brief Check that the large page containing virt is entirely unmapped.
+ */
+bool mmu_large_page_fits(void *page_dir, unsigned long virt);
+
+/**
+ * @brief Check whether a page is mapped at virt.
+ */
+bool mmu_page_mapped(void *page_dir, unsigned long virt);
+
+/**
+ * @brief Create the page tables for a range of kernel addresses up front.
+ */
+int mmu_alloc_page_tables(void *page_dir, unsigned long start, unsigned long end);
+
 /**
  * @brief Unmap a virtual page and return the physical page that it was
  * mapping to.
@@ -50,25 +105,17 @@ int mmu_map_page(void *page_dir, unsigned long virt, struct page *page, int flag
 struct page *mmu_unmap_page(void *page_dir, unsigned long virt);
 
 /**
- * @brief Flush the contents of the TLB, invalidating all cached virtual
- * address lookups.
+ * @brief Called by mmu_unmap_range() for every page it unmaps.
  */
-static inline void tlb_flush(void) {
-	set_cr3(get_cr3());
-}
+typedef void (*mmu_unmap_f)(struct page *page, unsigned long virt, void *arg);
 
 /**
- * @brief Invalidate a set of pages in the TLB. This should be called
- * after vm_map if you want to write to or read from the pages you just
- * mapped.
+ * @brief Unmap a range of virtual pages, freeing the page tables left empty
+ * and invalidating the TLB.
  */
-static inline void tlb_invalidate(unsigned long addr, size_t size)
-{
-	unsigned long v;
+unsigned long mmu_unmap_range(void *page_dir, unsigned long start,
+			      unsigned long end, mmu_unmap_f put, void *arg);
 
-	for (v = FLOOR(X86_PAGE_SIZE, addr); v < CEIL(X86_PAGE_SIZE, addr + size); v += X86_PAGE_SIZE) {
-		__invlpg(v);
-	}
-}
+void page_tables_dump(printf_f p);
 
 #endif /* !__X86_VM_H__ */
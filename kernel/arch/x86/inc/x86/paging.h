@@ -16,6 +16,12 @@
  *      which points to a page directory. This is only used when the physical
  *      address space extension (36-bit pointers) is used.
  *
+ * With CONFIG_X86_PAE the entries are 64 bits, so a page directory or page
+ * table holds 512 of them, and large pages are 2MB. The four page
+ * directories of an address space are allocated together, one after the
+ * other, so the rest of the code can treat them as a single page directory
+ * of 2048 entries (see PD_ENTRIES). The page directory pointer table goes
+ * right after them.
  */
 #ifndef __X86_PAGING_H__
 #define __X86_PAGING_H__
@@ -28,13 +34,18 @@
 #include <mm/vm.h>
 #include <mm/pages.h>
 #include <mm/kmalloc.h>
+#include <mm/slab.h>
 
 #include <stdint.h>
 #include <types.h>
 #include <stddef.h>
 #include <assert.h>
 
+#if CONFIG_X86_PAE
+typedef uint64_t entry_t;
+#else
 typedef int32_t entry_t;
+#endif
 
 /*
  * Page Directory & Page Table Entries for 4 KB pages
@@ -158,9 +169,22 @@ static inline int entry_is_dirty(entry_t *entry)
 /*
  * Page size (PS) flag, bit 7 (Page Directory Only)
  *   Determines the page size. When the flag is clear, pages are 4KB and the
- *   PDE points to a Page Table.
+ *   PDE points to a Page Table. When set (and the PSE flag of CR4 is set),
+ *   the PDE maps a 4MB page directly.
  */
 #define ENTRY_PAGESIZE4MB 7
+static inline void entry_set_large(entry_t *entry)
+{
+	set_bit(entry, ENTRY_PAGESIZE4MB, 1);
+}
+static inline void entry_clear_large(entry_t *entry)
+{
+	set_bit(entry, ENTRY_PAGESIZE4MB, 0);
+}
+static inline int entry_is_large(entry_t *entry)
+{
+	return get_bit(*entry, ENTRY_PAGESIZE4MB);
+}
 
 /* 
  * Page attribute index table (PAT) flag, bit 7 (Page Table only)
@@ -197,37 +221,42 @@ static inline int entry_is_global(entry_t *entry)
 #define ENTRY_AVAIL             9
 #define ENTRY_AVAIL_MASK        MASK(3)
 #define   ENTRY_TABLE_UNMAP     (1 << 9)  // used to mark page directory entries
+#define   ENTRY_TABLE_SHARED    (1 << 10) // page table may be shared by fork
 
 /*
  * Page Table Base Address (PT) or Physical Page Address (PP)
- *   bits 12-31
+ *   bits 12-31, or 12-35 with PAE
  */
+#if CONFIG_X86_PAE
+#define ENTRY_ADDR_MASK ((entry_t) 0x0000000FFFFFF000ULL)
+#else
 #define ENTRY_ADDR_MASK (~MASK(12))
-static inline void entry_set_addr(entry_t *entry_ptr, unsigned long addr)
+#endif
+static inline void entry_set_addr(entry_t *entry_ptr, phys_addr_t addr)
 {
-	ASSERT_EQUALS(FLOOR(X86_PAGE_SIZE, addr), addr);
+	ASSERT_EQUALS(addr & (X86_PAGE_SIZE - 1), 0);
 	*(entry_ptr) &= ~ENTRY_ADDR_MASK;
 	*(entry_ptr) |= addr;
 }
-static inline unsigned long entry_get_addr(entry_t *entry)
+static inline phys_addr_t entry_get_addr(entry_t *entry)
 {
-	return (unsigned long) ((*entry) & ENTRY_ADDR_MASK);
+	return (phys_addr_t) ((*entry) & ENTRY_ADDR_MASK);
 }
 
 /**
  * @return the virtual address of the page table pointed to by this page
- * directory entry.
+ * directory entry. Page tables are always allocated from kdirect.
  */
 static inline struct entry_table *entry_pt(entry_t *pde)
 {
-	unsigned long phys = entry_get_addr(pde);
+	size_t phys = (size_t) entry_get_addr(pde);
 	return (struct entry_table *) (phys + CONFIG_KERNEL_VIRTUAL_START);
 }
 
 /**
  * @return the physical address pointed to by this page table entry.
  */
-static inline unsigned long entry_phys(entry_t *pte)
+static inline phys_addr_t entry_phys(entry_t *pte)
 {
 	return entry_get_addr(pte);
 }
@@ -242,38 +271,129 @@ struct entry_table {
 	entry_t entries[ENTRY_TABLE_SIZE];
 };
 
+/*
+ * The memory mapped by one page table, or by one large page: 4MB, or 2MB
+ * with PAE.
+ */
+#define X86_LARGE_PAGE_SIZE (X86_PAGE_SIZE * ENTRY_TABLE_SIZE)
+
+/*
+ * In a large page directory entry only the bits above the large page size
+ * hold the page's physical address. The ones below are reserved (or PAT)
+ * and kept clear.
+ */
+#define ENTRY_LARGE_ADDR_MASK \
+	(ENTRY_ADDR_MASK & ~(entry_t) (X86_LARGE_PAGE_SIZE - 1))
+
+/**
+ * @return the physical address of the large page mapped by this page
+ * directory entry.
+ */
+static inline phys_addr_t entry_large_phys(entry_t *pde)
+{
+	return (phys_addr_t) ((*pde) & ENTRY_LARGE_ADDR_MASK);
+}
+
+/*
+ * The number of page directory entries covering the 4GB address space,
+ * and the number of pages they take up.
+ */
+#define PD_ENTRIES ((size_t) (0x100000000ULL / X86_LARGE_PAGE_SIZE))
+#define PD_PAGES   (PD_ENTRIES / ENTRY_TABLE_SIZE)
+
+/*
+ * With PAE the page directory is PD_PAGES entry tables back to back, so it
+ * has more entries than struct entry_table holds. Index it through a plain
+ * entry_t pointer to the whole allocation instead of through ->entries.
+ */
+#define pd_entries(_pd) ((entry_t *) (_pd))
+
+#define foreach_pde(_pde, _pd)						      \
+	for ((_pde) = pd_entries(_pd);					      \
+	     (_pde) < pd_entries(_pd) + PD_ENTRIES;			      \
+	     (_pde)++)
+
 #define foreach_entry(_entry, _entry_table)				      \
 	for ((_entry) = (_entry_table)->entries;			      \
 	     (_entry) < (_entry_table)->entries + ENTRY_TABLE_SIZE;	      \
 	     (_entry)++)
 
 /**
- * @brief Allocate a new entry_table, with the proper memory address alignment.
+ * @brief Allocate a zeroed page table or (without PAE) page directory, in a
+ * page of its own.
  *
- * @return NULL if the allocation fails.
+ * @return NULL if out of memory.
  */
-static inline struct entry_table *new_entry_table(void)
+struct entry_table *new_entry_table(void);
+void free_entry_table(struct entry_table *tbl);
+
+#if CONFIG_X86_PAE
+/*
+ * The page directory pointer table, right after the page directories.
+ */
+#define pd_pdpt(_pd) (pd_entries(_pd) + PD_ENTRIES)
+
+/**
+ * @brief Allocate the page directories of an address space, followed by
+ * their page directory pointer table.
+ *
+ * @return NULL if out of memory.
+ */
+struct entry_table *new_page_dir(void);
+void free_page_dir(struct entry_table *pd);
+
+/**
+ * @return the value of cr3 that selects the address space of this page
+ * directory.
+ */
+static inline u32 page_dir_cr3(struct entry_table *pd)
 {
-	struct entry_table *tbl;
-	entry_t *e;
+	return (size_t) pd_pdpt(pd) - CONFIG_KERNEL_VIRTUAL_START;
+}
 
-	tbl = kmemalign(X86_PAGE_SIZE, sizeof(struct entry_table));
-	if (!tbl)
-		return NULL;
+static inline struct entry_table *current_page_dir(void)
+{
+	return (struct entry_table *) ((size_t) get_cr3() +
+		CONFIG_KERNEL_VIRTUAL_START - PD_PAGES * X86_PAGE_SIZE);
+}
+#else
+#define new_page_dir() new_entry_table()
+#define free_page_dir(_pd) free_entry_table(_pd)
 
-	foreach_entry(e, tbl) {
-		*e = 0;
-		entry_set_absent(e);
-	}
+static inline u32 page_dir_cr3(struct entry_table *pd)
+{
+	return (size_t) pd - CONFIG_KERNEL_VIRTUAL_START;
+}
+
+static inline struct entry_table *current_page_dir(void)
+{
+	return (struct entry_table *) ((size_t) get_cr3() +
+				       CONFIG_KERNEL_VIRTUAL_START);
+}
+#endif
 
-	return tbl;
+/*
+ * After fork, the parent and child share user page tables until one of them
+ * writes to (or maps or unmaps in) the 4MB range the table covers. Shared
+ * page directory entries are marked ENTRY_TABLE_SHARED and read-only, so any
+ * write through them faults.
+ *
+ * Every page table lives in a page of its own (see new_entry_table()), so
+ * the number of page directories sharing a table is kept in the reference
+ * count of that page: 1 for the page directory that allocated it, plus one
+ * for every extra page directory pointing at it.
+ */
+static inline struct page *entry_table_page(struct entry_table *tbl)
+{
+	return page_struct((unsigned long) tbl - CONFIG_KERNEL_VIRTUAL_START);
 }
 
-static inline void free_entry_table(struct entry_table *ptr)
+static inline bool entry_table_is_shared(entry_t *pde)
 {
-	kfree(ptr, sizeof(struct entry_table));
+	return (*pde & ENTRY_TABLE_SHARED) != 0;
 }
 
+int unshare_page_table(entry_t *pde);
 
 /*
  * Linear Address translation for 4 KB pages
@@ -296,13 +416,23 @@ static inline void free_entry_table(struct entry_table *ptr)
  *       holds the address of the Page Directory).
  *
  */
+#if CONFIG_X86_PAE
+/*
+ * With PAE, bits 30-31 select the page directory and bits 21-29 the entry
+ * in it. The page directories are contiguous, so bits 21-31 index them as
+ * one. Bits 12-20 select the page table entry.
+ */
+#define PD_OFFSET(la)  (((la) >> 21) & MASK(11))
+#define PT_OFFSET(la)  (((la) >> 12) & MASK(9))
+#else
 #define PD_OFFSET(la)  (((la) >> 22) & MASK(10))
 #define PT_OFFSET(la)  (((la) >> 12) & MASK(10))
+#endif
 #define PHYS_OFFSET(la) ((la) & MASK(12))
 
 static inline entry_t* get_pde(struct entry_table *pd, unsigned long vaddr)
 {
-	return &(pd->entries[PD_OFFSET(vaddr)]);
+	return &pd_entries(pd)[PD_OFFSET(vaddr)];
 }
 
 static inline entry_t* get_pte(struct entry_table *pt, unsigned long vaddr)
@@ -313,8 +443,6 @@ static inline entry_t* get_pte(struct entry_table *pt, unsigned long vaddr)
 #include <kernel/proc.h>
 #define CURRENT_PAGE_DIR (CURRENT_PROCESS)->space.mmu
 
-void __invlpg(unsigned long);
-
-unsigned long to_phys(struct entry_table *page_dir, unsigned long virt);
+phys_addr_t to_phys(struct entry_table *page_dir, unsigned long virt);
 
 #endif /* !__X86_PAGING_H__ */
@@ -46,6 +46,19 @@ void arch_startup(void)
 
 	disable_fpu();
 
+	/*
+	 * Make the kernel honor read-only user pages, so that its own writes
+	 * to user memory (e.g. copying out syscall results) take the same
+	 * copy-on-write and zero page faults that user writes do.
+	 */
+	enable_write_protect();
+
+	/*
+	 * Keep the kernel's mappings (they're marked global) in the TLB when
+	 * cr3 is reloaded on an address space switch.
+	 */
+	enable_global_pages();
+
 	/*
 	 * Install default handlers for all IDT entries so we panic before 
 	 * we triple fault.
@@ -27,7 +27,7 @@ void jump_to_userspace(void)
 
 	set_esp0(KSTACK_TOP);
 
-	regs->cr3 = __phys(CURRENT_PAGE_DIR);
+	regs->cr3 = page_dir_cr3(CURRENT_PAGE_DIR);
 	regs->cr2 = 0;
 	regs->eflags = get_eflags() | 0x200; /* enable interrupts */
 
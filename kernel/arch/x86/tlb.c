@@ -0,0 +1,181 @@
+/**
+ * @file x86/tlb.c
+ *
+ * @brief TLB invalidation (see x86/tlb.h).
+ */
+#include <arch/tlb.h>
+#include <arch/reg.h>
+#include <arch/page.h>
+
+#include <mm/memory.h>
+#include <mm/vm.h>
+
+#include <assert.h>
+#include <math.h>
+
+struct tlb_stats tlb_stats;
+unsigned long tlb_flush_threshold = 32;
+
+void tlb_flush(void)
+{
+	set_cr3(get_cr3());
+	tlb_stats.flushes++;
+}
+
+void tlb_flush_global(void)
+{
+	int32_t cr4 = get_cr4();
+
+	/*
+	 * Turning global pages off and back on drops the global entries as
+	 * well. Without them, reloading cr3 is enough.
+	 */
+	if (cr4 & (1 << CR4_PGE)) {
+		set_cr4(cr4 & ~(1 << CR4_PGE));
+		set_cr4(cr4);
+	}
+	else {
+		set_cr3(get_cr3());
+	}
+
+	tlb_stats.global_flushes++;
+}
+
+void tlb_invalidate(unsigned long addr, size_t size)
+{
+	unsigned long v = FLOOR(X86_PAGE_SIZE, addr);
+	unsigned long end = CEIL(X86_PAGE_SIZE, addr + size);
+
+	if ((end - v) / X86_PAGE_SIZE > tlb_flush_threshold) {
+		/* kernel mappings are global */
+		if (kernel_address(v))
+			tlb_flush_global();
+		else
+			tlb_flush();
+		return;
+	}
+
+	for (; v < end; v += X86_PAGE_SIZE)
+		tlb_invalidate_page(v);
+}
+
+void tlb_batch_add(struct tlb_batch *batch, unsigned long addr, bool global)
+{
+	batch->global |= global;
+
+	if (batch->flush)
+		return;
+
+	if (batch->num_pages == TLB_BATCH_SIZE ||
+	    batch->num_pages >= tlb_flush_threshold) {
+		batch->flush = true;
+		return;
+	}
+
+	batch->pages[batch->num_pages++] = addr;
+}
+
+void tlb_batch_finish(struct tlb_batch *batch)
+{
+	unsigned i;
+
+	if (batch->flush) {
+		if (batch->global)
+			tlb_flush_global();
+		else
+			tlb_flush();
+	}
+	else {
+		for (i = 0; i < batch->num_pages; i++)
+			tlb_invalidate_page(batch->pages[i]);
+	}
+
+	batch->num_pages = 0;
+	batch->flush = false;
+	batch->global = false;
+}
+
+void tlb_dump_stats(printf_f p)
+{
+	p("tlb: %d cr3 loads, %d invlpgs, %d flushes, %d global flushes\n",
+	  tlb_stats.cr3_loads, tlb_stats.invlpgs, tlb_stats.flushes,
+	  tlb_stats.global_flushes);
+}
+
+#include <kernel/test.h>
+#include <kernel/proc.h>
+#include <arch/cpu.h>
+BEGIN_TEST(tlb_bench)
+{
+	static const unsigned long sizes[] = { 8, 200 }; /* in pages */
+	int prot = PROT_READ | PROT_WRITE;
+	int flags = MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS;
+	unsigned long addr = 0x80000000;
+	unsigned long num_pages, off, sum;
+	int32_t cr4 = get_cr4();
+	unsigned i, pass;
+
+	/*
+	 * The cost of touching the kernel after an address space switch, with
+	 * and without global pages.
+	 */
+	num_pages = umin(256, (kdirect_end - kdirect_start) / PAGE_SIZE);
+
+	for (pass = 0; pass < 2; pass++) {
+		u64 start, end;
+
+		set_cr4(pass ? cr4 & ~(1 << CR4_PGE) : cr4);
+
+		sum = 0;
+		for (off = 0; off < num_pages * PAGE_SIZE; off += PAGE_SIZE)
+			sum += kdirect_start[off];
+
+		set_cr3(get_cr3());
+		start = rdtsc();
+		for (off = 0; off < num_pages * PAGE_SIZE; off += PAGE_SIZE)
+			sum += kdirect_start[off];
+		end = rdtsc();
+
+		INFO("switch, %s: %d cycles to touch %d kernel pages (%d)",
+		     pass ? "no global pages" : "global pages",
+		     (unsigned long) (end - start), num_pages, sum);
+	}
+
+	set_cr4(cr4);
+
+	/*
+	 * Small unmaps invalidate page by page, big ones flush once.
+	 */
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		struct tlb_stats before;
+		u64 start, end;
+		int error;
+
+		error = vm_mmap(addr, sizes[i] * PAGE_SIZE, prot, flags, NULL, 0);
+		ASSERT(!(error % PAGE_SIZE));
+
+		for (off = 0; off < sizes[i] * PAGE_SIZE; off += PAGE_SIZE)
+			*((int *) (addr + off)) = 42;
+
+		before = tlb_stats;
+		start = rdtsc();
+		error = vm_munmap(addr, sizes[i] * PAGE_SIZE);
+		end = rdtsc();
+		ASSERT(!error);
+
+		INFO("munmap %d pages: %d cycles, %d invlpgs, %d flushes",
+		     sizes[i], (unsigned long) (end - start),
+		     tlb_stats.invlpgs - before.invlpgs,
+		     tlb_stats.flushes - before.flushes);
+
+		if (sizes[i] <= tlb_flush_threshold) {
+			ASSERT_EQUALS(tlb_stats.invlpgs - before.invlpgs,
+				      sizes[i]);
+		}
+		else {
+			ASSERT_EQUALS(tlb_stats.invlpgs, before.invlpgs);
+			ASSERT_GREATER(tlb_stats.flushes, before.flushes);
+		}
+	}
+}
+END_TEST
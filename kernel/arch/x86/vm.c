@@ -8,6 +8,7 @@
 #include <arch/page.h>
 #include <arch/reg.h>
 #include <arch/cpu.h>
+#include <arch/irq.h>
 
 #include <mm/kmalloc.h>
 
@@ -16,12 +17,214 @@
 #include <mm/pages.h>
 
 #include <stddef.h>
+#include <string.h>
 #include <assert.h>
 #include <errno.h>
 
-static inline bool is_page_aligned(unsigned long addr)
+/*
+ * Page tables (and page directories) come straight from the page allocator,
+ * a page each, and are reached through kdirect. Fork and exit go through a
+ * lot of them, so each cpu keeps a quicklist of up to PT_QUICKLIST_HIGH
+ * freed tables that have already been zeroed, ready to be handed out again.
+ * The lists are given back to the page allocator when memory runs low.
+ */
+#define PT_QUICKLIST_HIGH 64
+
+struct pt_quicklist {
+	page_list_t list;
+	unsigned long allocs;    /* tables handed out */
+	unsigned long hits;      /* ... of which came off the list */
+	unsigned long frees;     /* tables given back */
+};
+
+static struct pt_quicklist pt_quicklists[CONFIG_NR_CPUS];
+
+/*
+ * Until vm_init() has mapped kdirect, the early heap is all there is, so the
+ * kernel's own first tables come from it. Those are never freed.
+ */
+static bool pt_early = true;
+
+/* the inverse of entry_table_page() */
+#define entry_table_address(_page) \
+	((struct entry_table *) ((size_t) page_address(_page) + \
+				 CONFIG_KERNEL_VIRTUAL_START))
+
+/**
+ * @brief Allocate n zeroed, physically contiguous pages for tables.
+ */
+static struct entry_table *alloc_table_pages(unsigned long n)
 {
-	return FLOOR(X86_PAGE_SIZE, addr) == addr;
+	struct entry_table *tbl;
+	struct page *pages;
+
+	if (pt_early) {
+		tbl = kmemalign(X86_PAGE_SIZE, n * X86_PAGE_SIZE);
+	}
+	else {
+		pages = alloc_zone_pages(ZONE_NORMAL, n);
+		tbl = pages ? entry_table_address(pages) : NULL;
+	}
+
+	/*
+	 * An all zero entry is absent.
+	 */
+	if (tbl)
+		bzero(tbl, n * X86_PAGE_SIZE);
+
+	return tbl;
+}
+
+struct entry_table *new_entry_table(void)
+{
+	struct pt_quicklist *ql;
+	struct page *page = NULL;
+	unsigned long flags;
+
+	disable_save_irqs(&flags);
+
+	ql = &pt_quicklists[cpu_id()];
+	ql->allocs++;
+
+	if (!list_empty(&ql->list)) {
+		page = list_head(&ql->list);
+		list_remove(&ql->list, page, free_link);
+		ql->hits++;
+	}
+
+	restore_irqs(flags);
+
+	if (page)
+		return entry_table_address(page);
+
+	return alloc_table_pages(1);
+}
+
+void free_entry_table(struct entry_table *tbl)
+{
+	struct page *page = entry_table_page(tbl);
+	struct pt_quicklist *ql;
+	unsigned long flags;
+	bool full;
+
+	ASSERT_EQUALS(page->count, 1);
+
+	disable_save_irqs(&flags);
+	ql = &pt_quicklists[cpu_id()];
+	ql->frees++;
+	full = list_size(&ql->list) >= PT_QUICKLIST_HIGH;
+	restore_irqs(flags);
+
+	if (full) {
+		free_page(page);
+		return;
+	}
+
+	/*
+	 * Zero the table while it's still in the cache from being torn down.
+	 */
+	bzero(tbl, sizeof(struct entry_table));
+
+	disable_save_irqs(&flags);
+	list_insert_head(&pt_quicklists[cpu_id()].list, page, free_link);
+	restore_irqs(flags);
+}
+
+/**
+ * @brief Give every quicklist back to the page allocator.
+ */
+static unsigned long pt_quicklist_shrink(void)
+{
+	unsigned long freed = 0;
+	unsigned long flags;
+	int cpu;
+
+	for (cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+		struct pt_quicklist *ql = &pt_quicklists[cpu];
+
+		disable_save_irqs(&flags);
+
+		while (!list_empty(&ql->list)) {
+			struct page *page = list_head(&ql->list);
+
+			list_remove(&ql->list, page, free_link);
+			free_page(page);
+			freed++;
+		}
+
+		restore_irqs(flags);
+	}
+
+	return freed;
+}
+
+static struct page_shrinker pt_quicklist_shrinker = {
+	.name = "pt_quicklist",
+	.shrink = pt_quicklist_shrink,
+};
+
+#if CONFIG_X86_PAE
+struct entry_table *new_page_dir(void)
+{
+	struct entry_table *pd;
+	unsigned i;
+
+	/*
+	 * The page directory pointer table takes a page of its own, after
+	 * the page directories.
+	 */
+	pd = alloc_table_pages(PD_PAGES + 1);
+	if (!pd)
+		return NULL;
+
+	/*
+	 * Page directory pointer table entries only have the present bit
+	 * (and caching bits) set. They're read when cr3 is loaded and never
+	 * change afterwards.
+	 */
+	for (i = 0; i < PD_PAGES; i++)
+		pd_pdpt(pd)[i] = ((size_t) pd - CONFIG_KERNEL_VIRTUAL_START +
+				  i * X86_PAGE_SIZE) | (1 << ENTRY_PRESENT);
+
+	return pd;
+}
+
+void free_page_dir(struct entry_table *pd)
+{
+	free_pages(entry_table_page(pd), PD_PAGES + 1);
+}
+#endif
+
+void mmu_init(void)
+{
+	/*
+	 * kdirect is mapped now, so tables can come from anywhere in it.
+	 */
+	pt_early = false;
+	register_page_shrinker(&pt_quicklist_shrinker);
+}
+
+void page_tables_dump(printf_f p)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+		struct pt_quicklist *ql = &pt_quicklists[cpu];
+
+		p("page tables: cpu %d: %d allocs (%d quicklist hits), "
+		  "%d frees, %d cached\n", cpu, ql->allocs, ql->hits,
+		  ql->frees, list_size(&ql->list));
+	}
+}
+
+static inline bool is_page_aligned(phys_addr_t addr)
+{
+	return !(addr & (X86_PAGE_SIZE - 1));
+}
+
+static inline bool is_large_page_aligned(phys_addr_t addr)
+{
+	return !(addr & (X86_LARGE_PAGE_SIZE - 1));
 }
 
 static inline bool is_kernel_entry(entry_t *e)
@@ -39,7 +242,7 @@ void *new_address_space(void)
 {
 	struct entry_table *page_directory;
 
-	page_directory = new_entry_table();
+	page_directory = new_page_dir();
 	if (!page_directory) {
 		return NULL;
 	}
@@ -49,10 +252,149 @@ void *new_address_space(void)
 
 static inline void free_page_table_pde(entry_t *pde)
 {
+	struct entry_table *pt = entry_pt(pde);
+
 	ASSERT(entry_is_present(pde));
 	ASSERT(!is_kernel_entry(pde));
+	ASSERT(!entry_is_large(pde));
 
-	free_entry_table(entry_pt(pde));
+	/*
+	 * Somebody else still uses a shared page table, just drop our
+	 * reference to it.
+	 */
+	if (entry_table_is_shared(pde) && entry_table_page(pt)->count > 1) {
+		atomic_dec(&entry_table_page(pt)->count);
+		return;
+	}
+
+	free_entry_table(pt);
+}
+
+/**
+ * @brief Give the page directory entry a page table of its own, if the one
+ * it points to is shared, and make the entry writable again.
+ *
+ * If the table is still shared, it is copied and every page it maps gets a
+ * new reference. Those pages are marked read-only in both tables so the
+ * copy-on-write fault handles any writes to them.
+ *
+ * @return 0 on success, ENOMEM if the copy could not be allocated.
+ */
+int unshare_page_table(entry_t *pde)
+{
+	struct entry_table *shared = entry_pt(pde);
+	struct page *pt_page = entry_table_page(shared);
+
+	ASSERT(entry_table_is_shared(pde));
+
+	if (pt_page->count > 1) {
+		struct entry_table *copy;
+		unsigned i;
+
+		copy = new_entry_table();
+		if (!copy)
+			return ENOMEM;
+
+		for (i = 0; i < ENTRY_TABLE_SIZE; i++) {
+			entry_t *from = shared->entries + i;
+			entry_t *to = copy->entries + i;
+
+			if (!entry_is_present(from))
+				continue;
+
+			page_get(page_struct(entry_phys(from)));
+			entry_set_readonly(from);
+			*to = *from;
+		}
+
+		entry_set_addr(pde, __phys(copy));
+		atomic_dec(&pt_page->count);
+	}
+
+	*pde &= ~ENTRY_TABLE_SHARED;
+	entry_set_readwrite(pde);
+
+	tlb_flush();
+
+	return 0;
+}
+
+/*
+ * The flags of a large page directory entry that mean the same thing in a
+ * page table entry: present, read/write, user, write-through, cache
+ * disable, accessed, dirty and global.
+ */
+#define LARGE_PTE_FLAGS (MASK(7) | (1 << ENTRY_GLOBAL))
+
+/**
+ * @brief Replace the large page mapped by a page directory entry with a page
+ * table mapping the same memory with 4KB pages, with the same access
+ * rights. Each 4KB page already has a reference of its own (see
+ * mmu_map_range()), so nothing else has to change.
+ *
+ * @return 0 on success, ENOMEM if the page table could not be allocated.
+ */
+static int split_large_page(entry_t *pde)
+{
+	phys_addr_t phys = entry_large_phys(pde);
+	entry_t flags = *pde & LARGE_PTE_FLAGS;
+	struct entry_table *pt;
+	entry_t *pte;
+
+	ASSERT(entry_is_large(pde));
+	ASSERT(!is_kernel_entry(pde));
+
+	pt = new_entry_table();
+	if (!pt)
+		return ENOMEM;
+
+	foreach_entry(pte, pt) {
+		*pte = phys | flags;
+		phys += X86_PAGE_SIZE;
+	}
+
+	/*
+	 * Access is controlled by the page table entries from now on.
+	 */
+	entry_clear_large(pde);
+	entry_set_addr(pde, __phys(pt));
+	entry_set_readwrite(pde);
+
+	tlb_flush();
+
+	return 0;
+}
+
+/**
+ * @brief Drop this page directory's references to all the page tables it
+ * shares with other address spaces, leaving those entries unmapped. Used
+ * when tearing down an address space, so exiting right after a fork doesn't
+ * have to copy every page table just to empty it.
+ */
+void release_shared_page_tables(void *mmu)
+{
+	struct entry_table *pd = mmu;
+	entry_t *pde;
+
+	foreach_pde(pde, pd) {
+		struct page *pt_page;
+
+		if (is_kernel_entry(pde) || !entry_is_present(pde))
+			continue;
+
+		if (!entry_table_is_shared(pde))
+			continue;
+
+		pt_page = entry_table_page(entry_pt(pde));
+		if (pt_page->count == 1)
+			continue;
+
+		atomic_dec(&pt_page->count);
+		*pde = 0;
+	}
+
+	if (pd == current_page_dir())
+		tlb_flush();
 }
 
 void free_address_space(void *mmu)
@@ -61,9 +403,9 @@ void free_address_space(void *mmu)
 	entry_t *pde;
 
 	/* should not be destroying the page tables while they are in use */
-	ASSERT_NOTEQUALS(page_directory, get_cr3());
+	ASSERT_NOTEQUALS(page_directory, current_page_dir());
 
-	foreach_entry(pde, page_directory) {
+	foreach_pde(pde, page_directory) {
 		/* don't free kernel page tables */
 		if (is_kernel_entry(pde))
 			continue;
@@ -72,7 +414,7 @@ void free_address_space(void *mmu)
 			free_page_table_pde(pde);
 	}
 
-	free_entry_table(page_directory);
+	free_page_dir(page_directory);
 }
 
 /**
@@ -107,13 +449,13 @@ void entry_set_flags(entry_t *entry, int flags)
  * @brief Convert a virtual address to the physical address it is mapped
  * to.
  */
-unsigned long to_phys(struct entry_table *pd, unsigned long virt)
+phys_addr_t to_phys(struct entry_table *pd, unsigned long virt)
 {
 	if (kernel_address(virt)) {
 		return virt - CONFIG_KERNEL_VIRTUAL_START;
 	}
 	else {
-#define VIRT_NOT_MAPPED ((unsigned long) -1)
+#define VIRT_NOT_MAPPED ((phys_addr_t) -1)
 		struct entry_table *pt;
 		entry_t *pde, *pte;
 
@@ -123,6 +465,11 @@ unsigned long to_phys(struct entry_table *pd, unsigned long virt)
 			return VIRT_NOT_MAPPED;
 		}
 
+		if (entry_is_large(pde)) {
+			return entry_large_phys(pde) +
+			       (virt & ~ENTRY_LARGE_ADDR_MASK);
+		}
+
 		pt = entry_pt(pde);
 		pte = get_pte(pt, virt);
 
@@ -134,115 +481,244 @@ unsigned long to_phys(struct entry_table *pd, unsigned long virt)
 	}
 }
 
+struct unmap_state {
+	mmu_unmap_f put;
+	void *arg;
+	unsigned long unmapped;
+	struct tlb_batch *tlb;  /* NULL unless the page directory is in use */
+};
+
 /**
- * @brief Free the empty page tables referenced by the page directory. Only
- * look at PDEs marked with ENTRY_TABLE_UNMAP to check if empty.
+ * @brief The end of the page table covering virt, clamped to end.
  */
-void free_marked_page_tables(struct entry_table *pd)
+static inline unsigned long page_table_end(unsigned long virt,
+					   unsigned long end)
 {
-	entry_t *pde, *pte;
+	unsigned long next = FLOOR(X86_LARGE_PAGE_SIZE, virt) +
+			     X86_LARGE_PAGE_SIZE;
 
-	foreach_entry(pde, pd) {
+	/* next wraps to 0 in the last page table */
+	return (next - 1 < end - 1) ? next : end;
+}
 
-		/*
-		 * if we marked the page _directory_ entry, then we need to
-		 * check if the corresponding page table is empty, and if so
-		 * free it.
-		 */
-		if (entry_is_present(pde) && (*pde & ENTRY_TABLE_UNMAP)) {
-			struct entry_table *pt = entry_pt(pde);
-			bool page_table_empty = true;
-
-			foreach_entry(pte, pt) {
-				if (entry_is_present(pte)) {
-					page_table_empty = false;
-					break;
-				}
-			}
+static bool page_table_empty(struct entry_table *pt)
+{
+	entry_t *pte;
 
-			if (page_table_empty) {
-				free_page_table_pde(pde);
-				entry_set_absent(pde);
-			}
+	foreach_entry(pte, pt) {
+		if (entry_is_present(pte))
+			return false;
+	}
 
-			*pde &= ~ENTRY_TABLE_UNMAP;
-		}
+	return true;
+}
+
+static void unmap_pte(entry_t *pte, unsigned long virt, struct unmap_state *s)
+{
+	entry_set_absent(pte);
+
+	if (s->tlb)
+		tlb_batch_add(s->tlb, virt, entry_is_global(pte));
+
+	s->unmapped++;
+
+	if (s->put)
+		s->put(page_struct(entry_phys(pte)), virt, s->arg);
+}
+
+/**
+ * @brief Unmap a whole large page, handing each of its 4KB pages to the
+ * callback. A single invlpg drops the large page from the TLB.
+ */
+static void unmap_large_page(entry_t *pde, unsigned long virt,
+			     struct unmap_state *s)
+{
+	phys_addr_t phys = entry_large_phys(pde);
+	unsigned i;
+
+	if (s->tlb)
+		tlb_batch_add(s->tlb, virt, entry_is_global(pde));
+
+	*pde = 0;
+
+	s->unmapped += ENTRY_TABLE_SIZE;
+
+	if (!s->put)
+		return;
+
+	for (i = 0; i < ENTRY_TABLE_SIZE; i++) {
+		s->put(page_struct(phys), virt, s->arg);
+		phys += X86_PAGE_SIZE;
+		virt += X86_PAGE_SIZE;
 	}
 }
 
-struct page *unmap_page_pde(entry_t *pde, unsigned long virt)
+/**
+ * @brief Unmap [start, end), which lies within the page table of a single
+ * page directory entry, and free the page table if that leaves it empty.
+ */
+static void unmap_page_table(entry_t *pde, unsigned long start,
+			     unsigned long end, struct unmap_state *s)
 {
+	struct entry_table *pt;
+	unsigned long virt;
 	entry_t *pte;
 
-	/*
-	 * Mark the page _directory_ entry so we know that we unmapped a page
-	 * in this page table and we can free it later (if it's empty). Don't
-	 * mark the page directory entry if it global though because it is
-	 * being shared with other processes.
-	 */
-	*pde |= ENTRY_TABLE_UNMAP;
+	if (entry_is_large(pde)) {
+		if (end - start == X86_LARGE_PAGE_SIZE) {
+			unmap_large_page(pde, start, s);
+			return;
+		}
 
-	pte = get_pte(entry_pt(pde), virt);
+		if (split_large_page(pde)) {
+			WARN("Out of memory splitting the large page at 0x%08x",
+			     FLOOR(X86_LARGE_PAGE_SIZE, start));
+			return;
+		}
+	}
+
+	pt = entry_pt(pde);
 
 	/*
-	 * This page wasn't mapped in the first place. Return NULL to indicate
-	 * no page was unmapped.
+	 * Unmapping all of a page table that's still shared since a fork
+	 * doesn't need a copy of it: every page it maps gets a reference of
+	 * its own, to stand in for ours until the callback drops it, and the
+	 * table is left to the other address spaces.
 	 */
-	if (!entry_is_present(pte)) {
-		ERROR("Trying to unmap page that was never mapped. virt 0x%lx, pte 0x%lx",
-		      virt, pte);
-		return NULL;
+	if (entry_table_is_shared(pde) && entry_table_page(pt)->count > 1 &&
+	    start == FLOOR(X86_LARGE_PAGE_SIZE, start) &&
+	    end - start == X86_LARGE_PAGE_SIZE) {
+		for (virt = start; virt != end; virt += X86_PAGE_SIZE) {
+			pte = get_pte(pt, virt);
+			if (!entry_is_present(pte))
+				continue;
+
+			page_get(page_struct(entry_phys(pte)));
+			s->unmapped++;
+			if (s->put)
+				s->put(page_struct(entry_phys(pte)), virt,
+				       s->arg);
+		}
+
+		atomic_dec(&entry_table_page(pt)->count);
+		*pde = 0;
+		if (s->tlb)
+			tlb_batch_flush(s->tlb, false);
+		return;
+	}
+
+	if (entry_table_is_shared(pde) && unshare_page_table(pde)) {
+		WARN("Out of memory unsharing the page table for 0x%08x",
+		     start);
+		return;
+	}
+
+	pt = entry_pt(pde);
+
+	for (virt = start; virt != end; virt += X86_PAGE_SIZE) {
+		pte = get_pte(pt, virt);
+		if (entry_is_present(pte))
+			unmap_pte(pte, virt, s);
 	}
 
 	/*
-	 * Mark the page _table_ entry as not present, effectively unmapping
-	 * the page.
+	 * The kernel's page tables are copied into every address space, so
+	 * they're never freed.
 	 */
-	entry_set_absent(pte);
+	if (!is_kernel_entry(pde) && page_table_empty(pt)) {
+		free_page_table_pde(pde);
+		*pde = 0;
+	}
+}
+
+static unsigned long unmap_range(struct entry_table *pd, unsigned long start,
+				 unsigned long end, mmu_unmap_f put, void *arg,
+				 bool invalidate)
+{
+	struct tlb_batch tlb = INITIALIZED_TLB_BATCH;
+	struct unmap_state s = {
+		.put = put,
+		.arg = arg,
+		.unmapped = 0,
+		.tlb = invalidate ? &tlb : NULL,
+	};
+	unsigned long virt, next;
+
+	for (virt = start; virt != end; virt = next) {
+		entry_t *pde = get_pde(pd, virt);
 
-	return page_struct(entry_phys(pte));
+		next = page_table_end(virt, end);
+
+		if (entry_is_present(pde))
+			unmap_page_table(pde, virt, next, &s);
+	}
+
+	if (invalidate)
+		tlb_batch_finish(&tlb);
+
+	return s.unmapped;
 }
 
-struct page *mmu_unmap_page(void *pd, unsigned long virt)
+/**
+ * @brief Unmap every page in [start, end), walking each page table once.
+ *
+ * put is called for every page that was mapped, with the virtual address
+ * it was mapped at. Page tables left empty are freed. If pd is the page
+ * directory in use, the unmapped pages are invalidated in the TLB: one by
+ * one for small ranges, with a single flush for large ones.
+ *
+ * put may free the page before the TLB is flushed. That's safe, since
+ * nothing can go through the stale entries before we return, and switching
+ * to another address space flushes them anyway.
+ *
+ * @return The number of pages that were unmapped.
+ */
+unsigned long mmu_unmap_range(void *pd, unsigned long start, unsigned long end,
+			      mmu_unmap_f put, void *arg)
 {
-	struct page *page = NULL;
-	entry_t *pde;
-	int i;
+	TRACE("pd=%p, start=0x%x, end=0x%x", pd, start, end);
 
-	TRACE("pd=%p, virt=0x%x", pd, virt);
+	ASSERT(is_page_aligned(start) && is_page_aligned(end));
 
-	for (i = 0; i < PAGE_SIZE / X86_PAGE_SIZE; i++) {
-		virt += i * X86_PAGE_SIZE;
+	return unmap_range(pd, start, end, put, arg,
+			   pd == (void *) current_page_dir());
+}
 
-		pde = get_pde(pd, virt);
+static void unmap_page_put(struct page *page, unsigned long virt, void *arg)
+{
+	(void) virt;
+	*(struct page **) arg = page;
+}
 
-		if (!entry_is_present(pde))
-			continue;
+struct page *mmu_unmap_page(void *pd, unsigned long virt)
+{
+	struct page *page = NULL;
 
-		if (!page)
-			page = unmap_page_pde(pde, virt);
-	}
+	TRACE("pd=%p, virt=0x%x", pd, virt);
 
-	free_marked_page_tables(pd);
+	/*
+	 * The callers invalidate the page themselves.
+	 */
+	if (!unmap_range(pd, virt, virt + PAGE_SIZE, unmap_page_put, &page,
+			 false))
+		ERROR("Trying to unmap page that was never mapped. virt 0x%lx",
+		      virt);
 
 	return page;
 }
 
 /**
- * @brief Maps virt to phys with the given flags.
+ * @brief Find the page table for virt, creating it if there isn't one yet,
+ * splitting a large page into one and unsharing it if it's still shared since
+ * a fork.
  *
- * @return
- *    0 on success, non-0 if the mapping could not be completed.
- *
- *    ENOMEM if mapping this page requires allocating a new page
- *      table data structure and the system has run out of available
- *      memory.
+ * @return NULL if out of memory.
  */
-static int map(struct entry_table *pd, unsigned long virt,
-	       unsigned long phys, int flags)
+static struct entry_table *map_page_table(struct entry_table *pd,
+					  unsigned long virt, int flags)
 {
 	struct entry_table *pt;
-	entry_t *pde, *pte;
+	entry_t *pde;
 
 	pde = get_pde(pd, virt);
 
@@ -253,16 +729,51 @@ static int map(struct entry_table *pd, unsigned long virt,
 	if (!entry_is_present(pde)) {
 		pt = new_entry_table();
 		if (!pt) {
-			return ENOMEM;
+			return NULL;
 		}
 
+		/*
+		 * Access is controlled by the page table entries. The page
+		 * directory entry has to allow writes, since other mappings
+		 * in the same 4MB may be writable.
+		 */
 		entry_set_addr(pde, __phys(pt));
-		entry_set_flags(pde, flags | VM_P);
+		entry_set_flags(pde, flags | VM_P | VM_W);
+	}
+	else if (entry_is_large(pde)) {
+		if (split_large_page(pde))
+			return NULL;
+	}
+	else if (entry_table_is_shared(pde)) {
+		if (unshare_page_table(pde))
+			return NULL;
 	}
 
-	pt = (struct entry_table *) entry_get_addr(pde);
 	ASSERT(entry_is_present(pde));
 
+	return entry_pt(pde);
+}
+
+/**
+ * @brief Maps virt to phys with the given flags.
+ *
+ * @return
+ *    0 on success, non-0 if the mapping could not be completed.
+ *
+ *    ENOMEM if mapping this page requires allocating a new page
+ *      table data structure and the system has run out of available
+ *      memory.
+ */
+static int map(struct entry_table *pd, unsigned long virt,
+	       phys_addr_t phys, int flags)
+{
+	struct entry_table *pt;
+	entry_t *pte;
+
+	pt = map_page_table(pd, virt, flags);
+	if (!pt)
+		return ENOMEM;
+
 	/*
 	 * Write the physical address into the page table entry for the given
 	 * virtual address we are mapping.
@@ -285,7 +796,7 @@ int __map_page(struct entry_table *pd, unsigned long virt,
 	 */
 	for (i = 0; i < PAGE_SIZE / X86_PAGE_SIZE; i++) {
 		unsigned long v = virt + (i * X86_PAGE_SIZE);
-		unsigned long p = page_address(page) + (i * X86_PAGE_SIZE);
+		phys_addr_t p = page_address(page) + (i * X86_PAGE_SIZE);
 		int ret;
 
 		ret = map(pd, v, p, flags);
@@ -316,6 +827,169 @@ int mmu_map_page(void *pd, unsigned long virt, struct page *page, int flags)
 	return __map_page((struct entry_table *) pd, virt, page, flags);
 }
 
+/**
+ * @brief Map the physically contiguous memory starting at phys to
+ * [virt, virt + size), walking each page table once. Nothing is
+ * invalidated in the TLB; the range is expected to be unmapped.
+ *
+ * Every large page of the range that is aligned both virtually and
+ * physically, and has nothing mapped yet, is mapped with a single page
+ * directory entry (4MB, or 2MB with PAE). The 4KB pages making it up keep
+ * their own reference counts, so it can be split back into a page table at
+ * any time.
+ *
+ * @return 0 on success, ENOMEM if out of memory, in which case nothing
+ * is left mapped.
+ */
+int mmu_map_range(void *pd, unsigned long virt, phys_addr_t phys,
+		  unsigned long size, int flags)
+{
+	unsigned long start = virt, end = virt + size, next;
+
+	TRACE("pd=%p, virt=0x%x, phys=0x%llx, size=0x%x", pd, virt, (u64) phys,
+	      size);
+
+	ASSERT(is_page_aligned(virt) && is_page_aligned(phys) &&
+	       is_page_aligned(size));
+
+	for (; virt != end; virt = next) {
+		entry_t *pde = get_pde(pd, virt);
+		struct entry_table *pt;
+
+		next = page_table_end(virt, end);
+
+		if (next - virt == X86_LARGE_PAGE_SIZE &&
+		    is_large_page_aligned(virt) && is_large_page_aligned(phys) &&
+		    !entry_is_present(pde)) {
+			entry_set_addr(pde, phys);
+			entry_set_flags(pde, flags);
+			entry_set_large(pde);
+			phys += X86_LARGE_PAGE_SIZE;
+			continue;
+		}
+
+		pt = map_page_table(pd, virt, flags);
+		if (!pt) {
+			unmap_range(pd, start, virt, NULL, NULL, false);
+			return ENOMEM;
+		}
+
+		for (; virt != next; virt += X86_PAGE_SIZE) {
+			entry_t *pte = get_pte(pt, virt);
+
+			entry_set_addr(pte, phys);
+			entry_set_flags(pte, flags);
+			phys += X86_PAGE_SIZE;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Map a page from get() at every page of [start, end) that isn't
+ * mapped yet, walking each page table once. Nothing is invalidated in the
+ * TLB.
+ *
+ * @return 0 on success, ENOMEM if out of memory. The pages mapped before
+ * running out stay mapped.
+ */
+int mmu_populate_range(void *pd, unsigned long start, unsigned long end,
+		       int flags, mmu_populate_f get, void *arg)
+{
+	unsigned long virt, next;
+
+	TRACE("pd=%p, start=0x%x, end=0x%x", pd, start, end);
+
+	ASSERT(is_page_aligned(start) && is_page_aligned(end));
+
+	for (virt = start; virt != end; virt = next) {
+		struct entry_table *pt;
+
+		next = page_table_end(virt, end);
+
+		/* a large page leaves nothing to fill in */
+		if (entry_is_large(get_pde(pd, virt)))
+			continue;
+
+		pt = map_page_table(pd, virt, flags);
+		if (!pt)
+			return ENOMEM;
+
+		for (; virt != next; virt += PAGE_SIZE) {
+			struct page *page;
+			unsigned i;
+
+			if (entry_is_present(get_pte(pt, virt)))
+				continue;
+
+			page = get(virt, arg);
+			if (!page)
+				return ENOMEM;
+
+			for (i = 0; i < PAGE_SIZE / X86_PAGE_SIZE; i++) {
+				unsigned long v = virt + (i * X86_PAGE_SIZE);
+				entry_t *pte = get_pte(pt, v);
+
+				entry_set_addr(pte, page_address(page) +
+					       (i * X86_PAGE_SIZE));
+				entry_set_flags(pte, flags);
+			}
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Check whether nothing is mapped in the large page containing
+ * virt, so mmu_map_range() would map it with a large page.
+ */
+bool mmu_large_page_fits(void *pd, unsigned long virt)
+{
+	return !entry_is_present(get_pde(pd, virt));
+}
+
+bool mmu_page_mapped(void *pd, unsigned long virt)
+{
+	return to_phys(pd, virt) != (phys_addr_t) -1;
+}
+
+/**
+ * @brief Create the page tables for the kernel addresses [start, end) in
+ * advance. Every address space copies the kernel's page directory entries
+ * when it's created, so pages mapped here later show up in all of them.
+ *
+ * The page directory entries are marked global, so the page tables are
+ * never freed when they become empty.
+ *
+ * @return 0 on success, ENOMEM if out of memory.
+ */
+int mmu_alloc_page_tables(void *pd, unsigned long start, unsigned long end)
+{
+	unsigned long virt;
+
+	ASSERT(kernel_address(start) && kernel_address(end - 1));
+
+	for (virt = FLOOR(X86_PAGE_SIZE * ENTRY_TABLE_SIZE, start); virt < end;
+	     virt += X86_PAGE_SIZE * ENTRY_TABLE_SIZE) {
+		entry_t *pde = get_pde(pd, virt);
+		struct entry_table *pt;
+
+		if (entry_is_present(pde))
+			continue;
+
+		pt = new_entry_table();
+		if (!pt)
+			return ENOMEM;
+
+		entry_set_addr(pde, __phys(pt));
+		entry_set_flags(pde, VM_P | VM_S | VM_W | VM_G);
+	}
+
+	return 0;
+}
+
 /**
  * @brief This is the main page fault handling routine for arch/x86.
  * It's job is to parse the architecture generated exception and pass
@@ -335,6 +1009,20 @@ void page_fault(int vector, int error, struct registers *regs)
 	if (error & 4) flags |= PF_USER;
 	else           flags |= PF_SUPERVISOR;
 
+	/*
+	 * A write to a 4MB range whose page table is still shared since the
+	 * last fork. Give this address space its own page table and retry;
+	 * if the page itself is copy-on-write we'll fault again for that.
+	 */
+	if ((flags & PF_PRESENT) && (flags & PF_WRITE) &&
+	    !kernel_address(regs->cr2)) {
+		entry_t *pde = get_pde(CURRENT_PAGE_DIR, regs->cr2);
+
+		if (entry_is_present(pde) && entry_table_is_shared(pde) &&
+		    !unshare_page_table(pde))
+			return;
+	}
+
 	ret = vm_page_fault(regs->cr2, flags);
 
 	if (ret) {
@@ -342,3 +1030,36 @@ void page_fault(int vector, int error, struct registers *regs)
 		exn_panic(vector, error, regs);
 	}
 }
+
+#include <kernel/test.h>
+BEGIN_TEST(pt_quicklist_test)
+{
+	struct pt_quicklist *ql = &pt_quicklists[cpu_id()];
+	struct entry_table *tbl, *again;
+	unsigned long hits;
+	entry_t *e;
+
+	tbl = new_entry_table();
+	ASSERT_NOT_NULL(tbl);
+
+	foreach_entry(e, tbl)
+		*e = (entry_t) -1;
+
+	/*
+	 * Unless the list was full, the freed table comes straight back,
+	 * zeroed.
+	 */
+	hits = ql->hits;
+	free_entry_table(tbl);
+	again = new_entry_table();
+	ASSERT_NOT_NULL(again);
+
+	if (ql->hits != hits)
+		ASSERT_EQUALS(again, tbl);
+
+	foreach_entry(e, again)
+		ASSERT_EQUALS(*e, 0);
+
+	free_entry_table(again);
+}
+END_TEST
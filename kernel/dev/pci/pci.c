@@ -11,6 +11,7 @@
 #include <types.h>
 #include <stddef.h>
 #include <mm/memory.h>
+#include <mm/pages.h>
 #include <assert.h>
 
 struct pci_bus *__pci_root;
@@ -171,17 +172,23 @@ void pci_device_config_readall(struct pci_device *d)
  */
 int pci_init_bm(struct pci_bus_master *bm, unsigned io)
 {
+	struct page *page;
+
 	bm->cmd = io + PCI_BM_CMD;
 	bm->status = io + PCI_BM_STATUS;
 	bm->prdtreg = io + PCI_BM_PDTABLE;
 
 	/*
 	 * We give the prdt a memory page, aligned to a memory page so that
-	 * we do no cross a 64 KB boundary (64 KB is page aligned).
+	 * we do no cross a 64 KB boundary (64 KB is page aligned). It comes
+	 * from the DMA zone so that ISA-limited controllers can reach it.
 	 */
 	ASSERT(IS_PAGE_ALIGNED(KB(64)));
-	bm->prdt = (prdt_addr_t) kmemalign(PAGE_SIZE, PAGE_SIZE);
-	if (!bm->prdt) return ENOMEM;
+	page = alloc_dma_pages(1);
+	if (!page) return ENOMEM;
+
+	bm->prdt = (prdt_addr_t) (page_address(page) +
+				  CONFIG_KERNEL_VIRTUAL_START);
 
 	return 0;
 }
@@ -192,7 +199,7 @@ int pci_init_bm(struct pci_bus_master *bm, unsigned io)
  */
 void pci_destroy_bm(struct pci_bus_master *bm)
 {
-	kfree((void *) bm->prdt, PAGE_SIZE);
+	free_page(page_struct(bm->prdt - CONFIG_KERNEL_VIRTUAL_START));
 }
 
 /******************************************************************************
@@ -5,6 +5,8 @@
 #include <fs/initrd.h>
 #include <fs/vfs.h>
 #include <mm/kmalloc.h>
+#include <mm/memory.h>
+#include <mm/pages.h>
 
 #include <errno.h>
 #include <string.h>
@@ -84,6 +86,36 @@ ssize_t initrd_read(struct vfs_file *file, char *buf, size_t size,
 	return bytes;
 }
 
+/**
+ * @brief The ramdisk is in memory for good, so page-aligned file data can
+ * be mapped from where it is (see tools/create_initrd.c).
+ *
+ * Only whole pages of a file are mapped: the rest of the last, partial
+ * page holds whatever follows the file in the ramdisk, rather than zeros.
+ */
+struct page *initrd_get_page(struct vfs_file *file, size_t off)
+{
+	struct initrd_file *ramfile = (struct initrd_file *)
+		file->dirent->inode->object;
+	size_t data = initrd_location + ramfile->data + off;
+	struct page *page;
+
+	TRACE("file=%p, off=0x%x", file, off);
+
+	if (data % PAGE_SIZE || off >= ramfile->length ||
+	    ramfile->length - off < PAGE_SIZE)
+		return NULL;
+
+	/*
+	 * The ramdisk's pages were taken out of the page allocator with the
+	 * kernel image, and are never freed.
+	 */
+	page = page_struct(data - CONFIG_KERNEL_VIRTUAL_START);
+	page_get(page);
+
+	return page;
+}
+
 struct vfs_dirent *initrd_readdir(struct vfs_file *f, unsigned int index)
 {
 	ASSERT(dirent_isdir(f->dirent));
@@ -103,6 +135,7 @@ static void initrd_init_fops(void)
 	initrd_fops.read    = initrd_read;
 	initrd_fops.write   = NULL;
 	initrd_fops.readdir = NULL;
+	initrd_fops.get_page = initrd_get_page;
 
 	memset(&initrd_root_fops, 0, sizeof(struct vfs_file_ops));
 	initrd_root_fops.open    = initrd_open;
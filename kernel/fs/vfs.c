@@ -7,6 +7,7 @@
 
 #include <mm/memory.h>
 #include <mm/kmalloc.h>
+#include <mm/slab.h>
 
 #include <arch/atomic.h>
 
@@ -159,6 +160,9 @@ void vfs_put_dirent(struct vfs_dirent *d)
  *    A pointer to the allocated file on success
  *    NULL on error
  */
+static struct kmem_cache vfs_file_cache =
+	INITIALIZED_KMEM_CACHE("vfs_file", sizeof(struct vfs_file), 0, NULL);
+
 struct vfs_file *new_vfs_file_from_path(char *path)
 {
 	struct vfs_dirent *dirent;
@@ -168,7 +172,7 @@ struct vfs_file *new_vfs_file_from_path(char *path)
 	if (!dirent)
 		return NULL;
 
-	file = kmalloc(sizeof(struct vfs_file));
+	file = kmem_cache_alloc(&vfs_file_cache);
 	if (!file) {
 		vfs_put_dirent(dirent);
 		return NULL;
@@ -187,7 +191,10 @@ void vfs_file_destroy(struct vfs_file *file)
 {
 	vfs_put_dirent(file->dirent);
 
-	kfree(file, sizeof(struct vfs_file));
+	if (file->fops->release)
+		file->fops->release(file);
+	else
+		kmem_cache_free(&vfs_file_cache, file);
 }
 
 void vfs_file_get(struct vfs_file *file)
@@ -343,3 +350,19 @@ ssize_t vfs_read_page(struct vfs_file *file, ssize_t offset, char *page)
 
 	return vfs_read(file, page, PAGE_SIZE);
 }
+
+/**
+ * @brief Get the page that holds the file's data at offset (page aligned)
+ * in memory already, if the filesystem has one (see vfs_file_ops).
+ *
+ * @return NULL if the page has to be read with vfs_read_page().
+ */
+struct page *vfs_get_page(struct vfs_file *file, size_t offset)
+{
+	ASSERT_NOT_NULL(file);
+
+	if (!file->fops->get_page)
+		return NULL;
+
+	return file->fops->get_page(file, offset);
+}
@@ -19,6 +19,12 @@ struct initrd_hdr {
 	uint32_t nfiles;
 };
 
+/*
+ * tools/create_initrd puts every file's data at a multiple of this from the
+ * start of the ramdisk, so the kernel can map it in place.
+ */
+#define INITRD_DATA_ALIGN 4096
+
 struct initrd_file {
 #define INITRD_NAMESIZE 128
 	char name[INITRD_NAMESIZE];
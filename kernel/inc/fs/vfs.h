@@ -14,6 +14,7 @@
 #include <types.h>
 #include <stdint.h>
 #include <list.h>
+#include <rbtree.h>
 #include <string.h>
 
 #define VFS_PATH_DELIM '/'
@@ -22,6 +23,7 @@ struct vfs_inode;
 struct vfs_dirent;
 struct vfs_file;
 struct vfs_file_ops;
+struct page;
 
 list_typedef(struct vfs_inode)  vfs_inode_list_t;
 list_typedef(struct vfs_dirent) vfs_dirent_list_t;
@@ -54,6 +56,7 @@ struct vfs_inode {
 	struct vfs_file_ops *fops;
 	vfs_dirent_list_t dirents; // all the dirents referring to this file
 	void *object; // a pointer to private data (to be used by the underlying fs)
+	struct rb_root cached_pages; // page cache (see mm/page_cache.h)
 };
 
 /*
@@ -108,6 +111,24 @@ struct vfs_file_ops {
 	ssize_t (*write)(struct vfs_file *, char *, size_t size, size_t off);
 
 	struct vfs_dirent *(*readdir)(struct vfs_file *, unsigned int index);
+
+	/**
+	 * @brief Optional. Get the page of memory that already holds the
+	 * page of <f> at <off> (page aligned), so it can be mapped instead of
+	 * copied.
+	 *
+	 * @return
+	 *    NULL if the data has to be read
+	 *    the page, with a reference taken for the caller, otherwise
+	 */
+	struct page *(*get_page)(struct vfs_file *f, size_t off);
+
+	/**
+	 * @brief Optional. Called instead of freeing the vfs_file when its
+	 * last reference is dropped, for files that aren't in the directory
+	 * tree and own their dirent and inode (see mm/shmem.h).
+	 */
+	void (*release)(struct vfs_file *f);
 };
 
 #define VFS_ERROR(_fmt, ...) \
@@ -182,5 +203,6 @@ ssize_t vfs_read  (struct vfs_file *file, char *buf, size_t size);
 ssize_t vfs_seek  (struct vfs_file *file, ssize_t offset, int whence);
 
 ssize_t vfs_read_page(struct vfs_file *file, ssize_t offset, char *page);
+struct page *vfs_get_page(struct vfs_file *file, size_t offset);
 
 #endif /* !__FS_VFS_H__ */
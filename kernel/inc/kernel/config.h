@@ -13,8 +13,11 @@
 #define CONFIG_KERNEL_VIRTUAL_END             0x40000000
 #define CONFIG_KERNEL_VIRTUAL_SIZE            (CONFIG_KERNEL_VIRTUAL_END - CONFIG_KERNEL_VIRTUAL_START)
 
+#define CONFIG_VMALLOC_SIZE                   MB(64)
+#define CONFIG_VMALLOC_START                  (CONFIG_KERNEL_VIRTUAL_END - CONFIG_VMALLOC_SIZE)
+
 #define CONFIG_KMAP_MIN_SIZE                  MB(128)
-#define CONFIG_KHEAP_MAX_END                  (CONFIG_KERNEL_VIRTUAL_END - CONFIG_KMAP_MIN_SIZE)
+#define CONFIG_KHEAP_MAX_END                  (CONFIG_VMALLOC_START - CONFIG_KMAP_MIN_SIZE)
 
 /*
  * The user's virtual address space.
@@ -23,12 +26,36 @@
 #define CONFIG_USER_VIRTUAL_END               0xFFFFF000
 #define CONFIG_USER_VIRTUAL_SIZE              (CONFIG_USER_VIRTUAL_END - CONFIG_USER_VIRTUAL_START)
 
+/*
+ * Where mmap() starts looking for room when it picks the address itself,
+ * leaving the space right after the program for its heap.
+ */
+#define CONFIG_USER_MMAP_START                0x60000000
+
+/*
+ * Use PAE paging (three levels of 64-bit page table entries) so physical
+ * memory above 4GB can be used. Large pages are 2MB instead of 4MB.
+ */
+#define CONFIG_X86_PAE 0
+
+/*
+ * The maximum number of processors the kernel supports. Per-CPU data is
+ * sized by this.
+ */
+#define CONFIG_NR_CPUS 1
+
 /*
  * The default frequency (times per second) to receive hardware interrupts
  * from the timer.
  */
 #define CONFIG_TIMER_HZ 100
 
+/*
+ * Log the memory manager's counters (see vm_dump_stats()) every time a
+ * process exits.
+ */
+#define CONFIG_VM_STATS 1
+
 #define LOG_ERROR 0
 #define LOG_WARN  1
 #define LOG_INFO  2
@@ -8,6 +8,7 @@
 #include <kernel/compiler.h>
 #include <kernel/proc_types.h>
 #include <mm/kmalloc.h>
+#include <mm/slab.h>
 #include <arch/atomic.h>
 #include <arch/reg.h>
 #include <mm/memory.h>
@@ -105,13 +106,16 @@ struct process {
 #define num_threads(_proc) (list_size(&(_proc)->threads))
 #define main_thread(_proc) (list_head(&(_proc)->threads))
 
+extern struct kmem_cache thread_cache;
+extern struct kmem_cache process_cache;
+
 /**
  * @brief Allocate an initialize a new thread struct.
  */
 static inline struct thread *new_thread_struct() {
 	struct thread *t;
 
-	t = kmemalign(PAGE_SIZE, sizeof(struct thread));
+	t = kmem_cache_alloc(&thread_cache);
 	if (t) {
 		memset(t, 0, sizeof(struct thread));
 	}
@@ -119,7 +123,7 @@ static inline struct thread *new_thread_struct() {
 }
 
 static inline void free_thread_struct(struct thread *t) {
-	kfree(t, sizeof(struct thread));
+	kmem_cache_free(&thread_cache, t);
 }
 
 int next_pid(void);
@@ -131,7 +135,7 @@ static inline struct process *new_process_struct()
 {
 	struct process *p;
 
-	p = kmalloc(sizeof(struct process));
+	p = kmem_cache_alloc(&process_cache);
 	if (!p)
 		return NULL;
 
@@ -160,7 +164,7 @@ static inline struct process *fork_process_struct(struct process *parent)
 
 static inline void free_process_struct(struct process *p)
 {
-	kfree(p, sizeof(struct process));
+	kmem_cache_free(&process_cache, p);
 }
 
 static inline void add_thread(struct process *p, struct thread *t)
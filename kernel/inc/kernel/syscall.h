@@ -10,7 +10,9 @@
 #define SYS_YIELD		3
 #define SYS_EXIT		4
 #define SYS_WAIT		5
-#define SYS_MAX                 6
+#define SYS_MMAP		6
+#define SYS_MUNMAP		7
+#define SYS_MAX                 8
 
 #ifndef ASSEMBLER
 
@@ -24,6 +26,9 @@ pid_t sys_fork(void);
 int sys_yield(void);
 void sys_exit(int status);
 int sys_wait(int *status);
+unsigned long sys_mmap(unsigned long addr, unsigned long length, int prot,
+		       int flags);
+int sys_munmap(unsigned long addr, unsigned long length);
 
 void bad_syscall(int syscall);
 
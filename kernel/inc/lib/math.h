@@ -19,6 +19,12 @@ static inline unsigned __umin(unsigned a, unsigned b)
 }
 #define umin(a, b) __umin((unsigned) (a), (unsigned) (b))
 
+static inline unsigned __umax(unsigned a, unsigned b)
+{
+	return a > b ? a : b;
+}
+#define umax(a, b) __umax((unsigned) (a), (unsigned) (b))
+
 static inline unsigned __smin(int a, int b)
 {
 	return a < b ? a : b;
@@ -0,0 +1,90 @@
+/**
+ * @file rbtree.h
+ *
+ * @brief Intrusive red-black trees.
+ *
+ * The tree doesn't know how its elements are ordered. To insert, the caller
+ * walks down from the root comparing keys itself, links the new node in at
+ * the leaf it ended up at with rb_link_node(), then calls rb_insert_color()
+ * to rebalance:
+ *
+ *	struct rb_node **link = &root->node, *parent = NULL;
+ *
+ *	while (*link) {
+ *		parent = *link;
+ *		if (key < rb_entry(parent, struct foo, rb)->key)
+ *			link = &parent->left;
+ *		else
+ *			link = &parent->right;
+ *	}
+ *
+ *	rb_link_node(&foo->rb, parent, link);
+ *	rb_insert_color(&foo->rb, root);
+ *
+ * An augmented tree keeps a value in each node that depends on the node and
+ * its children only, like the maximum of some field over its subtree. The
+ * caller supplies a callback that recomputes it for one node from its
+ * children, and inserts and erases with the _augmented variants, which call
+ * it for every node whose subtree changed. When the field a node's value is
+ * computed from changes, rb_augment_propagate() brings the node and its
+ * ancestors up to date.
+ */
+#ifndef __RBTREE_H__
+#define __RBTREE_H__
+
+#include <stddef.h>
+
+struct rb_node {
+	struct rb_node *parent;
+	struct rb_node *left;
+	struct rb_node *right;
+#define RB_RED   0
+#define RB_BLACK 1
+	int color;
+};
+
+struct rb_root {
+	struct rb_node *node;
+};
+
+#define INITIALIZED_RB_ROOT { .node = NULL }
+
+#define rb_init(root_ptr) ((root_ptr)->node = NULL)
+#define rb_empty(root_ptr) ((root_ptr)->node == NULL)
+
+#define rb_entry(node_ptr, struct_type, member) \
+	container_of(node_ptr, struct_type, member)
+
+/**
+ * @brief Link node into the tree as a child of parent. link is the
+ * (empty) left or right pointer of parent that node goes in, or the
+ * root's pointer if the tree is empty.
+ */
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent,
+				struct rb_node **link)
+{
+	node->parent = parent;
+	node->left = NULL;
+	node->right = NULL;
+	node->color = RB_RED;
+
+	*link = node;
+}
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root);
+void rb_erase(struct rb_node *node, struct rb_root *root);
+
+typedef void (*rb_augment_f)(struct rb_node *node);
+
+void rb_insert_augmented(struct rb_node *node, struct rb_root *root,
+			 rb_augment_f augment);
+void rb_erase_augmented(struct rb_node *node, struct rb_root *root,
+			rb_augment_f augment);
+void rb_augment_propagate(struct rb_node *node, rb_augment_f augment);
+
+struct rb_node *rb_first(const struct rb_root *root);
+struct rb_node *rb_last(const struct rb_root *root);
+struct rb_node *rb_next(const struct rb_node *node);
+struct rb_node *rb_prev(const struct rb_node *node);
+
+#endif /* !__RBTREE_H__ */
@@ -19,4 +19,7 @@ void *kmalloc(size_t size);
 void *kmemalign(size_t alignment, size_t size);
 void  kfree(void *buf, size_t size);
 
+size_t ksize(const void *buf);
+void   kfree_nosize(void *buf);
+
 #endif /* !__MM_KMALLOC_H__ */
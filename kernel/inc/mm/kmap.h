@@ -11,4 +11,12 @@ void kmap_init(void);
 void *kmap(struct page *);
 void kunmap(void *);
 
+/*
+ * The number of kmap_atomic() mappings each cpu can hold at once.
+ */
+#define KMAP_ATOMIC_SLOTS 4
+
+void *kmap_atomic(struct page *);
+void kunmap_atomic(void *);
+
 #endif /* !__MM_KMAP_H__ */
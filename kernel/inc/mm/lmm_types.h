@@ -24,13 +24,18 @@
 #ifndef _LMM_TYPES_H_
 #define _LMM_TYPES_H_
 
+#include <rbtree.h>
+
 /* The contents of these structures are opaque to users.  */
 struct lmm_region
 {
 	struct lmm_region *next;
 
-	/* List of free memory blocks in this region.  */
-	struct lmm_node *nodes;
+	/* Free memory blocks in this region, indexed two ways:
+	   by address, for coalescing on free,
+	   and by (size, address), for best-fit allocation.  */
+	struct rb_root addr_tree;
+	struct rb_root size_tree;
 
 	/* Virtual addresses of the start and end of the memory region.  */
 	vm_offset_t min;
@@ -48,11 +53,27 @@ struct lmm_region
 
 struct lmm_node
 {
-	struct lmm_node *next;
+	struct rb_node addr_link;
+	struct rb_node size_link;
 	vm_size_t size;
 };
 
-#define ALIGN_SIZE	sizeof(struct lmm_node)
+/* Every free block has to be able to hold a struct lmm_node,
+   so blocks are allocated in multiples of the smallest power of two
+   that does (64 bytes with 32-bit pointers).  */
+#define ALIGN_SIZE	(16 * sizeof(void *))
 #define ALIGN_MASK	(ALIGN_SIZE - 1)
 
+/* Free node index maintenance, see lmm_nodes.c.  */
+void lmm_node_insert(struct lmm_region *reg, struct lmm_node *node,
+		     vm_size_t size);
+void lmm_node_remove(struct lmm_region *reg, struct lmm_node *node);
+void lmm_node_resize(struct lmm_region *reg, struct lmm_node *node,
+		     vm_size_t size);
+struct lmm_node *lmm_node_first(struct lmm_region *reg);
+struct lmm_node *lmm_node_next(struct lmm_node *node);
+struct lmm_node *lmm_node_find_end(struct lmm_region *reg, vm_offset_t addr);
+struct lmm_node *lmm_node_find_size(struct lmm_region *reg, vm_size_t size);
+struct lmm_node *lmm_node_next_size(struct lmm_node *node);
+
 #endif /*  _LMM_TYPES_H_ */
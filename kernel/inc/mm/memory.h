@@ -4,20 +4,40 @@
 #ifndef __MM_MEMORY_H__
 #define __MM_MEMORY_H__
 
+#include <kernel/config.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <boot/multiboot.h>
 
+#define PAGE_SHIFT          12
 #define PAGE_SIZE           KB(4)
 #define PAGE_ALIGN_UP(n)    CEIL(PAGE_SIZE, n)
 #define PAGE_ALIGN_DOWN(n)  FLOOR(PAGE_SIZE, n)
 #define IS_PAGE_ALIGNED(n)  (PAGE_ALIGN_DOWN(n) == n)
 #define PAGE_MASK           (~(PAGE_SIZE-1))
 
+/*
+ * Physical addresses. With PAE they're 36 bits, so they don't always fit
+ * in a pointer or a size_t.
+ */
+#if CONFIG_X86_PAE
+typedef u64 phys_addr_t;
+#define PHYS_ADDR_BITS 36
+#else
+typedef size_t phys_addr_t;
+#define PHYS_ADDR_BITS 32
+#endif
+
 /*
  * The amount of memory mapped during early boot. This is the amount
- * of memory that can be addressed before vm_init().
+ * of memory that can be addressed before vm_init(). The struct pages for
+ * all of physical memory come out of it, so PAE needs more.
  */
+#if CONFIG_X86_PAE
+#define BOOT_PAGING_SIZE MB(64)
+#else
 #define BOOT_PAGING_SIZE MB(16)
+#endif
 
 /*
  * Kernel Virtual Memory Layout:
@@ -39,9 +59,9 @@
  *        +---------------------------+ kheap_start
  *        |                           |
  *        |         kernel            |   Calling kmalloc() returns an address in this
- *        |          heap             |   region.
- *        |                           |
- *        |                           |
+ *        |          heap             |   region. The heap grows into it on demand,
+ *        |           and             |   with pages from the page allocator. Pages
+ *        |         user pages        |   the heap doesn't use are given to the user.
  *        |                           |
  *        |                           |
  *        +---------------------------+ kheap_end, kdirect_end, kmap_start
@@ -50,7 +70,12 @@
  *        |         temporary         |   from an address in this range to a desired page
  *        |         mappings          |   somewhere in physical memory.
  *        |                           |
- *        +---------------------------+ kmap_end
+ *        +---------------------------+ kmap_end, vmalloc_start
+ *        |                           |
+ *        |         vmalloc           |   Calling vmalloc() maps scattered physical
+ *        |                           |   pages to contiguous addresses in this range.
+ *        |                           |
+ *        +---------------------------+ vmalloc_end
  * CONFIG_KERNEL_VIRTUAL_END
  *
  *
@@ -63,6 +88,10 @@
  *          memory. Instead, kmap contains temporary mappings to addresses
  *          all over physical memory.
  *
+ * vmalloc: Large kernel buffers that don't need to be physically
+ *          contiguous. Its page tables are created at boot, so they are
+ *          shared by every address space.
+ *
  */
 extern char *kdirect_start, *kdirect_end;     /* kernel's direct mapped virtual memory */
 extern char kimg_start[], kimg_end[];         /* kernel image (the entire loaded image) */
@@ -72,10 +101,26 @@ extern char kdata_start[], kdata_end[];       /* initialized data */
 extern char kbss_start[], kbss_end[];         /* unititialized data */
 extern char *kheap_start, *kheap_end;         /* the kernel's heap (kmalloc) */
 extern char *kmap_start, *kmap_end;           /* the kernel's temporary mappings (kmap) */
+extern char *vmalloc_start, *vmalloc_end;     /* virtually contiguous allocations (vmalloc) */
 
-extern size_t phys_mem_bytes;
+extern phys_addr_t phys_mem_bytes;
 extern size_t phys_mem_pages;
 
+/*
+ * The regions of physical memory that are usable RAM, as reported by the
+ * boot loader. The regions are page aligned, sorted by address and never
+ * overlap or touch.
+ */
+struct mem_region {
+	phys_addr_t start;
+	phys_addr_t end;
+};
+
+#define MAX_MEM_REGIONS 32
+
+extern struct mem_region mem_regions[MAX_MEM_REGIONS];
+extern int mem_num_regions;
+
 void mem_mb_init(struct multiboot_info *mb_info);
 
 #endif /* !__MM_MEMORY_H__ */
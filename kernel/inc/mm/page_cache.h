@@ -0,0 +1,74 @@
+/**
+ * @file mm/page_cache.h
+ *
+ * @brief One physical copy of each page of a file, shared by every
+ * mapping of it.
+ *
+ * Each inode keeps the pages of it that have been read in a red-black tree
+ * ordered by their offset in the file. Read faults on a file mapping map
+ * the cached page itself (read-only, so a write gets a private copy), so
+ * every process running the same binary shares the same text pages.
+ *
+ * Files that are in memory already (the initrd) hand out their own pages
+ * instead (see vfs_get_page()), which bypass the cache.
+ *
+ * The cache holds a reference to each of its pages. Pages nobody else
+ * references any more are given back when memory runs low, oldest first.
+ * Pages written through a shared mapping are dirty: there is no writeback
+ * yet, so they stay cached until the inode is forgotten.
+ */
+#ifndef __MM_PAGE_CACHE_H__
+#define __MM_PAGE_CACHE_H__
+
+#include <types.h>
+
+struct page;
+struct vfs_file;
+struct vfs_inode;
+
+struct page_cache_stats {
+	unsigned long hits;       /* lookups that found the page cached */
+	unsigned long misses;     /* lookups that had to read the page in */
+	unsigned long in_place;   /* lookups served by the file's own memory */
+	unsigned long evictions;  /* pages given back to the page allocator */
+	unsigned long pages;      /* pages in the cache */
+	unsigned long dirty;      /* pages that can't be evicted */
+};
+
+extern struct page_cache_stats page_cache_stats;
+
+void page_cache_init(void);
+
+/**
+ * @brief Get the page of file at offset off (page aligned), reading it in
+ * if it isn't cached yet. The part of the page past the end of the file is
+ * zero. The caller gets a reference to the page and must page_put() it.
+ *
+ * @return 0 on success, ENOMEM or EFAULT otherwise.
+ */
+int page_cache_get(struct vfs_file *file, unsigned long off,
+		   struct page **pagep);
+
+/**
+ * @brief Like page_cache_get(), but only if the page is at hand without
+ * reading it.
+ *
+ * @return NULL if the page would have to be read in.
+ */
+struct page *page_cache_lookup(struct vfs_file *file, unsigned long off);
+
+/**
+ * @brief Mark the cached page of file at offset off (page aligned) as
+ * written to, so it is never evicted. Pages the file's own memory holds
+ * need nothing.
+ */
+void page_cache_dirty(struct vfs_file *file, unsigned long off);
+
+/**
+ * @brief Drop every cached page of an inode that is going away.
+ */
+void page_cache_forget(struct vfs_inode *inode);
+
+void page_cache_dump(printf_f p);
+
+#endif /* !__MM_PAGE_CACHE_H__ */
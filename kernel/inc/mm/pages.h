@@ -8,55 +8,217 @@
 #ifndef __MM_PAGES_H__
 #define __MM_PAGES_H__
 
+#include <kernel/config.h>
 #include <kernel/spinlock.h>
 #include <stddef.h>
 #include <kernel/spinlock.h>
 #include <mm/memory.h>
+#include <list.h>
 
 void pages_init(void);
 
+struct kmem_cache;
+
 struct page {
 	int count;
+
+#define PG_BUDDY    (1 << 0) /* page is the head of a free block */
+#define PG_RESERVED (1 << 1) /* page is not usable RAM (e.g. a memory hole) */
+#define PG_SLAB     (1 << 2) /* kernel heap page in a kmem_cache slab */
+#define PG_KMALLOC  (1 << 3) /* kernel heap page starting a large kmalloc */
+
+	/*
+	 * The top byte of flags holds the number of the memory section the
+	 * page belongs to.
+	 */
+#define PG_SECTION_SHIFT 8
+	unsigned short flags;
+
+	/*
+	 * The order of the free block headed by this page. Only valid if
+	 * PG_BUDDY is set.
+	 */
+	unsigned short order;
+
+	union {
+		/*
+		 * Links the head page of a free block into its zone's free
+		 * list, or a free page into a per-cpu page list.
+		 */
+		list_link(struct page) free_link;
+
+		/* PG_SLAB: the cache the page's slab belongs to */
+		struct kmem_cache *slab_cache;
+
+		/* PG_KMALLOC: the number of pages in the allocation */
+		unsigned long kmalloc_pages;
+	};
 };
 
-extern struct page *phys_pages;
+list_typedef(struct page) page_list_t;
+
+/*
+ * Physical memory is divided into sections of SECTION_SIZE bytes. An array
+ * of struct pages is only allocated for the sections that contain some
+ * usable RAM, so holes in the physical address space don't cost anything.
+ * Pages inside a section that aren't usable RAM are marked PG_RESERVED.
+ *
+ * A section is always bigger than the largest buddy block (see MAX_ORDER),
+ * so a free block never straddles two sections. There are 256 sections, so
+ * a section number fits in the top byte of a page's flags: 16MB sections
+ * for a 32-bit physical address space, 256MB with PAE.
+ */
+#define SECTION_SHIFT      (PHYS_ADDR_BITS - 8)
+#define SECTION_SIZE       (1UL << SECTION_SHIFT)
+#define PAGES_PER_SECTION  (SECTION_SIZE / PAGE_SIZE)
+#define NR_SECTIONS        (1UL << (PHYS_ADDR_BITS - SECTION_SHIFT))
+
+struct mem_section {
+	struct page *pages;
+};
 
-#define page_address(_page) \
-	((((size_t) (_page) - (size_t) phys_pages) / sizeof(struct page)) * PAGE_SIZE)
+extern struct mem_section mem_sections[NR_SECTIONS];
 
-#define page_struct(_address) \
-	(phys_pages + ((_address) / PAGE_SIZE))
+#define page_section(_page) ((_page)->flags >> PG_SECTION_SHIFT)
+
+/**
+ * @brief Return the physical address of a page. Only pages in kdirect have
+ * a kernel virtual address to go with it (see kmap()).
+ */
+static inline phys_addr_t page_address(struct page *page)
+{
+	unsigned long section = page_section(page);
+
+	return ((phys_addr_t) section << SECTION_SHIFT) +
+		(phys_addr_t) (page - mem_sections[section].pages) * PAGE_SIZE;
+}
+
+/**
+ * @brief Return the struct page of the physical page at address, or NULL
+ * if address is in a section without any usable RAM.
+ */
+static inline struct page *page_struct(phys_addr_t address)
+{
+	struct page *pages = mem_sections[address >> SECTION_SHIFT].pages;
+
+	if (!pages)
+		return NULL;
+
+	return pages + (address & (SECTION_SIZE - 1)) / PAGE_SIZE;
+}
+
+#define page_pfn(_page) ((unsigned long) (page_address(_page) / PAGE_SIZE))
+#define pfn_page(_pfn) page_struct((phys_addr_t) (_pfn) * PAGE_SIZE)
 
 #include <arch/atomic.h>
 #define page_get(_page) (atomic_inc(&((_page)->count)))
-#define page_put(_page) do {						\
-	atomic_dec(&((_page)->count));					\
-	ASSERT((_page)->count >= 0);					\
-} while (0)
+
+/*
+ * Drop a reference to a page. The page is returned to the page allocator
+ * when the last reference is dropped.
+ */
+#define page_put(_page) free_page(_page)
+
+/*
+ * The page allocator is a binary buddy allocator. Free memory is kept in
+ * blocks of 2^order contiguous pages, for order in [0, MAX_ORDER). Each
+ * order has its own free list so allocating or freeing a block only has
+ * to split or coalesce at most MAX_ORDER times.
+ */
+#define MAX_ORDER 11
+
+/*
+ * Each cpu keeps a short list of free pages in front of every zone, so
+ * allocating or freeing a single page doesn't have to take the zone lock.
+ * The list is refilled from the zone <batch> pages at a time once it drops
+ * to <low> pages, and <batch> pages are drained back to the zone once it
+ * grows past <high> pages.
+ *
+ * Freed pages go on the head of the list and allocations come off the
+ * head, so the pages handed out are the ones most likely still in the
+ * cache. Drains take the coldest pages from the tail.
+ */
+struct per_cpu_pages {
+	page_list_t list;
+	unsigned long low;
+	unsigned long high;
+	unsigned long batch;
+
+	unsigned long hits;      /* allocations served without a refill */
+	unsigned long refills;   /* times the list was refilled from the zone */
+	unsigned long drains;    /* times the list was drained to the zone */
+};
+
+#define PCP_BATCH 16
+#define PCP_LOW   0
+#define PCP_HIGH  (6 * PCP_BATCH)
+
+/*
+ * Physical memory is split into zones:
+ *
+ *   ZONE_DMA     [0, 16MB): the only memory legacy DMA engines can reach.
+ *   ZONE_NORMAL  [16MB, kdirect_end): the rest of the kernel's direct map.
+ *   ZONE_HIGH    [kdirect_end, phys_mem_bytes): everything else.
+ *
+ * An allocation names the highest zone it can use and falls back to the
+ * zones below it in order, so ordinary allocations only dip into the DMA
+ * zone once everything else is gone.
+ */
+#define ZONE_DMA     0
+#define ZONE_NORMAL  1
+#define ZONE_HIGH    2
+#define MAX_ZONES    3
+
+#define ZONE_DMA_END MB(16)
 
 struct page_zone {
-	struct page *pages;       /* array of all pages in the zone */
-	unsigned long num_pages;  /* total number of pages in the zone */
+	const char *name;
+	unsigned long start_pfn;  /* first page frame spanned by the zone */
+	unsigned long end_pfn;    /* one past the last page frame spanned */
+	unsigned long num_pages;  /* number of usable pages in the zone */
 	unsigned long num_free;   /* number of free pages in the zone */
-	unsigned long index;      /* allows searches to pick up where the last left off */
+	page_list_t free_lists[MAX_ORDER]; /* free blocks, one list per order */
 	struct spinlock lock;
+	struct per_cpu_pages pcp[CONFIG_NR_CPUS];
 };
-#define MAX_ZONES 1
-
-#define ZONE_START_PAGE_ADDR(zone) \
-	(page_address((zone)->pages))
-
-#define ZONE_END_PAGE_ADDR(zone) \
-	(page_address((zone)->pages + ((zone)->num_pages - 1)))
 
+extern struct page_zone *zones;
 
 struct page *alloc_pages_at(size_t addr, unsigned long n);
 
-struct page *alloc_pages(unsigned long n);
+struct page *alloc_zone_pages(int zone, unsigned long n);
+struct page *__alloc_zone_pages(int zone, unsigned long n);
+#define alloc_pages(_n) alloc_zone_pages(ZONE_HIGH, _n)
 #define alloc_page() alloc_pages(1)
+#define alloc_dma_pages(_n) alloc_zone_pages(ZONE_DMA, _n)
 
 void free_pages(struct page *pages, unsigned long n);
-//FIXME: this is confusing because it's essentially the same as page_put()
 #define free_page(_p) free_pages(_p, 1)
 
+void drain_pages(void);
+void pages_dump(printf_f p);
+
+/*
+ * When an allocation can't be satisfied, the page allocator calls every
+ * registered shrinker to give back memory that is cached but not in use
+ * (e.g. empty kernel heap chunks), and then tries once more. A shrinker
+ * returns the number of pages it freed.
+ *
+ * Shrinkers run in the context of the failed allocation, so anything that
+ * allocates while holding a lock a shrinker takes must use
+ * __alloc_zone_pages(), which never calls them.
+ */
+struct page_shrinker {
+	const char *name;
+	unsigned long (*shrink)(void);
+	list_link(struct page_shrinker) link;
+};
+
+void register_page_shrinker(struct page_shrinker *shrinker);
+unsigned long shrink_pages(void);
+
+struct page *alloc_zeroed_page(void);
+void zero_pool_refill(void);
+void zero_pool_dump(printf_f p);
+
 #endif /* !__MM_PAGES_H__ */
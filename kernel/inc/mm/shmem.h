@@ -0,0 +1,27 @@
+/**
+ * @file mm/shmem.h
+ *
+ * @brief Anonymous memory that can be shared between processes.
+ *
+ * A shared anonymous mapping is backed by a file of its own that isn't in
+ * the directory tree. Its pages are cached like any file's (see
+ * mm/page_cache.h), so every mapping of it, on both sides of a fork, finds
+ * the same pages. The pages start out as zeros and are freed when the last
+ * reference to the file is dropped.
+ */
+#ifndef __MM_SHMEM_H__
+#define __MM_SHMEM_H__
+
+#include <types.h>
+
+struct vfs_file;
+
+/**
+ * @brief Create a file of length bytes of shared memory.
+ *
+ * @return the file, with a reference for the caller, or NULL if out of
+ * memory.
+ */
+struct vfs_file *new_shmem_file(unsigned long length);
+
+#endif /* !__MM_SHMEM_H__ */
@@ -0,0 +1,121 @@
+/**
+ * @file mm/slab.h
+ *
+ * @brief Object caches for fixed size kernel structures.
+ *
+ * A kmem_cache hands out objects of one size. Objects are carved out of
+ * slabs: naturally aligned blocks of one or more pages taken from the
+ * kernel heap, with a small header at the start. Allocating and freeing an
+ * object only touches its slab's free list, instead of searching the whole
+ * heap.
+ *
+ * Each cpu keeps a small magazine of free objects in front of the cache so
+ * that most allocations and frees don't take the cache lock at all.
+ *
+ * If the cache has a constructor it's run once, when an object's slab is
+ * created, not on every allocation. Objects must be returned to the cache
+ * in their constructed state.
+ */
+#ifndef __MM_SLAB_H__
+#define __MM_SLAB_H__
+
+#include <kernel/config.h>
+#include <kernel/spinlock.h>
+#include <types.h>
+#include <list.h>
+
+struct kmem_cache;
+
+struct kmem_slab {
+	struct kmem_cache *cache;
+	void *free;              /* free objects, linked through the objects */
+	unsigned long inuse;     /* number of allocated objects */
+	list_link(struct kmem_slab) link;
+};
+
+list_typedef(struct kmem_slab) kmem_slab_list_t;
+
+#define KMEM_MAGAZINE_SIZE  16
+#define KMEM_MAGAZINE_BATCH (KMEM_MAGAZINE_SIZE / 2)
+
+struct kmem_magazine {
+	unsigned long avail;
+	void *objs[KMEM_MAGAZINE_SIZE];
+};
+
+struct kmem_cache {
+	const char *name;
+	size_t size;
+	size_t align;
+	void (*ctor)(void *obj);
+
+	/*
+	 * The layout of a slab, worked out when the first slab is created.
+	 * Objects are stride bytes apart, starting offset bytes into the slab.
+	 * A free object links to the next free object with the pointer at
+	 * free_offset inside it, which lies past the end of the object if
+	 * there is a constructor.
+	 */
+	size_t stride;
+	size_t offset;
+	size_t free_offset;
+	size_t slab_size;
+	unsigned long objs_per_slab;
+
+	struct spinlock lock;
+	kmem_slab_list_t partial; /* slabs with some objects free */
+	kmem_slab_list_t full;    /* slabs with no objects free */
+	kmem_slab_list_t empty;   /* slabs with every object free */
+
+	struct kmem_magazine magazine[CONFIG_NR_CPUS];
+
+	unsigned long active;     /* objects allocated */
+	unsigned long allocs;     /* calls to kmem_cache_alloc */
+	unsigned long frees;      /* calls to kmem_cache_free */
+	unsigned long hits;       /* allocations served from a magazine */
+	unsigned long grown;      /* slabs created */
+	unsigned long reaped;     /* slabs given back to the heap */
+
+	list_link(struct kmem_cache) cache_link;
+};
+
+list_typedef(struct kmem_cache) kmem_cache_list_t;
+
+/*
+ * Caches are usually defined statically, so they can be used before the
+ * rest of the kernel is up:
+ *
+ *	static struct kmem_cache foo_cache =
+ *		INITIALIZED_KMEM_CACHE("foo", sizeof(struct foo), 0, NULL);
+ *
+ * An alignment of 0 means pointer alignment.
+ */
+#define INITIALIZED_KMEM_CACHE(_name, _size, _align, _ctor)		\
+	{								\
+		.name = (_name),					\
+		.size = (_size),					\
+		.align = (_align),					\
+		.ctor = (_ctor),					\
+		.lock = INITIALIZED_SPINLOCK,				\
+		.partial = INITIALIZED_EMPTY_LIST,			\
+		.full = INITIALIZED_EMPTY_LIST,				\
+		.empty = INITIALIZED_EMPTY_LIST,			\
+	}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align, void (*ctor)(void *));
+void kmem_cache_destroy(struct kmem_cache *cache);
+
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+
+struct kmem_cache *kmem_cache_of(const void *obj);
+void kmem_cache_init_pages(void);
+void kmem_cache_shrink(void);
+
+size_t kmem_cache_slab_bytes(void);
+size_t kmem_cache_object_bytes(void);
+
+void kmem_cache_dump(printf_f p);
+
+#endif /* !__MM_SLAB_H__ */
@@ -10,6 +10,7 @@
 #include <string.h>
 #include <stddef.h>
 #include <list.h>
+#include <rbtree.h>
 
 #if CONFIG_KERNEL_VIRTUAL_START == 0 // damn gcc warnings...
 #define kernel_address(addr) \
@@ -40,6 +41,8 @@ struct vm_mapping {
 #define VM_S (1 << 4) // supervisor
 #define VM_G (1 << 5) // global
 #define VM_P (1 << 6) // present (FIXME need to implement in arch/x86/vm.c)
+#define VM_L (1 << 7) // locked, its pages must never be reclaimed
+#define VM_SHARED (1 << 8) // writes are seen by every mapping, never copied
 	int flags;
 
 	/*
@@ -49,6 +52,19 @@ struct vm_mapping {
 	unsigned long foff;
 
 	list_link(struct vm_mapping) link;
+
+	/*
+	 * Links the mapping into its space's mapping_tree.
+	 */
+	struct rb_node rb_node;
+
+	/*
+	 * The free space between the mapping and the one before it (or the
+	 * start of user space), and the largest such gap in the mapping's
+	 * subtree, so free ranges can be found in O(log n).
+	 */
+	unsigned long gap;
+	unsigned long max_gap;
 };
 
 #define M_LENGTH(_m) \
@@ -60,6 +76,12 @@ struct vm_mapping {
 #define M_WRITEABLE(_m) \
 	((_m)->flags & VM_W)
 
+#define M_LOCKED(_m) \
+	((_m)->flags & VM_L)
+
+#define M_SHARED(_m) \
+	((_m)->flags & VM_SHARED)
+
 list_typedef(struct vm_mapping) vm_mapping_list_t;
 
 struct vm_space {
@@ -70,11 +92,40 @@ struct vm_space {
 	void *mmu;
 
 	/*
-	 * A list of all memory mapped regions of the address space.
+	 * A list of all memory mapped regions of the address space, sorted by
+	 * address.
 	 */
 	vm_mapping_list_t mappings;
+
+	/*
+	 * The same mappings in a red-black tree keyed on address, for
+	 * looking up the mapping containing an address in O(log n). Mappings
+	 * never overlap, so ordering them by start address orders them by end
+	 * address too.
+	 */
+	struct rb_root mapping_tree;
+
+	/*
+	 * The mapping the last lookup found. Faults tend to come in runs on
+	 * the same mapping.
+	 */
+	struct vm_mapping *mapping_cache;
+
+	/*
+	 * The number of pages mapped into the address space (resident set
+	 * size). Mappings of the shared zero page aren't counted.
+	 */
+	unsigned long rss;
+
+	/*
+	 * The number of page faults taken since the program was loaded (or,
+	 * for a forked child, since the fork).
+	 */
+	unsigned long faults;
 };
 
+extern struct page *zero_page;
+
 extern struct vm_space boot_vm_space;
 
 void vm_init(void);
@@ -95,6 +146,7 @@ int  vm_space_fork(struct vm_space *to, struct vm_space *from);
 #define MAP_ANONYMOUS (1 << 2)
 #define MAP_LOCKED    (1 << 3)
 #define MAP_FIXED     (1 << 4)
+#define MAP_POPULATE  (1 << 5)
 
 #include <fs/vfs.h>
 
@@ -103,6 +155,18 @@ struct vm_mapping *new_vm_mapping(unsigned long addr, unsigned long length,
 				  unsigned long off);
 void free_vm_mapping(struct vm_mapping *m);
 
+void vm_space_init_mappings(struct vm_space *space);
+void vm_insert_mapping(struct vm_space *space, struct vm_mapping *m);
+void vm_remove_mapping(struct vm_space *space, struct vm_mapping *m);
+void vm_mapping_changed(struct vm_mapping *m);
+struct vm_mapping *vm_find_mapping(struct vm_space *space, unsigned long addr);
+struct vm_mapping *vm_find_first_overlapping(struct vm_space *space,
+					     unsigned long addr,
+					     unsigned long length);
+unsigned long vm_find_free_range(struct vm_space *space, unsigned long length,
+				 unsigned long align, unsigned long low,
+				 unsigned long high);
+
 unsigned long vm_mmap(unsigned long addr, unsigned long length,
 		int prot, int flags,
 		struct vfs_file *file, unsigned long off);
@@ -119,7 +183,44 @@ int vm_page_fault(unsigned long address, int flags);
 
 int vm_map_page(struct vm_space *space, unsigned long virt, int flags);
 void vm_unmap_page(struct vm_space *space, unsigned long virt);
+void vm_unmap_range(struct vm_space *space, unsigned long start,
+		    unsigned long end);
 
 void vm_dump_maps(printf_f p, struct vm_space *space);
 
+/*
+ * Counters for the page fault paths.
+ */
+struct vm_stats {
+	unsigned long faults;       /* page faults on user mappings */
+	unsigned long cow_copied;   /* cow faults that copied the page */
+	unsigned long cow_reused;   /* cow faults that reused the page */
+	unsigned long zero_page_maps; /* read faults given the zero page */
+	unsigned long large_page_maps; /* faults given a whole large page */
+	unsigned long fault_around_maps; /* pages mapped around a fault */
+	unsigned long populated;    /* pages mapped by MAP_POPULATE/LOCKED */
+	unsigned long shared_writes; /* shared pages made writable on a write */
+	unsigned long merges;       /* mmaps that extended a neighbour instead */
+};
+
+extern struct vm_stats vm_stats;
+
+/*
+ * The number of pages around a read fault to map along with the faulting
+ * page, if they are at hand already. Less than 2 turns this off.
+ */
+extern unsigned long vm_fault_around;
+
+/*
+ * Map large, aligned parts of anonymous mappings with large pages.
+ */
+extern bool vm_large_pages;
+
+/*
+ * Share user page tables with the child on fork instead of copying them.
+ */
+extern bool vm_share_page_tables;
+
+void vm_dump_stats(printf_f p);
+
 #endif /* !__MM_VM_H__ */
@@ -0,0 +1,25 @@
+/**
+ * @file mm/vmalloc.h
+ *
+ * @brief Virtually contiguous kernel allocations.
+ *
+ * vmalloc() builds a buffer out of single pages from the page allocator,
+ * mapped next to each other in the vmalloc region of the kernel's address
+ * space. Unlike kmalloc(), it doesn't need physically contiguous memory,
+ * so large buffers don't fail just because memory is fragmented. The
+ * memory isn't direct mapped though, so it can't be used where a physical
+ * address is needed (e.g. page tables or DMA).
+ */
+#ifndef __MM_VMALLOC_H__
+#define __MM_VMALLOC_H__
+
+#include <types.h>
+
+void vmalloc_init(void);
+
+void *vmalloc(size_t size);
+void  vfree(void *addr);
+
+void vmalloc_dump(printf_f p);
+
+#endif /* !__MM_VMALLOC_H__ */
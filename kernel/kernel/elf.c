@@ -17,6 +17,7 @@
 #include <stddef.h>
 #include <errno.h>
 #include <assert.h>
+#include <math.h>
 
 #include <arch/vm.h>
 
@@ -133,6 +134,7 @@ int __elf32_load(struct vfs_file *file, struct elf32_ehdr *ehdr,
 
 	for (i = 0; i < ehdr->e_phnum; i++) {
 		struct elf32_phdr *p = phdrs + i;
+		unsigned long file_end, mem_end;
 		int flags, prot = 0;
 
 		log_phdr(p);
@@ -143,22 +145,41 @@ int __elf32_load(struct vfs_file *file, struct elf32_ehdr *ehdr,
 
 		flags = MAP_PRIVATE | MAP_FIXED;
 
+		file_end = PAGE_ALIGN_UP(p->p_vaddr + p->p_filesz);
+		mem_end = PAGE_ALIGN_UP(p->p_vaddr + p->p_memsz);
+
+		/*
+		 * Map the part of the section that is backed by the file.
+		 */
+		if (file_end > p->p_vaddr) {
+			error = vm_mmap(p->p_vaddr, file_end - p->p_vaddr, prot,
+					flags, file, p->p_offset);
+			error %= PAGE_SIZE;
+			if (error)
+				goto load_fail;
+		}
+
 		/*
-		 * Map the elf into memory.
+		 * The pages past the end of the file (the bss) are mapped
+		 * anonymous, so they are handed out pre-zeroed when touched.
 		 */
-		error = vm_mmap(p->p_vaddr, p->p_memsz, prot,
-				flags, file, p->p_offset);
-		error %= PAGE_SIZE;
-		if (error)
-			goto load_fail;
+		if (mem_end > file_end) {
+			error = vm_mmap(file_end, mem_end - file_end, prot,
+					flags | MAP_ANONYMOUS, NULL, 0);
+			error %= PAGE_SIZE;
+			if (error)
+				goto load_fail;
+		}
 
 		/*
-		 * Finally write 0s if the size of the section in memory is
-		 * larger than the size of the section in the file.
+		 * Finally write 0s over the rest of the last page that came
+		 * from the file.
 		 */
 		if (p->p_filesz < p->p_memsz) {
 			void *zero_start = (void *) p->p_vaddr + p->p_filesz;
-			unsigned long zero_size = p->p_memsz - p->p_filesz;
+			unsigned long zero_size = umin(file_end,
+						       p->p_vaddr + p->p_memsz) -
+						  (p->p_vaddr + p->p_filesz);
 
 			memset(zero_start, 0, zero_size);
 		}
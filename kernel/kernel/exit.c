@@ -8,6 +8,8 @@
 #include <kernel/init.h>
 #include <kernel/wait.h>
 #include <kernel/log.h>
+#include <kernel/config.h>
+#include <mm/vm.h>
 #include <lib/errno.h>
 #include <lib/assert.h>
 
@@ -65,8 +67,14 @@ void sys_exit(int status)
 	ASSERT_EQUALS(1, num_threads(p));
 	ASSERT_NOTEQUALS(1, p->pid);
 
+	INFO("Process %d took %d page faults.", p->pid, p->space.faults);
+
 	vm_space_destroy(&p->space);
 
+#if CONFIG_VM_STATS
+	vm_dump_stats(log);
+#endif
+
 	vfs_file_put(p->exec_file);
 
 	process_exit(status);
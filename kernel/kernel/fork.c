@@ -22,6 +22,16 @@
  */
 int __next_pid = 2;
 
+/*
+ * Threads must be page aligned: the current thread is found by rounding
+ * the stack pointer down to a page (see CURRENT_THREAD).
+ */
+struct kmem_cache thread_cache =
+	INITIALIZED_KMEM_CACHE("thread", sizeof(struct thread), PAGE_SIZE, NULL);
+
+struct kmem_cache process_cache =
+	INITIALIZED_KMEM_CACHE("process", sizeof(struct process), 0, NULL);
+
 int next_pid(void)
 {
 	return atomic_inc(&__next_pid);
@@ -17,6 +17,8 @@
 #include <mm/pages.h>
 #include <mm/vm.h>
 #include <mm/kmap.h>
+#include <mm/vmalloc.h>
+#include <mm/page_cache.h>
 
 #include <dev/vga.h>
 #include <dev/serial.h>
@@ -48,6 +50,8 @@ void kernel_main()
 	pages_init();
 	vm_init();
 	kmap_init();
+	vmalloc_init();
+	page_cache_init();
 	initrd_init();
 	pci_init();
 
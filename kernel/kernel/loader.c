@@ -6,6 +6,7 @@
 #include <kernel/loader.h>
 #include <mm/kmalloc.h>
 #include <kernel/elf.h>
+#include <kernel/proc.h>
 
 #include <arch/atomic.h>
 
@@ -33,6 +34,9 @@ int load_binary(struct vfs_file *file)
 		return EPERM;
 	}
 
+	/* count the new program's faults from here */
+	CURRENT_PROCESS->space.faults = 0;
+
 	/*
 	 * Read the first few bytes of the file to use to determine the executable
 	 * format.
@@ -6,6 +6,7 @@
 #include <kernel/proc.h>
 #include <kernel/sched.h>
 #include <kernel/log.h>
+#include <mm/pages.h>
 #include <lib/assert.h>
 
 void *syscall_table[] =
@@ -16,6 +17,8 @@ void *syscall_table[] =
 	[SYS_YIELD]	= (void *) sys_yield,
 	[SYS_EXIT]	= (void *) sys_exit,
 	[SYS_WAIT]	= (void *) sys_wait,
+	[SYS_MMAP]	= (void *) sys_mmap,
+	[SYS_MUNMAP]	= (void *) sys_munmap,
 };
 
 int sys_write(int fd, char *ptr, int len)
@@ -40,6 +43,13 @@ int sys_getpid(void)
 int sys_yield(void)
 {
 	TRACE();
+
+	/*
+	 * The caller has nothing better to do, so spend a little of its time
+	 * zeroing pages ahead of the next demand-zero fault.
+	 */
+	zero_pool_refill();
+
 	reschedule();
 	return 0;
 }
@@ -0,0 +1,357 @@
+/**
+ * @file rbtree.c
+ *
+ * Red-black tree rebalancing, as described in Cormen, Leiserson, Rivest and
+ * Stein, "Introduction to Algorithms", chapter 13. Leaves are NULL pointers
+ * rather than a sentinel node, so they are always black.
+ *
+ * Augmented trees (see rbtree.h) pass an augment callback down to the
+ * rotations, the only place nodes change subtrees while rebalancing. It is
+ * NULL for plain trees.
+ */
+#include <rbtree.h>
+
+#define is_red(_n)   ((_n) && (_n)->color == RB_RED)
+#define is_black(_n) (!is_red(_n))
+
+/*
+ * Replace the child pointer to old in parent (or the root) with new.
+ */
+static inline void change_child(struct rb_node *old, struct rb_node *new,
+				struct rb_node *parent, struct rb_root *root)
+{
+	if (!parent)
+		root->node = new;
+	else if (parent->left == old)
+		parent->left = new;
+	else
+		parent->right = new;
+}
+
+static void rotate_left(struct rb_node *node, struct rb_root *root,
+			rb_augment_f augment)
+{
+	struct rb_node *right = node->right;
+	struct rb_node *parent = node->parent;
+
+	node->right = right->left;
+	if (right->left)
+		right->left->parent = node;
+
+	right->left = node;
+	right->parent = parent;
+	change_child(node, right, parent, root);
+	node->parent = right;
+
+	/* node is right's child now, so it goes first */
+	if (augment) {
+		augment(node);
+		augment(right);
+	}
+}
+
+static void rotate_right(struct rb_node *node, struct rb_root *root,
+			 rb_augment_f augment)
+{
+	struct rb_node *left = node->left;
+	struct rb_node *parent = node->parent;
+
+	node->left = left->right;
+	if (left->right)
+		left->right->parent = node;
+
+	left->right = node;
+	left->parent = parent;
+	change_child(node, left, parent, root);
+	node->parent = left;
+
+	if (augment) {
+		augment(node);
+		augment(left);
+	}
+}
+
+static void insert_color(struct rb_node *node, struct rb_root *root,
+			 rb_augment_f augment)
+{
+	struct rb_node *parent, *gparent, *uncle;
+
+	while ((parent = node->parent) && is_red(parent)) {
+		gparent = parent->parent;
+
+		if (parent == gparent->left) {
+			uncle = gparent->right;
+			if (is_red(uncle)) {
+				uncle->color = RB_BLACK;
+				parent->color = RB_BLACK;
+				gparent->color = RB_RED;
+				node = gparent;
+				continue;
+			}
+
+			if (node == parent->right) {
+				rotate_left(parent, root, augment);
+				node = parent;
+				parent = node->parent;
+			}
+
+			parent->color = RB_BLACK;
+			gparent->color = RB_RED;
+			rotate_right(gparent, root, augment);
+		}
+		else {
+			uncle = gparent->left;
+			if (is_red(uncle)) {
+				uncle->color = RB_BLACK;
+				parent->color = RB_BLACK;
+				gparent->color = RB_RED;
+				node = gparent;
+				continue;
+			}
+
+			if (node == parent->left) {
+				rotate_right(parent, root, augment);
+				node = parent;
+				parent = node->parent;
+			}
+
+			parent->color = RB_BLACK;
+			gparent->color = RB_RED;
+			rotate_left(gparent, root, augment);
+		}
+	}
+
+	root->node->color = RB_BLACK;
+}
+
+/**
+ * @brief Rebalance the tree after node was linked in with rb_link_node().
+ */
+void rb_insert_color(struct rb_node *node, struct rb_root *root)
+{
+	insert_color(node, root, NULL);
+}
+
+void rb_augment_propagate(struct rb_node *node, rb_augment_f augment)
+{
+	for (; node; node = node->parent)
+		augment(node);
+}
+
+void rb_insert_augmented(struct rb_node *node, struct rb_root *root,
+			 rb_augment_f augment)
+{
+	/* every node above the new one has one more node under it */
+	rb_augment_propagate(node, augment);
+	insert_color(node, root, augment);
+}
+
+/*
+ * Restore the red-black properties after a black node was removed from
+ * above node (which may be a NULL leaf, hence the separate parent).
+ */
+static void erase_color(struct rb_node *node, struct rb_node *parent,
+			struct rb_root *root, rb_augment_f augment)
+{
+	struct rb_node *sibling;
+
+	while (is_black(node) && node != root->node) {
+		if (parent->left == node) {
+			sibling = parent->right;
+			if (is_red(sibling)) {
+				sibling->color = RB_BLACK;
+				parent->color = RB_RED;
+				rotate_left(parent, root, augment);
+				sibling = parent->right;
+			}
+
+			if (is_black(sibling->left) && is_black(sibling->right)) {
+				sibling->color = RB_RED;
+				node = parent;
+				parent = node->parent;
+				continue;
+			}
+
+			if (is_black(sibling->right)) {
+				sibling->left->color = RB_BLACK;
+				sibling->color = RB_RED;
+				rotate_right(sibling, root, augment);
+				sibling = parent->right;
+			}
+
+			sibling->color = parent->color;
+			parent->color = RB_BLACK;
+			sibling->right->color = RB_BLACK;
+			rotate_left(parent, root, augment);
+		}
+		else {
+			sibling = parent->left;
+			if (is_red(sibling)) {
+				sibling->color = RB_BLACK;
+				parent->color = RB_RED;
+				rotate_right(parent, root, augment);
+				sibling = parent->left;
+			}
+
+			if (is_black(sibling->left) && is_black(sibling->right)) {
+				sibling->color = RB_RED;
+				node = parent;
+				parent = node->parent;
+				continue;
+			}
+
+			if (is_black(sibling->left)) {
+				sibling->right->color = RB_BLACK;
+				sibling->color = RB_RED;
+				rotate_left(sibling, root, augment);
+				sibling = parent->left;
+			}
+
+			sibling->color = parent->color;
+			parent->color = RB_BLACK;
+			sibling->left->color = RB_BLACK;
+			rotate_right(parent, root, augment);
+		}
+
+		node = root->node;
+		break;
+	}
+
+	if (node)
+		node->color = RB_BLACK;
+}
+
+static void erase(struct rb_node *node, struct rb_root *root,
+		  rb_augment_f augment)
+{
+	struct rb_node *child, *parent;
+	int color;
+
+	if (node->left && node->right) {
+		struct rb_node *old = node;
+
+		/*
+		 * Swap the node with its successor, which has no left child,
+		 * and remove the successor from its old position instead.
+		 */
+		node = node->right;
+		while (node->left)
+			node = node->left;
+
+		change_child(old, node, old->parent, root);
+
+		child = node->right;
+		parent = node->parent;
+		color = node->color;
+
+		if (parent == old) {
+			parent = node;
+		}
+		else {
+			if (child)
+				child->parent = parent;
+			parent->left = child;
+
+			node->right = old->right;
+			old->right->parent = node;
+		}
+
+		node->parent = old->parent;
+		node->color = old->color;
+		node->left = old->left;
+		old->left->parent = node;
+	}
+	else {
+		child = node->left ? node->left : node->right;
+		parent = node->parent;
+		color = node->color;
+
+		if (child)
+			child->parent = parent;
+		change_child(node, child, parent, root);
+	}
+
+	/*
+	 * Everything from where a node was taken out up to the root lost a
+	 * node under it (the successor that took node's place is on the way).
+	 */
+	if (augment)
+		rb_augment_propagate(parent, augment);
+
+	if (color == RB_BLACK)
+		erase_color(child, parent, root, augment);
+}
+
+/**
+ * @brief Remove node from the tree and rebalance it.
+ */
+void rb_erase(struct rb_node *node, struct rb_root *root)
+{
+	erase(node, root, NULL);
+}
+
+void rb_erase_augmented(struct rb_node *node, struct rb_root *root,
+			rb_augment_f augment)
+{
+	erase(node, root, augment);
+}
+
+struct rb_node *rb_first(const struct rb_root *root)
+{
+	struct rb_node *n = root->node;
+
+	if (!n)
+		return NULL;
+
+	while (n->left)
+		n = n->left;
+
+	return n;
+}
+
+struct rb_node *rb_last(const struct rb_root *root)
+{
+	struct rb_node *n = root->node;
+
+	if (!n)
+		return NULL;
+
+	while (n->right)
+		n = n->right;
+
+	return n;
+}
+
+struct rb_node *rb_next(const struct rb_node *node)
+{
+	struct rb_node *parent;
+
+	if (node->right) {
+		node = node->right;
+		while (node->left)
+			node = node->left;
+		return (struct rb_node *) node;
+	}
+
+	while ((parent = node->parent) && node == parent->right)
+		node = parent;
+
+	return parent;
+}
+
+struct rb_node *rb_prev(const struct rb_node *node)
+{
+	struct rb_node *parent;
+
+	if (node->left) {
+		node = node->left;
+		while (node->right)
+			node = node->right;
+		return (struct rb_node *) node;
+	}
+
+	while ((parent = node->parent) && node == parent->left)
+		node = parent;
+
+	return parent;
+}
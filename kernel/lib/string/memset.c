@@ -22,12 +22,22 @@
 #pragma GCC diagnostic ignored "-Wconversion"
 
 #include <types.h>
+#include <string.h>
 
 void *
 memset(void *tov, int c, size_t len)
 {
 	register char *to = tov;
 
+	/*
+	 * Zeroing is by far the most common use, and bzero works a word at
+	 * a time.
+	 */
+	if (c == 0) {
+		bzero(tov, len);
+		return tov;
+	}
+
 	while (len-- > 0)
 		*to++ = c;
 
@@ -4,9 +4,23 @@
  * @brief kmalloc is the dynamic memory allocator in charge of the kernel
  * heap (kheap).
  *
+ * Small allocations are rounded up to a size class and served from that
+ * class's kmem_cache, so they only pop an object off a free list. Only
+ * large allocations, kmemalign() and anything allocated before vm_init()
+ * go to the LMM heap itself.
+ *
+ * The heap starts out as the memory between the end of the kernel image
+ * (and boot modules) and BOOT_PAGING_SIZE. Once vm_init() is done, the
+ * part of that it never used goes back to the page allocator, and the
+ * heap grows on demand, a KHEAP_CHUNK_SIZE chunk at a time, with pages
+ * taken from the direct mapped zones. When the page allocator runs short,
+ * chunks that are entirely free are given back to it.
+ *
  * TODO locking
  */
 #include <mm/kmalloc.h>
+#include <mm/slab.h>
+#include <mm/pages.h>
 #include <kernel/spinlock.h>
 
 #include <stddef.h>
@@ -17,6 +31,7 @@
 #include <mm/lmm.h>
 #include <mm/lmm_types.h>
 #include <mm/memory.h>
+#include <math.h>
 
 /*
  * The lmm datastructures used to support the kernel heap.
@@ -33,6 +48,84 @@ size_t kheap_early_size;   /* The size of the kernel's early heap */
 
 static size_t kheap_used;  /* The number of bytes in use (allocated) */
 
+/*
+ * The heap grows in naturally aligned chunks of KHEAP_CHUNK_SIZE bytes.
+ * kheap_chunk_map[i] is set if the i'th chunk of kdirect was added to the
+ * heap by kheap_grow().
+ */
+#define KHEAP_CHUNK_SHIFT  18
+#define KHEAP_CHUNK_SIZE   (1UL << KHEAP_CHUNK_SHIFT)
+#define KHEAP_CHUNK_PAGES  (KHEAP_CHUNK_SIZE / PAGE_SIZE)
+#define KHEAP_MAX_CHUNKS \
+	((CONFIG_KHEAP_MAX_END - CONFIG_KERNEL_VIRTUAL_START) / KHEAP_CHUNK_SIZE)
+
+static unsigned char kheap_chunk_map[KHEAP_MAX_CHUNKS];
+static unsigned long kheap_chunks;  /* The number of chunks in the heap */
+
+/*
+ * Set once the page allocator is up and the heap can grow.
+ */
+static bool kheap_growable;
+
+static unsigned long kheap_shrink(void);
+
+static struct page_shrinker kheap_shrinker = {
+	.name = "kheap",
+	.shrink = kheap_shrink,
+};
+
+/*
+ * The size classes: powers of two, with one class half way between each.
+ */
+#define KMALLOC_CACHE(_size) \
+	INITIALIZED_KMEM_CACHE("kmalloc-" #_size, _size, 8, NULL)
+
+static struct kmem_cache kmalloc_caches[] = {
+	KMALLOC_CACHE(8),
+	KMALLOC_CACHE(16),
+	KMALLOC_CACHE(32),
+	KMALLOC_CACHE(48),
+	KMALLOC_CACHE(64),
+	KMALLOC_CACHE(96),
+	KMALLOC_CACHE(128),
+	KMALLOC_CACHE(192),
+	KMALLOC_CACHE(256),
+	KMALLOC_CACHE(384),
+	KMALLOC_CACHE(512),
+	KMALLOC_CACHE(768),
+	KMALLOC_CACHE(1024),
+	KMALLOC_CACHE(1536),
+	KMALLOC_CACHE(2048),
+};
+
+#define KMALLOC_MAX_SIZE 2048
+
+/*
+ * kmalloc_class[(size - 1) / 8] is the smallest class that fits size.
+ */
+static unsigned char kmalloc_class[KMALLOC_MAX_SIZE / 8];
+
+/*
+ * The size classes are only used once the pages of the kernel heap have
+ * their struct pages, so kfree() can tell where an allocation came from.
+ */
+static bool kmalloc_classes_ready;
+
+#define kheap_page(_addr) \
+	page_struct((size_t) (_addr) - CONFIG_KERNEL_VIRTUAL_START)
+
+
+static void kmalloc_classes_init(void)
+{
+	unsigned i, class = 0;
+
+	for (i = 0; i < arraylen(kmalloc_class); i++) {
+		while (kmalloc_caches[class].size < (i + 1) * 8)
+			class++;
+
+		kmalloc_class[i] = class;
+	}
+}
 
 void kmalloc_early_init(void)
 {
@@ -57,26 +150,72 @@ void kmalloc_early_init(void)
 	ASSERT_LESSEQ(kmalloc_bytes_free(), kheap_early_size);
 
 	kheap_used = 0;
+
+	kmalloc_classes_init();
 }
 
-void kmalloc_late_init(void)
+/**
+ * @brief Give the free tail of the early heap back to the page allocator.
+ *
+ * vm_init() reserves everything up to BOOT_PAGING_SIZE because the early
+ * heap might be using any of it, but by now only the front has been
+ * allocated. The tail is the low 16MB of physical memory that the DMA
+ * zone exists for, and the heap can grow elsewhere from here on.
+ */
+static void kheap_release_early(void)
 {
-	char *start;
-	size_t size;
+	size_t end = (size_t) kheap_early_start + kheap_early_size;
+	vm_offset_t free_addr = (vm_offset_t) kheap_early_start;
+	vm_size_t free_size;
+	lmm_flags_t lmm_flags;
+	size_t start;
+
+	/*
+	 * Nothing has been added to the heap since kmalloc_early_init(), so
+	 * the last free block that ends at the top of the early heap is its
+	 * tail.
+	 */
+	for (;;) {
+		lmm_find_free(&kheap_lmm, &free_addr, &free_size, &lmm_flags);
+		if (free_addr >= end || free_addr + free_size >= end)
+			break;
+		free_addr += free_size;
+	}
+
+	if (free_addr >= end)
+		return;
+
+	start = PAGE_ALIGN_UP(free_addr);
+	if (start >= end)
+		return;
+
+	lmm_remove_free(&kheap_lmm, (void *) start, end - start);
+	kheap_early_size = start - (size_t) kheap_early_start;
+
+	free_pages(kheap_page(start), (end - start) / PAGE_SIZE);
 
+	INFO("kheap: released %d KB of the early heap",
+	     (end - start) / 1024);
+}
+
+void kmalloc_late_init(void)
+{
 	TRACE();
 
 	/*
-	 * We want to grow the kernel heap to kheap_end. Thus we add a
-	 * new lmm_region that starts at the end of the early heap, and
-	 * extends to kheap_end.
+	 * vm_init() has taken the early heap's pages out of the page
+	 * allocator, so their struct pages are ours to use now.
+	 */
+	kmem_cache_init_pages();
+	kmalloc_classes_ready = true;
+
+	/*
+	 * From now on the heap grows with pages from the page allocator.
 	 */
-	start = kheap_early_start + kheap_early_size;
-	size = (size_t) kheap_end - (size_t) start;
+	kheap_growable = true;
+	register_page_shrinker(&kheap_shrinker);
 
-	lmm_add_free(&kheap_lmm, start, size);
-	ASSERT_LESSEQ(kmalloc_bytes_free(),
-		      (size_t) kheap_end - (size_t) kheap_start);
+	kheap_release_early();
 }
 
 size_t kmalloc_bytes_free(void)
@@ -84,25 +223,152 @@ size_t kmalloc_bytes_free(void)
 	return lmm_avail(&kheap_lmm, 0);
 }
 
+/**
+ * @return The number of bytes allocated and not yet freed. Objects from the
+ * kmalloc size classes and other caches count at their size rather than as
+ * the slabs they sit in, so the number doesn't move when a cache grows or
+ * keeps an empty slab around.
+ */
 size_t kmalloc_bytes_used(void)
 {
-	return kheap_used;
+	return kheap_used - kmem_cache_slab_bytes() + kmem_cache_object_bytes();
 }
 
-static void *__kmalloc(size_t size)
+/**
+ * @brief Add enough whole chunks to the heap to hold an allocation of size
+ * bytes aligned to align.
+ *
+ * The chunks come from the direct mapped zones, so everything in the heap
+ * is still direct mapped and its physical address is known (page tables
+ * and DMA descriptors depend on this). A block from the page allocator is
+ * aligned to its own size, so the new chunks always fit the allocation.
+ *
+ * The page allocator isn't allowed to call the shrinkers here, because we
+ * may be growing a slab with its cache locked.
+ *
+ * @return false if there weren't enough free pages.
+ */
+static bool kheap_grow(size_t size, size_t align)
 {
+	unsigned long nchunks, first, i;
 	unsigned long flags;
-	void *chunk;
+	struct page *pages;
+	size_t addr;
+
+	if (!kheap_growable)
+		return false;
+
+	nchunks = CEIL(KHEAP_CHUNK_SIZE, umax(size, align)) / KHEAP_CHUNK_SIZE;
+
+	pages = __alloc_zone_pages(ZONE_NORMAL, nchunks * KHEAP_CHUNK_PAGES);
+	if (!pages)
+		return false;
+
+	addr = page_address(pages) + CONFIG_KERNEL_VIRTUAL_START;
+	ASSERT_LESSEQ(addr + nchunks * KHEAP_CHUNK_SIZE, (size_t) kheap_end);
+
+	first = page_address(pages) / KHEAP_CHUNK_SIZE;
 
 	spin_lock_irq(&kmalloc_lock, &flags);
 
-	chunk = lmm_alloc(&kheap_lmm, size, 0);
-	if (!chunk)
-		goto out;
+	for (i = first; i < first + nchunks; i++)
+		kheap_chunk_map[i] = 1;
+	kheap_chunks += nchunks;
+
+	lmm_add_free(&kheap_lmm, (void *) addr, nchunks * KHEAP_CHUNK_SIZE);
+
+	spin_unlock_irq(&kmalloc_lock, flags);
+	return true;
+}
+
+/**
+ * @brief The page shrinker for the kernel heap. Gives every chunk that is
+ * entirely free back to the page allocator.
+ *
+ * @return The number of pages freed.
+ */
+static unsigned long kheap_shrink(void)
+{
+	unsigned long flags, i;
+	unsigned long freed = 0;
+
+	/*
+	 * Empty slabs would keep otherwise free chunks in the heap.
+	 */
+	kmem_cache_shrink();
+
+	spin_lock_irq(&kmalloc_lock, &flags);
+
+	for (i = 0; i < KHEAP_MAX_CHUNKS && kheap_chunks; i++) {
+		size_t addr = CONFIG_KERNEL_VIRTUAL_START + i * KHEAP_CHUNK_SIZE;
+		vm_offset_t free_addr = addr;
+		vm_size_t free_size;
+		lmm_flags_t lmm_flags;
+
+		if (!kheap_chunk_map[i])
+			continue;
+
+		lmm_find_free(&kheap_lmm, &free_addr, &free_size, &lmm_flags);
+		if (free_addr != addr || free_size < KHEAP_CHUNK_SIZE)
+			continue;
+
+		lmm_remove_free(&kheap_lmm, (void *) addr, KHEAP_CHUNK_SIZE);
+		kheap_chunk_map[i] = 0;
+		kheap_chunks--;
+
+		free_pages(kheap_page(addr), KHEAP_CHUNK_PAGES);
+		freed += KHEAP_CHUNK_PAGES;
+	}
 
-	kheap_used += size;
-out:
 	spin_unlock_irq(&kmalloc_lock, flags);
+	return freed;
+}
+
+/**
+ * @brief Allocate size bytes aligned to 2^shift from the LMM heap, growing
+ * the heap if there's no room.
+ */
+static void *kheap_alloc(size_t size, unsigned shift)
+{
+	unsigned long flags;
+	void *chunk;
+
+	do {
+		spin_lock_irq(&kmalloc_lock, &flags);
+
+		chunk = lmm_alloc_aligned(&kheap_lmm, size, 0, shift, 0);
+		if (chunk)
+			kheap_used += size;
+
+		spin_unlock_irq(&kmalloc_lock, flags);
+	} while (!chunk && kheap_grow(size, 1UL << shift));
+
+	return chunk;
+}
+
+static void *__kmalloc(size_t size)
+{
+	return kheap_alloc(size, 0);
+}
+
+/**
+ * @brief Allocate whole pages for an allocation too big for the size
+ * classes, and remember how many in the first page's struct page.
+ */
+static void *kmalloc_large(size_t size)
+{
+	unsigned long npages = PAGE_ALIGN_UP(size) / PAGE_SIZE;
+	struct page *page;
+	void *chunk;
+
+	chunk = kmemalign(PAGE_SIZE, npages * PAGE_SIZE);
+	if (!chunk)
+		return NULL;
+
+	page = kheap_page(chunk);
+	page->flags |= PG_KMALLOC;
+	page->kmalloc_pages = npages;
+
 	return chunk;
 }
 
@@ -115,7 +381,16 @@ out:
  */
 void *kmalloc(size_t size)
 {
-	return __kmalloc(size);
+	if (!kmalloc_classes_ready)
+		return __kmalloc(size);
+
+	if (size <= KMALLOC_MAX_SIZE) {
+		unsigned class = kmalloc_class[size ? (size - 1) / 8 : 0];
+
+		return kmem_cache_alloc(&kmalloc_caches[class]);
+	}
+
+	return kmalloc_large(size);
 }
 
 /**
@@ -133,31 +408,15 @@ void *kmalloc(size_t size)
  */
 void *kmemalign(size_t alignment, size_t size)
 {
-	unsigned long flags;
 	unsigned shift;
-	void *chunk;
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wsign-compare"
 	/* Find the alignment shift in bits.  XXX use proc_ops.h  */
 	for (shift = 0; (1 << shift) < alignment; shift++);
-
-	spin_lock_irq(&kmalloc_lock, &flags);
-
-	/*
-	 * Allocate a chunk of LMM memory with the specified alignment shift
-	 * and an offset such that the memory block we return will be aligned.
-	 */
-	chunk = lmm_alloc_aligned(&kheap_lmm, size, 0, shift, 0);
-	if (!chunk)
-		goto out;
-
 #pragma GCC diagnostic pop
 
-	kheap_used += size;
-out:
-	spin_unlock_irq(&kmalloc_lock, flags);
-	return chunk;
+	return kheap_alloc(size, shift);
 }
 
 /**
@@ -168,8 +427,24 @@ out:
  */
 void kfree(void *buf, size_t size)
 {
+	struct kmem_cache *cache;
 	unsigned long flags;
 
+	cache = kmem_cache_of(buf);
+	if (cache) {
+		kmem_cache_free(cache, buf);
+		return;
+	}
+
+	if (kmalloc_classes_ready) {
+		struct page *page = kheap_page(buf);
+
+		if (page->flags & PG_KMALLOC) {
+			size = page->kmalloc_pages * PAGE_SIZE;
+			page->flags &= ~PG_KMALLOC;
+		}
+	}
+
 	kheap_used -= size;
 
 	spin_lock_irq(&kmalloc_lock, &flags);
@@ -178,3 +453,80 @@ void kfree(void *buf, size_t size)
 
 	spin_unlock_irq(&kmalloc_lock, flags);
 }
+
+/**
+ * @return The number of usable bytes in buf, which must have come from
+ * kmalloc() after vm_init().
+ */
+size_t ksize(const void *buf)
+{
+	struct kmem_cache *cache;
+	struct page *page;
+
+	cache = kmem_cache_of(buf);
+	if (cache)
+		return cache->size;
+
+	page = kheap_page(buf);
+	if (!page || !(page->flags & PG_KMALLOC))
+		panic("ksize: 0x%08x wasn't allocated by kmalloc", buf);
+
+	return page->kmalloc_pages * PAGE_SIZE;
+}
+
+/**
+ * @brief Free memory from kmalloc() without knowing its size. The size
+ * is found from the struct page of the memory.
+ */
+void kfree_nosize(void *buf)
+{
+	kfree(buf, ksize(buf));
+}
+
+#include <kernel/test.h>
+
+static unsigned long free_page_count(void)
+{
+	struct page_zone *zone;
+	unsigned long n = 0;
+
+	drain_pages();
+	for (zone = zones; zone < zones + MAX_ZONES; zone++)
+		n += zone->num_free;
+
+	return n;
+}
+
+BEGIN_TEST(kheap_grow_test)
+{
+#define N 16
+	void *bufs[N];
+	unsigned long chunks = kheap_chunks;
+	unsigned long free;
+	int i;
+
+	/*
+	 * Use more than the early heap has, so the heap has to grow.
+	 */
+	for (i = 0; i < N; i++) {
+		bufs[i] = kmalloc(MB(1));
+		ASSERT_NOT_NULL(bufs[i]);
+		memset(bufs[i], i, MB(1));
+	}
+
+	ASSERT_GREATER(kheap_chunks, chunks);
+
+	for (i = 0; i < N; i++)
+		kfree(bufs[i], MB(1));
+
+	/*
+	 * The chunks grown for the test are empty again, so the shrinker
+	 * gives them back to the page allocator.
+	 */
+	free = free_page_count();
+	ASSERT_GREATER(kheap_shrink(), 0);
+	ASSERT_LESSEQ(kheap_chunks, chunks);
+	ASSERT_GREATER(free_page_count(), free);
+#undef N
+}
+END_TEST
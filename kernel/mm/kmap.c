@@ -1,9 +1,20 @@
 /**
  * @file mm/kmap.c
+ *
+ * kmap() hands out pages of the kmap region from a bitmap, and can be held
+ * for as long as needed. kmap_atomic() is for short sections that don't
+ * sleep: each cpu has a few fixed slots at the top of the kmap region,
+ * used like a stack, so it needs no allocation and no lock.
+ *
+ * Pages in kdirect are already mapped, so both just return the page's
+ * kdirect address.
  */
+#include <mm/kmap.h>
 #include <mm/pages.h>
 #include <arch/vm.h>
+#include <arch/cpu.h>
 #include <kernel/spinlock.h>
+#include <kernel/sched.h>
 #include <assert.h>
 
 char *kmap_start;
@@ -15,12 +26,62 @@ char  *kmap_bitmap;
 size_t kmap_bitmap_size;
 static struct spinlock kmap_lock = INITIALIZED_SPINLOCK;
 
-#define KMAP_VM_FLAGS (VM_S | VM_P | VM_R | VM_W)
+/*
+ * The kmap_atomic() slots of cpu c are the KMAP_ATOMIC_SLOTS pages from
+ * kmap_atomic_start + c * KMAP_ATOMIC_SLOTS * PAGE_SIZE.
+ * kmap_atomic_depth[c] is the number of those in use.
+ */
+static char *kmap_atomic_start;
+static unsigned long kmap_atomic_depth[CONFIG_NR_CPUS];
+
+/*
+ * kmap addresses are the same in every address space, so they're global and
+ * stay in the TLB across address space switches. Every unmap or remap
+ * invalidates the page explicitly, which drops global entries too.
+ */
+#define KMAP_VM_FLAGS (VM_S | VM_P | VM_R | VM_W | VM_G)
+
+/**
+ * @brief The kdirect address of page, or NULL if the page isn't in kdirect.
+ */
+static inline void *kdirect_address(struct page *page)
+{
+	phys_addr_t phys = page_address(page);
+
+	if (phys >= (size_t) kdirect_end - (size_t) kdirect_start)
+		return NULL;
+
+	return kdirect_start + (size_t) phys;
+}
+
+static inline bool is_kdirect_address(void *virt)
+{
+	return (char *) virt >= kdirect_start && (char *) virt < kdirect_end;
+}
+
+static inline unsigned long kmap_atomic_slot(int cpu, unsigned long idx)
+{
+	return (unsigned long) kmap_atomic_start +
+		(cpu * KMAP_ATOMIC_SLOTS + idx) * PAGE_SIZE;
+}
 
 void kmap_init(void)
 {
 	TRACE();
 
+	/*
+	 * Take the kmap_atomic() slots off the top of the kmap region, and
+	 * create their page table now so mapping a slot never allocates.
+	 */
+	kmap_atomic_start = kmap_end - CONFIG_NR_CPUS * KMAP_ATOMIC_SLOTS *
+				       PAGE_SIZE;
+	kmap_end = kmap_atomic_start;
+
+	if (mmu_alloc_page_tables(kernel_space.mmu,
+				  (unsigned long) kmap_atomic_start,
+				  kmap_atomic_slot(CONFIG_NR_CPUS, 0)))
+		panic("Failed to allocate the kmap_atomic page table.");
+
 	kmap_bitmap_size = ((size_t) kmap_end - (size_t) kmap_start) / PAGE_SIZE / 8;
 	kmap_bitmap = kmalloc(kmap_bitmap_size);
 	if (!kmap_bitmap) {
@@ -54,7 +115,7 @@ void *kmap_alloc_page(void)
 	spin_lock_irq(&kmap_lock, &flags);
 
 	for (block = kmap_bitmap; block < kmap_bitmap + kmap_bitmap_size; block++) {
-		if (block) {
+		if (*block != (char) 0xff) {
 			int bit;
 
 			for (bit = 0; ((*block >> bit) & 1) != 0; bit++)
@@ -144,7 +205,11 @@ void *kmap(struct page *page)
 	void *virt;
 	int error;
 
-	TRACE("page=%p (0x%08x)", page, page_address(page));
+	TRACE("page=%p (0x%09llx)", page, (u64) page_address(page));
+
+	virt = kdirect_address(page);
+	if (virt)
+		return virt;
 
 	virt = kmap_alloc_page();
 	if (!virt) {
@@ -167,6 +232,9 @@ void kunmap(void *virt)
 {
 	TRACE("virt=%p", virt);
 
+	if (is_kdirect_address(virt))
+		return;
+
 	virt = (void *) PAGE_ALIGN_DOWN(virt);
 
 	mmu_unmap_page(kernel_space.mmu, (unsigned long) virt);
@@ -174,6 +242,63 @@ void kunmap(void *virt)
 	kmap_free_page(virt);
 }
 
+/**
+ * @brief Map a page into the kernel for a short time. Preemption is
+ * disabled until the matching kunmap_atomic(), so the caller must not
+ * sleep. Mappings nest, and must be undone in the reverse order.
+ *
+ * Mapping a slot invalidates whatever the slot mapped before, so
+ * kunmap_atomic() doesn't have to.
+ *
+ * @return The virtual address of the page. This never fails.
+ */
+void *kmap_atomic(struct page *page)
+{
+	unsigned long virt, idx;
+	void *kdirect;
+	int cpu;
+	int ret;
+
+	kdirect = kdirect_address(page);
+	if (kdirect)
+		return kdirect;
+
+	disable_save_preemption();
+
+	cpu = cpu_id();
+	idx = kmap_atomic_depth[cpu]++;
+	ASSERT_LESS(idx, KMAP_ATOMIC_SLOTS);
+
+	virt = kmap_atomic_slot(cpu, idx);
+
+	ret = mmu_map_page(kernel_space.mmu, virt, page, KMAP_VM_FLAGS);
+	ASSERT_EQUALS(ret, 0);
+
+	tlb_invalidate(virt, PAGE_SIZE);
+	return (void *) virt;
+}
+
+/**
+ * @brief Undo the most recent kmap_atomic() on this cpu.
+ *
+ * The slot keeps its mapping until it's used again, which is harmless:
+ * it's only reachable from the kernel, and nothing knows its address.
+ */
+void kunmap_atomic(void *virt)
+{
+	int cpu = cpu_id();
+
+	if (is_kdirect_address(virt))
+		return;
+
+	ASSERT_GREATER(kmap_atomic_depth[cpu], 0);
+	ASSERT_EQUALS(PAGE_ALIGN_DOWN(virt),
+		      kmap_atomic_slot(cpu, kmap_atomic_depth[cpu] - 1));
+
+	kmap_atomic_depth[cpu]--;
+	restore_preemption();
+}
+
 #include <kernel/test.h>
 BEGIN_TEST(kmap_test)
 {
@@ -198,3 +323,34 @@ BEGIN_TEST(kmap_test)
 	kfree(mem, PAGE_SIZE);
 }
 END_TEST
+
+BEGIN_TEST(kmap_atomic_test)
+{
+	struct page *page = alloc_page();
+	char *a, *b, *c;
+
+	ASSERT_NOT_NULL(page);
+
+	a = kmap_atomic(page);
+	memset(a, 0x5a, PAGE_SIZE);
+
+	/*
+	 * A nested mapping of the same page sees the same memory.
+	 */
+	b = kmap_atomic(page);
+	ASSERT_EQUALS(b[0], 0x5a);
+	ASSERT_EQUALS(b[PAGE_SIZE - 1], 0x5a);
+	b[1] = 0x11;
+	kunmap_atomic(b);
+
+	ASSERT_EQUALS(a[1], 0x11);
+	kunmap_atomic(a);
+
+	c = kmap(page);
+	ASSERT_EQUALS(c[0], 0x5a);
+	ASSERT_EQUALS(c[1], 0x11);
+	kunmap(c);
+
+	free_page(page);
+}
+END_TEST
@@ -43,7 +43,8 @@ void lmm_add_region(lmm_t *lmm, lmm_region_t *reg,
 		return;
 
 	/* Initialize the new region header.  */
-	reg->nodes = 0;
+	rb_init(&reg->addr_tree);
+	rb_init(&reg->size_tree);
 	reg->min = min;
 	reg->max = max;
 	reg->flags = flags;
@@ -18,73 +18,12 @@
  * CSL requests users of this software to return to csl-dist@cs.utah.edu any
  * improvements that they make and grant CSL redistribution rights.
  */
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wtype-limits"
-#pragma GCC diagnostic ignored "-Wpointer-arith"
 
 #include <mm/lmm.h>
 #include <mm/lmm_types.h>
-#include <assert.h>
 
 void *lmm_alloc(lmm_t *lmm, vm_size_t size, lmm_flags_t flags)
 {
-	struct lmm_region *reg;
-
-	assert(lmm != 0);
-	assert(size > 0);
-
-	size = (size + ALIGN_MASK) & ~ALIGN_MASK;
-
-	for (reg = lmm->regions; reg; reg = reg->next)
-	{
-		struct lmm_node **nodep, *node;
-
-		assert((reg->nodes == 0 && reg->free == 0)
-		       || ((vm_offset_t)reg->nodes >= reg->min));
-		assert(reg->free >= 0);
-		assert(reg->free <= reg->max - reg->min);
-
-		if (flags & ~reg->flags)
-			continue;
-
-		for (nodep = &reg->nodes;
-		     (node = *nodep) != 0;
-		     nodep = &node->next)
-		{
-			assert(((vm_offset_t)node & ALIGN_MASK) == 0);
-			assert(((vm_offset_t)node->size & ALIGN_MASK) == 0);
-			assert((node->next == 0) || (node->next > node));
-			assert((vm_offset_t)node < reg->max);
-
-			if (node->size >= size)
-			{
-				if (node->size > size)
-				{
-					struct lmm_node *newnode;
-
-					/* Split the node and return its head */
-					newnode = (struct lmm_node*)
-							((void*)node + size);
-					newnode->next = node->next;
-					newnode->size = node->size - size;
-					*nodep = newnode;
-				}
-				else
-				{
-					/* Remove and return the entire node. */
-					*nodep = node->next;
-				}
-
-				/* Adjust the region's free memory counter.  */
-				assert(reg->free >= size);
-				reg->free -= size;
-
-				return (void*)node;
-			}
-		}
-	}
-
-	return 0;
+	return lmm_alloc_gen(lmm, size, flags, 0, 0,
+			     (vm_offset_t)0, (vm_size_t)-1);
 }
-
-#pragma GCC diagnostic pop
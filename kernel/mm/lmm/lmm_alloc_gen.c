@@ -20,34 +20,157 @@
  */
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wtype-limits"
-#pragma GCC diagnostic ignored "-Wpointer-arith"
 
 #include <mm/lmm.h>
 #include <mm/lmm_types.h>
 #include <assert.h>
 
+/* How many of the best fitting nodes to try
+   before settling for one that is sure to fit after alignment.  */
+#define BEST_FIT_TRIES	8
+
+/* Return the address at which an aligned block of size bytes
+   could be allocated from node, or 0 if it doesn't fit.  */
+static vm_offset_t node_fit(struct lmm_node *node, vm_size_t size,
+			    vm_offset_t align_mask, vm_offset_t align_ofs,
+			    vm_offset_t in_min)
+{
+	vm_offset_t addr = (vm_offset_t)node;
+
+	if (addr < in_min)
+		addr = in_min;
+
+	/* Round up to the next address that is align_ofs
+	   beyond an alignment boundary.  */
+	addr += (align_ofs - addr) & align_mask;
+
+	/* See if the block at the adjusted address
+	   is still entirely within the node.  */
+	if ((addr < (vm_offset_t)node)
+	    || (addr - (vm_offset_t)node + size > node->size))
+		return 0;
+
+	return addr;
+}
+
+/* Carve [addr, addr + size) out of node,
+   giving back whatever is left before and after it.  */
+static void node_take(struct lmm_region *reg, struct lmm_node *node,
+		      vm_offset_t addr, vm_size_t size)
+{
+	vm_offset_t node_min = (vm_offset_t)node;
+	vm_offset_t node_max = node_min + node->size;
+	vm_offset_t min = addr & ~ALIGN_MASK;
+	vm_offset_t max = (addr + size + ALIGN_MASK) & ~ALIGN_MASK;
+
+	assert(min >= node_min);
+	assert(max <= node_max);
+
+	lmm_node_remove(reg, node);
+
+	if (min > node_min)
+		lmm_node_insert(reg, node, min - node_min);
+	if (node_max > max)
+		lmm_node_insert(reg, (struct lmm_node*)max, node_max - max);
+
+	/* Adjust the region's free memory counter.  */
+	assert(reg->free >= max - min);
+	reg->free -= max - min;
+}
+
+/* Best fit: the smallest node the aligned block fits in.
+   The few smallest nodes that are big enough are tried first;
+   failing that, the smallest node big enough to fit the block
+   however badly it is aligned.  */
+static vm_offset_t alloc_best_fit(struct lmm_region *reg, vm_size_t size,
+				  vm_offset_t align_mask, vm_offset_t align_ofs)
+{
+	struct lmm_node *node;
+	vm_offset_t addr;
+	int i;
+
+	node = lmm_node_find_size(reg, size);
+	for (i = 0; node && i < BEST_FIT_TRIES; i++)
+	{
+		addr = node_fit(node, size, align_mask, align_ofs, 0);
+		if (addr)
+			goto found;
+		node = lmm_node_next_size(node);
+	}
+
+	if (!align_mask)
+		return 0;
+
+	for (node = lmm_node_find_size(reg, size + align_mask);
+	     node;
+	     node = lmm_node_next_size(node))
+	{
+		addr = node_fit(node, size, align_mask, align_ofs, 0);
+		if (addr)
+			goto found;
+	}
+
+	return 0;
+
+found:
+	node_take(reg, node, addr, size);
+	return addr;
+}
+
+/* First fit within [in_min, in_max), in address order.
+   Only used for allocations restricted to part of a region,
+   which are rare.  */
+static vm_offset_t alloc_in_range(struct lmm_region *reg, vm_size_t size,
+				  vm_offset_t align_mask, vm_offset_t align_ofs,
+				  vm_offset_t in_min, vm_offset_t in_max)
+{
+	struct lmm_node *node;
+	vm_offset_t addr;
+
+	for (node = lmm_node_find_end(reg, in_min);
+	     node;
+	     node = lmm_node_next(node))
+	{
+		if (node->size < size)
+			continue;
+
+		addr = node_fit(node, size, align_mask, align_ofs, in_min);
+		if (!addr)
+			continue;
+
+		/* If the block extends past the range constraint,
+		   then all of the rest of the nodes in this region
+		   will extend past it too, so stop here. */
+		if (addr + size > in_max)
+			break;
+
+		node_take(reg, node, addr, size);
+		return addr;
+	}
+
+	return 0;
+}
+
 void *lmm_alloc_gen(lmm_t *lmm, vm_size_t size, unsigned flags,
 		    int align_bits, vm_offset_t align_ofs,
 		    vm_offset_t in_min, vm_size_t in_size)
 {
 	vm_offset_t in_max = in_min + in_size;
+	vm_offset_t align_mask = ((vm_offset_t)1 << align_bits) - 1;
 	struct lmm_region *reg;
 
-#if 0
-	printf("lmm_alloc_gen %08x\n", size);
-	lmm_dump(lmm);
-#endif
-
 	assert(lmm != 0);
 	assert(size > 0);
+	assert(align_bits >= 0 && align_bits < (int)(8 * sizeof(vm_offset_t)));
+
+	/* An in_size of -1 means no upper bound.  */
+	if (in_max < in_min)
+		in_max = (vm_offset_t)-1;
 
 	for (reg = lmm->regions; reg; reg = reg->next)
 	{
-		struct lmm_node **nodep, *node;
+		vm_offset_t addr;
 
-		assert((reg->nodes == 0 && reg->free == 0)
-		       || ((vm_offset_t)reg->nodes >= reg->min));
-		assert(reg->free >= 0);
 		assert(reg->free <= reg->max - reg->min);
 
 		/* First trivially reject the entire region if possible.  */
@@ -56,103 +179,16 @@ void *lmm_alloc_gen(lmm_t *lmm, vm_size_t size, unsigned flags,
 		    || (reg->max <= in_min))
 			continue;
 
-		for (nodep = &reg->nodes;
-		     (node = *nodep) != 0;
-		     nodep = &node->next)
-		{
-			vm_offset_t addr;
-			struct lmm_node *anode;
-			int i;
-
-			assert(((vm_offset_t)node & ALIGN_MASK) == 0);
-			assert(((vm_offset_t)node->size & ALIGN_MASK) == 0);
-			assert((node->next == 0) || (node->next > node));
-			assert((vm_offset_t)node < reg->max);
-
-			/* Now make a first-cut trivial elimination check
-			   to skip chunks that are _definitely_ too small.  */
-			if (node->size < size)
-				continue;
-
-			/* Now compute the address at which
-			   the allocated chunk would have to start.  */
-			addr = (vm_offset_t)node;
-			if (addr < in_min)
-				addr = in_min;
-			for (i = 0; i < align_bits; i++)
-			{
-				vm_offset_t bit = (vm_offset_t)1 << i;
-				if ((addr ^ align_ofs) & bit)
-					addr += bit;
-			}
-
-			/* See if the block at the adjusted address
-			   is still entirely within the node.  */
-			if ((addr - (vm_offset_t)node + size) > node->size)
-				continue;
-
-			/* If the block extends past the range constraint,
-			   then all of the rest of the nodes in this region
-			   will extend past it too, so stop here. */
-			if (addr + size > in_max)
-				break;
-
-			/* OK, we can allocate the block from this node.  */
-
-			/* If the allocation leaves at least ALIGN_SIZE
-			   space before it, then split the node.  */
-			anode = (struct lmm_node*)(addr & ~ALIGN_MASK);
-			assert(anode >= node);
-			if (anode > node)
-			{
-				vm_size_t split_size = (vm_offset_t)anode
-							- (vm_offset_t)node;
-				assert((split_size & ALIGN_MASK) == 0);
-				anode->next = node->next;
-				anode->size = node->size - split_size;
-				node->size = split_size;
-				nodep = &node->next;
-			}
-
-			/* Now use the first part of the anode
-			   to satisfy the allocation,
-			   splitting off the tail end if necessary.  */
-			size = ((addr & ALIGN_MASK) + size + ALIGN_MASK)
-				& ~ALIGN_MASK;
-			if (anode->size > size)
-			{
-				struct lmm_node *newnode;
-
-				/* Split the node and return its head.  */
-				newnode = (struct lmm_node*)
-						((void*)anode + size);
-				newnode->next = anode->next;
-				newnode->size = anode->size - size;
-				*nodep = newnode;
-			}
-			else
-			{
-				/* Remove and return the entire node.  */
-				*nodep = anode->next;
-			}
-
-			/* Adjust the region's free memory counter.  */
-			assert(reg->free >= size);
-			reg->free -= size;
-
-#if 0
-			printf("lmm_alloc_gen returning %08x\n", addr);
-			lmm_dump(lmm);
-#endif
+		if ((in_min <= reg->min) && (in_max >= reg->max))
+			addr = alloc_best_fit(reg, size, align_mask, align_ofs);
+		else
+			addr = alloc_in_range(reg, size, align_mask, align_ofs,
+					      in_min, in_max);
 
+		if (addr)
 			return (void*)addr;
-		}
 	}
 
-#if 0
-	printf("lmm_alloc_gen failed\n");
-#endif
-
 	return 0;
 }
 
@@ -25,7 +25,7 @@
 
 void *lmm_alloc_page(lmm_t *lmm, lmm_flags_t flags)
 {
-	return lmm_alloc_gen(lmm, PAGE_SIZE, flags, PAGE_SIZE, 0,
+	return lmm_alloc_gen(lmm, PAGE_SIZE, flags, PAGE_SHIFT, 0,
 			     (vm_offset_t)0, (vm_size_t)-1);
 }
 
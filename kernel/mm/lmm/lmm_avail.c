@@ -33,8 +33,6 @@ vm_size_t lmm_avail(lmm_t *lmm, lmm_flags_t flags)
 	count = 0;
 	for (reg = lmm->regions; reg; reg = reg->next)
 	{
-		assert((vm_offset_t)reg->nodes >= reg->min);
-		assert((vm_offset_t)reg->nodes < reg->max);
 		assert(reg->free >= 0);
 		assert(reg->free <= reg->max - reg->min);
 
@@ -38,36 +38,54 @@ void lmm_dump(lmm_t *lmm)
 
 	for (reg = lmm->regions; reg; reg = reg->next)
 	{
-		struct lmm_node *node;
-		vm_size_t free_check;
+		struct lmm_node *node, *next;
+		struct rb_node *rb;
+		vm_size_t free_check, size_check;
 
 		INFO(" region 0x%08lx-0x%08lx size=0x%08lx flags=0x%08x pri=%d free=0x%08lx",
 			reg->min, reg->max, reg->max - reg->min,
 			reg->flags, reg->pri, reg->free);
 
-		ASSERT((reg->nodes == 0)
-		       || (vm_offset_t)reg->nodes >= reg->min);
-		ASSERT((reg->nodes ==0) || (vm_offset_t)reg->nodes < reg->max);
 		ASSERT(reg->free >= 0);
 		ASSERT(reg->free <= reg->max - reg->min);
 
 		free_check = 0;
-		for (node = reg->nodes; node; node = node->next)
+		for (node = lmm_node_first(reg); node; node = next)
 		{
+			next = lmm_node_next(node);
+
 			INFO("  node %p-0x%08lx size=0x%08lx next=%p",
-				node, (vm_offset_t)node + node->size, node->size, node->next);
+				node, (vm_offset_t)node + node->size, node->size, next);
 
 			ASSERT(((vm_offset_t)node & ALIGN_MASK) == 0);
 			ASSERT((node->size & ALIGN_MASK) == 0);
 			ASSERT(node->size >= sizeof(*node));
-			ASSERT((node->next == 0) || (node->next > node));
-			ASSERT((vm_offset_t)node < reg->max);
+			ASSERT((vm_offset_t)node >= reg->min);
+			ASSERT((vm_offset_t)node + node->size <= reg->max);
+
+			/* Adjacent free nodes should have been coalesced.  */
+			ASSERT((next == 0) ||
+			       ((vm_offset_t)node + node->size < (vm_offset_t)next));
 
 			free_check += node->size;
 		}
 
+		/* The size index must hold the same nodes, in size order.  */
+		size_check = 0;
+		for (rb = rb_first(&reg->size_tree); rb; rb = rb_next(rb))
+		{
+			node = rb_entry(rb, struct lmm_node, size_link);
+			next = rb_next(rb) ?
+				rb_entry(rb_next(rb), struct lmm_node, size_link) : 0;
+
+			ASSERT((next == 0) || (node->size <= next->size));
+
+			size_check += node->size;
+		}
+
 		INFO(" free_check=0x%08lx", free_check);
 		ASSERT(reg->free == free_check);
+		ASSERT(reg->free == size_check);
 	}
 
 	INFO("lmm_dump done");
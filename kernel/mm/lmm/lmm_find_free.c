@@ -36,39 +36,33 @@ void lmm_find_free(lmm_t *lmm, vm_offset_t *inout_addr,
 	{
 		struct lmm_node *node;
 
-		if ((reg->nodes == 0)
+		if (rb_empty(&reg->addr_tree)
 		    || (reg->max <= start_addr)
 		    || (reg->min > lowest_addr))
 			continue;
 
-		for (node = reg->nodes; node; node = node->next)
-		{
-			assert((vm_offset_t)node >= reg->min);
-			assert((vm_offset_t)node < reg->max);
+		node = lmm_node_find_end(reg, start_addr);
+		if (!node || (vm_offset_t)node >= lowest_addr)
+			continue;
 
-			if ((vm_offset_t)node >= lowest_addr)
-				break;
-			if ((vm_offset_t)node + node->size > start_addr)
-			{
-				if ((vm_offset_t)node > start_addr)
-				{
-					lowest_addr = (vm_offset_t)node;
-					lowest_size = node->size;
-				}
-				else
-				{
-					lowest_addr = start_addr;
-					lowest_size = node->size
-						- (lowest_addr - (vm_offset_t)node);
-				}
-				lowest_flags = reg->flags;
-				break;
-			}
+		assert((vm_offset_t)node >= reg->min);
+		assert((vm_offset_t)node < reg->max);
+
+		if ((vm_offset_t)node > start_addr)
+		{
+			lowest_addr = (vm_offset_t)node;
+			lowest_size = node->size;
 		}
+		else
+		{
+			lowest_addr = start_addr;
+			lowest_size = node->size
+				- (lowest_addr - (vm_offset_t)node);
+		}
+		lowest_flags = reg->flags;
 	}
 
 	*inout_addr = lowest_addr;
 	*out_size = lowest_size;
 	*out_flags = lowest_flags;
 }
-
@@ -29,6 +29,7 @@ void lmm_free(lmm_t *lmm, void *block, vm_size_t size)
 	struct lmm_node *node = (struct lmm_node*)
 				((vm_offset_t)block & ~ALIGN_MASK);
 	struct lmm_node *prevnode, *nextnode;
+	vm_offset_t min, max;
 
 	assert(lmm != 0);
 	assert(block != 0);
@@ -36,16 +37,15 @@ void lmm_free(lmm_t *lmm, void *block, vm_size_t size)
 
 	size = (((vm_offset_t)block & ALIGN_MASK) + size + ALIGN_MASK)
 		& ~ALIGN_MASK;
+	min = (vm_offset_t)node;
+	max = min + size;
 
 	/* First find the region to add this block to.  */
 	for (reg = lmm->regions; ; reg = reg->next)
 	{
 		assert(reg != 0);
-		assert((reg->nodes == 0 && reg->free == 0)
-		       || ((vm_offset_t)reg->nodes >= reg->min));
 
-		if (((vm_offset_t)node >= reg->min)
-		    && ((vm_offset_t)node < reg->max))
+		if ((min >= reg->min) && (min < reg->max))
 			break;
 	}
 
@@ -53,56 +53,33 @@ void lmm_free(lmm_t *lmm, void *block, vm_size_t size)
 	reg->free += size;
 	assert(reg->free <= reg->max - reg->min);
 
-	/* Now find the location in that region's free list
-	   at which to add the node.  */
-	for (prevnode = 0, nextnode = reg->nodes;
-	     (nextnode != 0) && (nextnode < node);
-	     prevnode = nextnode, nextnode = nextnode->next);
-
-	/* Coalesce the new free chunk into the previous chunk if possible.  */
-	if ((prevnode) &&
-	    ((vm_offset_t)prevnode + prevnode->size >= (vm_offset_t)node))
+	/* Find the free nodes on either side of the block.  */
+	nextnode = lmm_node_find_end(reg, min);
+	if (nextnode)
 	{
-		assert((vm_offset_t)prevnode + prevnode->size
-		       == (vm_offset_t)node);
-
-		/* Coalesce prevnode with nextnode if possible.  */
-		if (((vm_offset_t)nextnode)
-		    && ((vm_offset_t)node + size >= (vm_offset_t)nextnode))
-		{
-			assert((vm_offset_t)node + size
-			       == (vm_offset_t)nextnode);
-
-			prevnode->size += size + nextnode->size;
-			prevnode->next = nextnode->next;
-		}
-		else
-		{
-			/* Not possible -
-			   just grow prevnode around newly freed memory.  */
-			prevnode->size += size;
-		}
+		struct rb_node *rb = rb_prev(&nextnode->addr_link);
+		prevnode = rb ? rb_entry(rb, struct lmm_node, addr_link) : 0;
 	}
 	else
 	{
-		/* Insert the new node into the free list.  */
-		if (prevnode)
-			prevnode->next = node;
-		else
-			reg->nodes = node;
+		struct rb_node *rb = rb_last(&reg->addr_tree);
+		prevnode = rb ? rb_entry(rb, struct lmm_node, addr_link) : 0;
+	}
+
+	assert(!nextnode || (vm_offset_t)nextnode >= max);
+	assert(!prevnode || (vm_offset_t)prevnode + prevnode->size <= min);
 
-		/* Try coalescing the new node with the nextnode.  */
-		if ((nextnode) &&
-		    (vm_offset_t)node + size >= (vm_offset_t)nextnode)
-		{
-			node->size = size + nextnode->size;
-			node->next = nextnode->next;
-		}
-		else
-		{
-			node->size = size;
-			node->next = nextnode;
-		}
+	/* Coalesce with the following node if possible.  */
+	if (nextnode && (vm_offset_t)nextnode == max)
+	{
+		size += nextnode->size;
+		lmm_node_remove(reg, nextnode);
 	}
-}
 
+	/* Coalesce into the previous node if possible,
+	   otherwise the block becomes a node of its own.  */
+	if (prevnode && (vm_offset_t)prevnode + prevnode->size == min)
+		lmm_node_resize(reg, prevnode, prevnode->size + size);
+	else
+		lmm_node_insert(reg, node, size);
+}
@@ -0,0 +1,151 @@
+/*
+ * Indexes of the free nodes in an LMM region.
+ *
+ * Each free node is linked into two red-black trees:
+ * the region's addr_tree, ordered by address,
+ * and its size_tree, ordered by size and then by address.
+ * Free nodes never overlap,
+ * so ordering them by address also orders them by end address.
+ */
+
+#include <mm/lmm.h>
+#include <mm/lmm_types.h>
+#include <assert.h>
+
+#define addr_node(_rb)	rb_entry(_rb, struct lmm_node, addr_link)
+#define size_node(_rb)	rb_entry(_rb, struct lmm_node, size_link)
+
+/* Is node a before node b in the size tree?  */
+static inline int size_before(struct lmm_node *a, struct lmm_node *b)
+{
+	return (a->size < b->size) || ((a->size == b->size) && (a < b));
+}
+
+static void size_tree_insert(struct lmm_region *reg, struct lmm_node *node)
+{
+	struct rb_node **link = &reg->size_tree.node, *parent = 0;
+
+	while (*link)
+	{
+		parent = *link;
+		if (size_before(node, size_node(parent)))
+			link = &parent->left;
+		else
+			link = &parent->right;
+	}
+
+	rb_link_node(&node->size_link, parent, link);
+	rb_insert_color(&node->size_link, &reg->size_tree);
+}
+
+/* Add the free block [node, node + size) to the region's indexes.
+   It must not overlap or touch any other free node.  */
+void lmm_node_insert(struct lmm_region *reg, struct lmm_node *node,
+		     vm_size_t size)
+{
+	struct rb_node **link = &reg->addr_tree.node, *parent = 0;
+
+	assert(((vm_offset_t)node & ALIGN_MASK) == 0);
+	assert((size & ALIGN_MASK) == 0);
+	assert(size >= ALIGN_SIZE);
+
+	node->size = size;
+
+	while (*link)
+	{
+		parent = *link;
+		if (node < addr_node(parent))
+			link = &parent->left;
+		else
+			link = &parent->right;
+	}
+
+	rb_link_node(&node->addr_link, parent, link);
+	rb_insert_color(&node->addr_link, &reg->addr_tree);
+
+	size_tree_insert(reg, node);
+}
+
+void lmm_node_remove(struct lmm_region *reg, struct lmm_node *node)
+{
+	rb_erase(&node->addr_link, &reg->addr_tree);
+	rb_erase(&node->size_link, &reg->size_tree);
+}
+
+/* Change the size of a free node without moving its start address.  */
+void lmm_node_resize(struct lmm_region *reg, struct lmm_node *node,
+		     vm_size_t size)
+{
+	rb_erase(&node->size_link, &reg->size_tree);
+	node->size = size;
+	size_tree_insert(reg, node);
+}
+
+/* The lowest addressed free node in the region, or 0.  */
+struct lmm_node *lmm_node_first(struct lmm_region *reg)
+{
+	struct rb_node *rb = rb_first(&reg->addr_tree);
+
+	return rb ? addr_node(rb) : 0;
+}
+
+/* The next free node by address, or 0.  */
+struct lmm_node *lmm_node_next(struct lmm_node *node)
+{
+	struct rb_node *rb = rb_next(&node->addr_link);
+
+	return rb ? addr_node(rb) : 0;
+}
+
+/* The lowest addressed free node that ends after addr, or 0.  */
+struct lmm_node *lmm_node_find_end(struct lmm_region *reg, vm_offset_t addr)
+{
+	struct rb_node *rb = reg->addr_tree.node;
+	struct lmm_node *found = 0;
+
+	while (rb)
+	{
+		struct lmm_node *node = addr_node(rb);
+
+		if ((vm_offset_t)node + node->size > addr)
+		{
+			found = node;
+			rb = rb->left;
+		}
+		else
+			rb = rb->right;
+	}
+
+	return found;
+}
+
+/* The smallest free node of at least size bytes, or 0.
+   Among nodes of the same size, the lowest addressed one.  */
+struct lmm_node *lmm_node_find_size(struct lmm_region *reg, vm_size_t size)
+{
+	struct rb_node *rb = reg->size_tree.node;
+	struct lmm_node *found = 0;
+
+	while (rb)
+	{
+		struct lmm_node *node = size_node(rb);
+
+		if (node->size >= size)
+		{
+			found = node;
+			rb = rb->left;
+		}
+		else
+			rb = rb->right;
+	}
+
+	return found;
+}
+
+/* The next free node in size order, or 0.  */
+struct lmm_node *lmm_node_next_size(struct lmm_node *node)
+{
+	struct rb_node *rb = rb_next(&node->size_link);
+
+	return rb ? size_node(rb) : 0;
+}
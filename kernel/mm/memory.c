@@ -7,24 +7,141 @@
 #include <stddef.h>
 #include <assert.h>
 #include <math.h>
+#include <string.h>
 
-size_t phys_mem_bytes; /* size of physical memory in bytes */
-size_t phys_mem_pages; /* size of physical memory in pages */
+phys_addr_t phys_mem_bytes; /* end of the highest usable physical memory */
+size_t phys_mem_pages; /* phys_mem_bytes in pages */
+
+struct mem_region mem_regions[MAX_MEM_REGIONS];
+int mem_num_regions;
 
 char *kdirect_start;
 char *kdirect_end;
 
+/*
+ * The end of the usable physical address space. Without PAE the last page
+ * is left out, so the end of a region still fits in a phys_addr_t.
+ */
+#if CONFIG_X86_PAE
+#define PHYS_MEM_LIMIT (1ULL << PHYS_ADDR_BITS)
+#else
+#define PHYS_MEM_LIMIT 0xFFFFF000ULL
+#endif
+
+/**
+ * @brief Add the usable memory [addr, addr + len) to mem_regions, keeping the
+ * list sorted and merging it with any regions it overlaps or touches.
+ *
+ * Memory that physical addresses can't reach (above 4GB without PAE, 64GB
+ * with it) is dropped.
+ */
+static void add_mem_region(u64 addr, u64 len)
+{
+	struct mem_region *r;
+	phys_addr_t start, end;
+	int i;
+
+	if (addr >= PHYS_MEM_LIMIT)
+		return;
+
+	if (addr + len > PHYS_MEM_LIMIT)
+		len = PHYS_MEM_LIMIT - addr;
+
+	start = ALIGN_UP((phys_addr_t) addr, PAGE_SIZE);
+	end = ALIGN_DOWN((phys_addr_t) (addr + len), PAGE_SIZE);
+
+	if (start >= end)
+		return;
+
+	for (i = 0; i < mem_num_regions; i++) {
+		r = &mem_regions[i];
+
+		if (end < r->start)
+			break;
+
+		if (start > r->end)
+			continue;
+
+		/*
+		 * Merge with this region, and then with any regions after it
+		 * that now overlap.
+		 */
+		if (start < r->start)
+			r->start = start;
+		if (end > r->end)
+			r->end = end;
+
+		while (i + 1 < mem_num_regions && r->end >= r[1].start) {
+			if (r[1].end > r->end)
+				r->end = r[1].end;
+
+			memmove(r + 1, r + 2, (mem_num_regions - i - 2) * sizeof(*r));
+			mem_num_regions--;
+		}
+		return;
+	}
+
+	if (mem_num_regions == MAX_MEM_REGIONS) {
+		WARN("Too many memory regions, ignoring 0x%09llx - 0x%09llx",
+		     (u64) start, (u64) end);
+		return;
+	}
+
+	r = &mem_regions[i];
+	memmove(r + 1, r, (mem_num_regions - i) * sizeof(*r));
+	r->start = start;
+	r->end = end;
+	mem_num_regions++;
+}
+
+/**
+ * @brief Build mem_regions from the multiboot memory map, or from the
+ * lower/upper memory sizes if the boot loader didn't give us a map.
+ */
+static void mem_regions_init(struct multiboot_info *mb_info)
+{
+	if (mb_info->flags & MULTIBOOT_INFO_MEM_MAP) {
+		size_t addr = mb_info->mmap_addr;
+
+		while (addr < mb_info->mmap_addr + mb_info->mmap_length) {
+			struct multiboot_mmap_entry *e = (void *) addr;
+
+			if (e->type == MULTIBOOT_MEMORY_AVAILABLE)
+				add_mem_region(e->addr, e->len);
+
+			/* size doesn't include the size field itself */
+			addr += e->size + sizeof(e->size);
+		}
+	}
+	else {
+		ASSERT(mb_info->flags & MULTIBOOT_INFO_MEMORY);
+
+		add_mem_region(0, KB(1) * mb_info->mem_lower);
+		add_mem_region(MB(1), KB(1) * mb_info->mem_upper);
+	}
+
+	ASSERT_GREATER(mem_num_regions, 0);
+}
+
 /**
  * @brief Initialize basic memory contructs from the multiboot environment
  */
 void mem_mb_init(struct multiboot_info *mb_info)
 {
-	ASSERT(mb_info->flags & MULTIBOOT_INFO_MEMORY);
+	struct mem_region *r;
+	size_t usable = 0; /* in pages */
+
+	mem_regions_init(mb_info);
 
-	phys_mem_bytes = MB(1) + (KB(1) * mb_info->mem_upper);
+	for (r = mem_regions; r < mem_regions + mem_num_regions; r++) {
+		INFO("RAM:     0x%09llx - 0x%09llx", (u64) r->start, (u64) r->end);
+		usable += (r->end - r->start) / PAGE_SIZE;
+	}
+
+	phys_mem_bytes = mem_regions[mem_num_regions - 1].end;
 	phys_mem_pages = phys_mem_bytes / PAGE_SIZE;
 
-	INFO("RAM: %d MB", phys_mem_bytes / MB(1));
+	INFO("RAM: %d MB", usable / (MB(1) / PAGE_SIZE));
 
 	kdirect_start = CONFIG_KERNEL_VIRTUAL_START;
 
@@ -52,24 +169,32 @@ void mem_mb_init(struct multiboot_info *mb_info)
 	}
 
 	/*
-	 * The kernel heap marks the end of the direct mapped pages of kernel
-	 * memory. We statically allocate some fraction of physical memory to
-	 * the kernel here. The rest goes to the user.
+	 * Direct map as much physical memory as fits below the kmap region.
+	 * The kernel heap grows into it on demand (see kmalloc.c), taking
+	 * pages from the page allocator, so whatever the heap doesn't use
+	 * goes to the user. Memory above kdirect is only reachable through
+	 * kmap.
 	 */
-	kdirect_end = (char *) umin(CONFIG_KHEAP_MAX_END,
-		CONFIG_KERNEL_VIRTUAL_START +
-		PAGE_ALIGN_DOWN(phys_mem_bytes / 4));
+	if (phys_mem_bytes < CONFIG_KHEAP_MAX_END - CONFIG_KERNEL_VIRTUAL_START)
+		kdirect_end = (char *) CONFIG_KERNEL_VIRTUAL_START +
+			      PAGE_ALIGN_DOWN((size_t) phys_mem_bytes);
+	else
+		kdirect_end = (char *) CONFIG_KHEAP_MAX_END;
 
 	kheap_end = kdirect_end;
 
 	/*
 	 * The kmap region lives at the top of the kernel's virtual address
-	 * space.
+	 * space, below the vmalloc region.
 	 */
 	kmap_start = kdirect_end;
-	kmap_end = (char *) CONFIG_KERNEL_VIRTUAL_END;
+	kmap_end = (char *) CONFIG_VMALLOC_START;
+
+	vmalloc_start = (char *) CONFIG_VMALLOC_START;
+	vmalloc_end = (char *) CONFIG_KERNEL_VIRTUAL_END;
 
 	INFO("kimg:    0x%08x - 0x%08x", kimg_start, kimg_end);
 	INFO("kheap:   0x%08x - 0x%08x", kheap_start, kheap_end);
 	INFO("kmap:    0x%08x - 0x%08x", kmap_start, kmap_end);
+	INFO("vmalloc: 0x%08x - 0x%08x", vmalloc_start, vmalloc_end);
 }
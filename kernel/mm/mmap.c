@@ -3,34 +3,157 @@
  */
 #include <mm/kmalloc.h>
 #include <mm/kmap.h>
+#include <mm/page_cache.h>
+#include <mm/shmem.h>
 #include <mm/vm.h>
 
 #include <kernel/config.h>
 #include <kernel/log.h>
 #include <kernel/proc.h>
+#include <kernel/syscall.h>
 
 #include <arch/vm.h>
 
 #include <errno.h>
 #include <math.h>
 
+struct vm_stats vm_stats;
+
+#define rb_mapping(_node) rb_entry(_node, struct vm_mapping, rb_node)
+
+void vm_space_init_mappings(struct vm_space *space)
+{
+	list_init(&space->mappings);
+	rb_init(&space->mapping_tree);
+	space->mapping_cache = NULL;
+}
+
+/**
+ * @brief The free space right before m.
+ */
+static unsigned long mapping_gap(struct vm_mapping *m)
+{
+	struct vm_mapping *prev = list_prev(m, link);
+	unsigned long start = prev ? M_END(prev) : CONFIG_USER_VIRTUAL_START;
+
+	/* kernel mappings have no room before them */
+	return m->address > start ? m->address - start : 0;
+}
+
+/**
+ * @brief Recompute the largest gap in the subtree of n from its children.
+ */
+static void mapping_augment(struct rb_node *n)
+{
+	struct vm_mapping *m = rb_mapping(n);
+	unsigned long max_gap = m->gap;
+
+	if (n->left)
+		max_gap = umax(max_gap, rb_mapping(n->left)->max_gap);
+	if (n->right)
+		max_gap = umax(max_gap, rb_mapping(n->right)->max_gap);
+
+	m->max_gap = max_gap;
+}
+
+/**
+ * @brief Recompute m's gap after the mapping before it changed.
+ */
+static void update_gap(struct vm_mapping *m)
+{
+	if (!m)
+		return;
+
+	m->gap = mapping_gap(m);
+	rb_augment_propagate(&m->rb_node, mapping_augment);
+}
+
+/**
+ * @brief Add m to space's mappings. m must not overlap any of them.
+ */
+void vm_insert_mapping(struct vm_space *space, struct vm_mapping *m)
+{
+	struct rb_node **link = &space->mapping_tree.node;
+	struct rb_node *parent = NULL;
+	struct vm_mapping *prev = NULL;
+
+	while (*link) {
+		parent = *link;
+
+		if (m->address < rb_mapping(parent)->address) {
+			link = &parent->left;
+		}
+		else {
+			prev = rb_mapping(parent);
+			link = &parent->right;
+		}
+	}
+
+	/*
+	 * Keep the list in the same order as the tree.
+	 */
+	if (prev)
+		list_insert_after(&space->mappings, prev, m, link);
+	else
+		list_insert_head(&space->mappings, m, link);
+
+	m->gap = mapping_gap(m);
+	rb_link_node(&m->rb_node, parent, link);
+	rb_insert_augmented(&m->rb_node, &space->mapping_tree,
+			    mapping_augment);
+
+	/* the next mapping has less room before it now */
+	update_gap(list_next(m, link));
+}
+
+void vm_remove_mapping(struct vm_space *space, struct vm_mapping *m)
+{
+	struct vm_mapping *next = list_next(m, link);
+
+	if (space->mapping_cache == m)
+		space->mapping_cache = NULL;
+
+	rb_erase_augmented(&m->rb_node, &space->mapping_tree,
+			   mapping_augment);
+	list_remove(&space->mappings, m, link);
+
+	update_gap(next);
+}
+
+/**
+ * @brief Update the gap index after m's address or size changed.
+ */
+void vm_mapping_changed(struct vm_mapping *m)
+{
+	update_gap(m);
+	update_gap(list_next(m, link));
+}
+
 /**
  * @return The mapping that contains <addr> or NULL if none exists.
  */
-static struct vm_mapping *find_mapping(struct vm_space *space,
-				       unsigned long addr)
+struct vm_mapping *vm_find_mapping(struct vm_space *space, unsigned long addr)
 {
-	struct vm_mapping *m;
+	struct vm_mapping *m = space->mapping_cache;
+	struct rb_node *n;
 
-	list_foreach(m, &space->mappings, link) {
-		/*
-		 * Found an overlapping region
-		 */
-		if (m->address <= addr && M_END(m) > addr) {
+	if (m && m->address <= addr && M_END(m) > addr)
+		return m;
+
+	n = space->mapping_tree.node;
+	while (n) {
+		m = rb_mapping(n);
+
+		if (addr < m->address) {
+			n = n->left;
+		}
+		else if (addr >= M_END(m)) {
+			n = n->right;
+		}
+		else {
+			space->mapping_cache = m;
 			return m;
 		}
-
-		if (m->address > addr) break;
 	}
 
 	return NULL;
@@ -40,114 +163,484 @@ static struct vm_mapping *find_mapping(struct vm_space *space,
  * @brief Return the first mapping in space that overlaps with
  * [addr, addr + length).
  */
-static struct vm_mapping *find_first_overlapping(struct vm_space *space,
-						 unsigned long addr,
-						 unsigned long length)
+struct vm_mapping *vm_find_first_overlapping(struct vm_space *space,
+					     unsigned long addr,
+					     unsigned long length)
 {
-	struct vm_mapping *m;
+	struct vm_mapping *first = NULL;
+	struct rb_node *n;
 
-	list_foreach(m, &space->mappings, link) {
-		if (check_overlap(addr, length, m->address, M_LENGTH(m))) {
-			return m;
+	/*
+	 * Find the lowest mapping that ends after addr...
+	 */
+	n = space->mapping_tree.node;
+	while (n) {
+		struct vm_mapping *m = rb_mapping(n);
+
+		if (M_END(m) > addr) {
+			first = m;
+			n = n->left;
+		}
+		else {
+			n = n->right;
 		}
 	}
 
+	/*
+	 * ... which overlaps if it starts before addr + length.
+	 */
+	if (first && check_overlap(addr, length, first->address,
+				   M_LENGTH(first)))
+		return first;
+
 	return NULL;
 }
 
 /**
- * @brief A page fault occurred on a mapping backed on a file. This function 
- * will map the page and fill it with the contents of the file.
+ * @brief The lowest address in the free range [start, end) that fits
+ * length bytes aligned to align, within [low, high).
+ *
+ * @return the address, 0 if it doesn't fit.
+ */
+static unsigned long fit_in_gap(unsigned long start, unsigned long end,
+				unsigned long length, unsigned long align,
+				unsigned long low, unsigned long high)
+{
+	/* CEIL() may wrap to 0, which is never a valid answer anyway */
+	start = CEIL(align, umax(start, low));
+	end = umin(end, high);
+
+	if (!start || start >= end || end - start < length)
+		return 0;
+
+	return start;
+}
+
+/**
+ * @brief Find the lowest free range of length bytes in [low, high), aligned
+ * to align (a multiple of PAGE_SIZE).
+ *
+ * Walks down the mapping tree skipping every subtree whose largest gap is
+ * too small, so this takes O(log n). Only gaps big enough for any alignment
+ * of the range are looked for, so a smaller gap that happens to be aligned
+ * right can be missed.
+ *
+ * @return the address, 0 if there is no room.
  */
-static int page_fault_file(struct vm_mapping *m, unsigned long addr)
+unsigned long vm_find_free_range(struct vm_space *space, unsigned long length,
+				 unsigned long align, unsigned long low,
+				 unsigned long high)
+{
+	unsigned long need = length + (align - PAGE_SIZE);
+	struct rb_node *n = space->mapping_tree.node;
+	struct vm_mapping *m, *last;
+	unsigned long addr;
+	bool descend = true;
+
+	TRACE("length=0x%x, align=0x%x, low=0x%08x, high=0x%08x", length,
+	      align, low, high);
+
+	if (need < length)
+		return 0;
+
+	if (!n || rb_mapping(n)->max_gap < need)
+		goto last_gap;
+
+	for (;;) {
+		m = rb_mapping(n);
+
+		/*
+		 * Lower gaps first, if one of them is big enough and they don't
+		 * all end below low.
+		 */
+		if (descend && n->left && rb_mapping(n->left)->max_gap >= need &&
+		    m->address > low) {
+			n = n->left;
+			continue;
+		}
+
+		/* everything from here on is above high */
+		if (m->address - m->gap >= high)
+			return 0;
+
+		if (m->gap >= need) {
+			addr = fit_in_gap(m->address - m->gap, m->address,
+					  length, align, low, high);
+			if (addr)
+				return addr;
+		}
+
+		if (n->right && rb_mapping(n->right)->max_gap >= need) {
+			n = n->right;
+			descend = true;
+			continue;
+		}
+
+		/*
+		 * Nothing left here, go back up to the first mapping above
+		 * this subtree.
+		 */
+		for (;;) {
+			struct rb_node *child = n;
+
+			n = n->parent;
+			if (!n)
+				goto last_gap;
+			if (n->left == child)
+				break;
+		}
+		descend = false;
+	}
+
+last_gap:
+	/* the room after the last mapping isn't in the tree */
+	last = list_tail(&space->mappings);
+	if (last && !M_END(last))
+		return 0;
+
+	return fit_in_gap(last ? M_END(last) : CONFIG_USER_VIRTUAL_START,
+			  CONFIG_USER_VIRTUAL_END, length, align, low, high);
+}
+
+/*
+ * Read faults on anonymous memory map this one page of zeros read-only
+ * instead of a page of their own. The first write to the page then goes
+ * through page_fault_cow(), which gives the process a private page. The
+ * kernel keeps its own reference to the zero page so it is never freed.
+ */
+struct page *zero_page;
+
+static struct page *get_zero_page(void)
+{
+	if (!zero_page)
+		zero_page = alloc_zeroed_page();
+
+	return zero_page;
+}
+
+unsigned long vm_fault_around = 16;
+
+/**
+ * @brief Map the pages around a read fault at addr that can be had without
+ * any I/O, so that touching them later doesn't fault.
+ *
+ * The window is the vm_fault_around pages aligned block around addr, cut
+ * down to the mapping and to the page table addr is in. File pages must be
+ * in the page cache or the file's own memory already; anonymous pages get
+ * the zero page. Everything is mapped read-only, so writes still go through
+ * page_fault_cow().
+ */
+static void fault_around(struct vm_mapping *m, unsigned long addr)
+{
+	unsigned long table = FLOOR(MMU_LARGE_PAGE_SIZE, addr);
+	unsigned long virt, last, n;
+	struct page *page;
+
+	if (vm_fault_around < 2)
+		return;
+
+	/* inclusive bounds, M_END() may wrap to 0 */
+	virt = FLOOR(vm_fault_around * PAGE_SIZE, addr);
+	last = virt + (vm_fault_around * PAGE_SIZE - 1);
+	virt = umax(virt, umax(m->address, table));
+	last = umin(last, umin(M_END(m) - 1, table + (MMU_LARGE_PAGE_SIZE - 1)));
+
+	for (n = (last - virt) / PAGE_SIZE + 1; n; n--, virt += PAGE_SIZE) {
+		if (mmu_page_mapped(m->space->mmu, virt))
+			continue;
+
+		if (m->file) {
+			page = page_cache_lookup(m->file,
+						 m->foff + (virt - m->address));
+			if (!page)
+				continue;
+		}
+		else {
+			page = zero_page;
+			page_get(page);
+		}
+
+		if (mmu_map_page(m->space->mmu, virt, page, m->flags & ~VM_W)) {
+			page_put(page);
+			return;
+		}
+
+		/*
+		 * Nothing was mapped here, so there is nothing in the TLB to
+		 * invalidate.
+		 */
+		if (page == zero_page)
+			vm_stats.zero_page_maps++;
+		else
+			m->space->rss++;
+		vm_stats.fault_around_maps++;
+	}
+}
+
+/**
+ * @brief Allocate a private copy of a page.
+ */
+static struct page *copy_page(struct page *page)
+{
+	struct page *copy;
+	char *src, *dst;
+
+	copy = alloc_page();
+	if (!copy)
+		return NULL;
+
+	src = kmap_atomic(page);
+	dst = kmap_atomic(copy);
+	memcpy(dst, src, PAGE_SIZE);
+	kunmap_atomic(dst);
+	kunmap_atomic(src);
+
+	return copy;
+}
+
+/**
+ * @brief A page fault occurred on a mapping backed on a file.
+ *
+ * The page comes from the page cache. Unless this is a write to a writable
+ * mapping, the cached page itself is mapped read-only, and shared with
+ * every other mapping of it; a later write goes through page_fault_cow()
+ * like it does after a fork. A write gets a private copy right away.
+ *
+ * Shared mappings never copy: a write maps the cached page itself writable
+ * and marks it dirty, so every mapping of the file sees it.
+ */
+static int page_fault_file(struct vm_mapping *m, unsigned long addr,
+			   int flags)
 {
 	unsigned long virt = PAGE_ALIGN_DOWN(addr);
 	unsigned long voff = virt - m->address;
+	struct page *cached, *page;
+	int vmflags = m->flags;
 	int error;
 
 	TRACE("mapping=%p, addr=0x%08x", m, addr);
 
-	error = vm_map_page(m->space, virt, m->flags);
+	error = page_cache_get(m->file, m->foff + voff, &cached);
+	if (error)
+		return error;
+
+	page = cached;
+	if (!(flags & PF_WRITE) || !M_WRITEABLE(m)) {
+		vmflags &= ~VM_W;
+	}
+	else if (M_SHARED(m)) {
+		page_cache_dirty(m->file, m->foff + voff);
+	}
+	else {
+		page = copy_page(cached);
+		page_put(cached);
+		if (!page)
+			return ENOMEM;
+	}
+
+	error = mmu_map_page(m->space->mmu, virt, page, vmflags);
 	if (error) {
+		page_put(page);
 		return ENOMEM;
 	}
 
-	/*
-	 * Read the page in from the file.
-	 */
-	error = vfs_read_page(m->file, m->foff + voff, (char *) virt);
-	if (error < 0) {
-		vm_unmap_page(m->space, virt);
-		return EFAULT;
-	}
+	tlb_invalidate(virt, PAGE_SIZE);
+	m->space->rss++;
+
+	if (!(vmflags & VM_W))
+		fault_around(m, addr);
+
+	return 0;
+}
+
+bool vm_large_pages = true;
+
+/**
+ * @brief Try to back the whole large page around addr with one physically
+ * contiguous, naturally aligned block, so a single TLB entry covers it.
+ *
+ * Only done for writable anonymous mappings that cover the large page, and
+ * only if nothing is mapped there yet. The block is zeroed through the new
+ * mapping, like page_fault_cow() copies.
+ *
+ * @return 0 on success, non-0 if the caller should fall back to mapping a
+ * single page.
+ */
+static int page_fault_large(struct vm_mapping *m, unsigned long addr)
+{
+	unsigned long virt = FLOOR(MMU_LARGE_PAGE_SIZE, addr);
+	unsigned long n = MMU_LARGE_PAGE_SIZE / PAGE_SIZE;
+	struct page *page;
+	int error;
+
+	if (!vm_large_pages || !M_WRITEABLE(m))
+		return EINVAL;
+
+	if (virt < m->address || M_END(m) - virt < MMU_LARGE_PAGE_SIZE)
+		return EINVAL;
+
+	if (!mmu_large_page_fits(m->space->mmu, virt))
+		return EEXIST;
 
 	/*
-	 * If a whole page wasn't read from the file (because it wasn't big
-	 * enough, copy 0's to the page.
+	 * Large pages are only an optimization, not worth calling the
+	 * shrinkers for.
 	 */
-	if (error < PAGE_SIZE) {
-		memset((void *) (virt + error), 0, PAGE_SIZE - error);
+	page = __alloc_zone_pages(ZONE_HIGH, n);
+	if (!page)
+		return ENOMEM;
+
+	error = mmu_map_range(m->space->mmu, virt, page_address(page),
+			      MMU_LARGE_PAGE_SIZE, m->flags);
+	if (error) {
+		free_pages(page, n);
+		return error;
 	}
 
+	tlb_invalidate(virt, PAGE_SIZE);
+
+	memset((void *) virt, 0, MMU_LARGE_PAGE_SIZE);
+
+	m->space->rss += n;
+	vm_stats.large_page_maps++;
+
 	return 0;
 }
 
 /**
  * @breif A page fault occurred on an anonymous mapping.
  */
-static int page_fault_anon(struct vm_mapping *m, unsigned long addr)
+static int page_fault_anon(struct vm_mapping *m, unsigned long addr,
+			   int flags)
 {
 	unsigned long virt = PAGE_ALIGN_DOWN(addr);
+	struct page *page;
+	int vmflags = m->flags;
 	int error;
 
 	TRACE("mapping=%p, addr=0x%08x", m, addr);
 
-	error = vm_map_page(m->space, virt, m->flags);
+	if (!page_fault_large(m, addr))
+		return 0;
+
+	if (!(flags & PF_WRITE) && get_zero_page()) {
+		page = zero_page;
+		page_get(page);
+		vmflags &= ~VM_W;
+	}
+	else {
+		page = alloc_zeroed_page();
+		if (!page) {
+			return ENOMEM;
+		}
+	}
+
+	error = mmu_map_page(m->space->mmu, virt, page, vmflags);
 	if (error) {
+		free_page(page);
 		return ENOMEM;
 	}
 
-	memset((void *) virt, 0, PAGE_SIZE);
+	tlb_invalidate(virt, PAGE_SIZE);
+
+	if (page == zero_page) {
+		vm_stats.zero_page_maps++;
+		fault_around(m, addr);
+	}
+	else {
+		m->space->rss++;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief A write to a page of a shared mapping that is mapped read-only,
+ * after a read fault or a fork. The page is shared on purpose, so it is
+ * just made writable, and marked dirty in the page cache.
+ */
+static int page_fault_shared(struct vm_mapping *m, unsigned long addr)
+{
+	unsigned long virt = PAGE_ALIGN_DOWN(addr);
+	struct page *page;
+	int error;
+
+	page = __page(addr);
+	ASSERT_NOT_NULL(page);
+
+	error = mmu_map_page(m->space->mmu, virt, page, m->flags);
+	if (error)
+		return error;
+
+	tlb_invalidate(virt, PAGE_SIZE);
+
+	page_cache_dirty(m->file, m->foff + (virt - m->address));
+	vm_stats.shared_writes++;
 
 	return 0;
 }
 
 /*
- * For cow, we take the easy way out and avoid races. Whenever faulting
- * on a cow mapping, always allocate a new page and copy the old page to
- * the new page. Never try to use the old page.
+ * A cow fault normally allocates a new page and copies the old page to the
+ * new page. But if nobody else references the old page anymore (e.g. the
+ * other side of the fork already exited), the faulting process owns it
+ * outright and we just make it writable again.
  */
 static int page_fault_cow(struct vm_mapping *m, unsigned long addr)
 {
 	struct page *old_page = NULL;
 	struct page *new_page = NULL;
 	void *old_page_addr = NULL;
-	unsigned long virt;
+	unsigned long virt = PAGE_ALIGN_DOWN(addr);
 	int error = ENOMEM;
 
 	/* Get the physical page that is currently mapped. */
 	old_page = __page(addr);
-	ASSERT_NOTEQUALS(old_page, -1);
+	ASSERT_NOT_NULL(old_page);
 
 	/*
-	 * Create a temporary kernel mapping to that page so we
-	 * can read it from the kernel.
+	 * A write to the zero page. There is nothing to copy, so just give
+	 * the process a zeroed page of its own.
 	 */
-	old_page_addr = kmap(old_page);
-	if (!old_page_addr) {
-		goto cow_fail;
+	if (old_page == zero_page) {
+		new_page = alloc_zeroed_page();
+		if (!new_page)
+			return ENOMEM;
+
+		error = mmu_map_page(m->space->mmu, virt, new_page, m->flags);
+		if (error) {
+			free_page(new_page);
+			return error;
+		}
+
+		tlb_invalidate(virt, PAGE_SIZE);
+		page_put(zero_page);
+
+		m->space->rss++;
+		return 0;
+	}
+
+	if (old_page->count == 1) {
+		error = mmu_map_page(m->space->mmu, virt, old_page, m->flags);
+		if (error)
+			return error;
+
+		tlb_invalidate(virt, PAGE_SIZE);
+
+		vm_stats.cow_reused++;
+		return 0;
 	}
 
 	new_page = alloc_page();
 	if (!new_page) {
-		goto cow_fail;
+		return ENOMEM;
 	}
 
 	/* Map the faulted page to the newly allocated page. */
-	virt = PAGE_ALIGN_DOWN(addr);
 	error = mmu_map_page(m->space->mmu, virt, new_page, m->flags);
 	if (error) {
-		goto cow_fail;
+		free_page(new_page);
+		return error;
 	}
 
 	tlb_invalidate(virt, PAGE_SIZE);
@@ -158,18 +651,34 @@ static int page_fault_cow(struct vm_mapping *m, unsigned long addr)
 	 * we are already in the process's address space. The
 	 * previous mmu_map_page and tlb_invalidate will allow
 	 * us to write to new_page simply by writing to the
-	 * faulting virtual address.
+	 * faulting virtual address. The old page is still referenced by
+	 * the other side of the fork, so it can't go away under us.
 	 */
+	old_page_addr = kmap_atomic(old_page);
 	memcpy((void *) virt, old_page_addr, PAGE_SIZE);
+	kunmap_atomic(old_page_addr);
 
-	kunmap(old_page_addr);
 	page_put(old_page);
+
+	vm_stats.cow_copied++;
 	return 0;
+}
 
-cow_fail:
-	if (old_page_addr) kunmap(old_page_addr);
-	if (new_page) free_page(new_page);
-	return error;
+void vm_dump_stats(printf_f p)
+{
+	p("cow faults: %d copied, %d reused\n",
+	  vm_stats.cow_copied, vm_stats.cow_reused);
+	p("zero page: %d read faults mapped, %d references\n",
+	  vm_stats.zero_page_maps, zero_page ? zero_page->count - 1 : 0);
+	p("large pages: %d faults mapped\n", vm_stats.large_page_maps);
+	p("faults: %d, %d pages mapped around them\n", vm_stats.faults,
+	  vm_stats.fault_around_maps);
+	p("populate: %d pages mapped up front\n", vm_stats.populated);
+	p("shared: %d write faults\n", vm_stats.shared_writes);
+	p("mappings: %d mmaps merged into a neighbour\n", vm_stats.merges);
+	tlb_dump_stats(p);
+	page_tables_dump(p);
+	page_cache_dump(p);
 }
 
 int vm_page_fault(unsigned long addr, int flags)
@@ -203,7 +712,9 @@ int vm_page_fault(unsigned long addr, int flags)
 	 * Otherwise the kernel page-faulted writing to a user page or the user
 	 * page-faulted writing to a user page. Both are expected.
 	 */
-	mapping = find_mapping(space, addr);
+	mapping = vm_find_mapping(space, addr);
+	vm_stats.faults++;
+	space->faults++;
 
 	/*
 	 * SEGFAULT
@@ -233,6 +744,9 @@ int vm_page_fault(unsigned long addr, int flags)
 			return EFAULT;
 		}
 
+		if (M_SHARED(mapping))
+			return page_fault_shared(mapping, addr);
+
 		return page_fault_cow(mapping, addr);
 	}
 	/*
@@ -241,14 +755,97 @@ int vm_page_fault(unsigned long addr, int flags)
 	 */
 	else {
 		if (mapping->file) {
-			return page_fault_file(mapping, addr);
+			return page_fault_file(mapping, addr, flags);
 		}
 		else {
-			return page_fault_anon(mapping, addr);
+			return page_fault_anon(mapping, addr, flags);
 		}
 	}
 }
 
+/**
+ * @brief Get the page populate_range() maps at virt: what a write fault
+ * would get for a writable mapping, and a read fault for any other.
+ */
+static struct page *populate_page(unsigned long virt, void *arg)
+{
+	struct vm_mapping *m = arg;
+	struct page *page, *cached;
+
+	if (m->file) {
+		if (page_cache_get(m->file, m->foff + (virt - m->address),
+				   &cached))
+			return NULL;
+
+		if (M_WRITEABLE(m) && !M_SHARED(m)) {
+			page = copy_page(cached);
+			page_put(cached);
+		}
+		else {
+			page = cached;
+			if (M_WRITEABLE(m))
+				page_cache_dirty(m->file,
+						 m->foff + (virt - m->address));
+		}
+	}
+	else if (M_WRITEABLE(m)) {
+		page = alloc_zeroed_page();
+	}
+	else {
+		page = get_zero_page();
+		if (page)
+			page_get(page);
+	}
+
+	if (!page)
+		return NULL;
+
+	if (page == zero_page)
+		vm_stats.zero_page_maps++;
+	else
+		m->space->rss++;
+	vm_stats.populated++;
+
+	return page;
+}
+
+/**
+ * @brief Map every page of [start, end) in m up front, so touching it never
+ * faults (until a fork makes it copy-on-write).
+ *
+ * The page tables are walked once for the whole range, and the TLB is
+ * invalidated once at the end instead of after every page.
+ *
+ * @return 0 on success, ENOMEM if out of memory.
+ */
+static int populate_range(struct vm_mapping *m, unsigned long start,
+			  unsigned long end)
+{
+	int error;
+
+	TRACE("mapping=%p, start=0x%08x, end=0x%08x", m, start, end);
+
+	error = mmu_populate_range(m->space->mmu, start, end, m->flags,
+				   populate_page, m);
+	tlb_invalidate(start, end - start);
+
+	return error;
+}
+
+/**
+ * @brief Check whether a new mapping of [addr, ...) with these flags, file
+ * and offset would just continue m, the mapping right before or after it.
+ */
+static bool can_merge(struct vm_mapping *m, unsigned long addr, int vmflags,
+		      struct vfs_file *file, unsigned long off)
+{
+	if (m->flags != vmflags || m->file != file)
+		return false;
+
+	/* the offsets must line up too (this wraps around for the next one) */
+	return !file || m->foff + (addr - m->address) == off;
+}
+
 /*
  * addr, length, off assumed to be page aligned!
  */
@@ -256,63 +853,101 @@ unsigned long __vm_mmap(unsigned long addr, unsigned long length, int prot,
 			int flags, struct vfs_file *file, unsigned long off)
 {
 	struct vm_space *space = &CURRENT_PROCESS->space;
-	struct vm_mapping *m, *prev = NULL;
+	struct vm_mapping *m, *prev, *next;
 	int vmflags = 0;
-	bool found = false;
 
 	if (prot & PROT_EXEC)     vmflags |= VM_X;
 	if (prot & PROT_READ)     vmflags |= VM_R;
 	if (prot & PROT_WRITE)    vmflags |= VM_W;
 	if (!(prot & PROT_NONE))  vmflags |= VM_P;
+	if (flags & MAP_LOCKED)   vmflags |= VM_L;
+	if (flags & MAP_SHARED)   vmflags |= VM_SHARED;
 	if (kernel_address(addr)) vmflags |= VM_S;
 	else                      vmflags |= VM_U;
 
 	// Steps:
 	//  1. Find an overlapping mapping to extend or create a new mapping.
-	list_foreach(m, &space->mappings, link) {
-		/*
-		 * Found an overlapping region
-		 */
-		if (check_overlap(addr, length, m->address, M_LENGTH(m))) {
-			DEBUG("OVERLAP?? (0x%08x, 0x%08x) (0x%08x, 0x%08x)",
-					addr, length, m->address, M_LENGTH(m));
-			found = true;
-			break;
-		}
+	m = vm_find_first_overlapping(space, addr, length);
+	if (m) {
+		DEBUG("OVERLAP?? (0x%08x, 0x%08x) (0x%08x, 0x%08x)",
+				addr, length, m->address, M_LENGTH(m));
 
-		/*
-		 * Found the first region AFTER the region we're trying to add.
-		 */
-		if (m->address > addr) {
-			ASSERT_GREATEREQ(m->address, addr + length);
-			break;
-		}
-
-		prev = m;
-	}
-
-	if (found) {
 		//TODO: Probably need to handle this case for growing the heap
 		//and stack...
 		panic("Found an overlapping mapping!! Handling the case is "
 		      "not implemented yet...");
 	}
-	else {
-		if (flags & MAP_ANONYMOUS) {
-			file = NULL;
-			off = 0;
+
+	if (flags & MAP_ANONYMOUS) {
+		file = NULL;
+		off = 0;
+	}
+
+	/*
+	 * Shared anonymous memory gets a file of its own, so that every
+	 * process that maps it finds the same pages.
+	 */
+	if ((flags & MAP_ANONYMOUS) && (flags & MAP_SHARED)) {
+		file = new_shmem_file(length);
+		if (!file)
+			return ENOMEM;
+	}
+
+	//  2. Extend the mapping right before or after the new one if it's
+	//     the same kind, to keep the number of mappings down.
+	prev = vm_find_mapping(space, addr - 1);
+	next = addr + length ? vm_find_mapping(space, addr + length) : NULL;
+
+	if (prev && can_merge(prev, addr, vmflags, file, off)) {
+		prev->num_pages += length / PAGE_SIZE;
+
+		/* the new mapping fills the hole between two mappings */
+		if (next && can_merge(next, addr, vmflags, file, off)) {
+			prev->num_pages += next->num_pages;
+			vm_remove_mapping(space, next);
+			free_vm_mapping(next);
 		}
 
+		m = prev;
+		vm_mapping_changed(m);
+		vm_stats.merges++;
+	}
+	else if (next && can_merge(next, addr, vmflags, file, off)) {
+		next->address = addr;
+		next->foff = off;
+		next->num_pages += length / PAGE_SIZE;
+
+		m = next;
+		vm_mapping_changed(m);
+		vm_stats.merges++;
+	}
+	//  3. Otherwise create a new mapping.
+	else {
 		m = new_vm_mapping(addr, length, vmflags, file, off);
-		if (!m)
-			return ENOMEM;
+		if (m) {
+			m->space = space;
+			vm_insert_mapping(space, m);
+		}
+	}
 
-		m->space = space;
+	/* the mapping holds its own reference to the file */
+	if (flags & MAP_ANONYMOUS)
+		cond_vfs_file_put(file);
 
-		if (prev)
-			list_insert_after(&space->mappings, prev, m, link);
-		else
-			list_insert_head(&space->mappings, m, link);
+	if (!m)
+		return ENOMEM;
+
+	/*
+	 * Locked mappings are populated too, so they are resident as long as
+	 * they are mapped.
+	 */
+	if (flags & (MAP_POPULATE | MAP_LOCKED)) {
+		int error = populate_range(m, addr, addr + length);
+
+		if (error) {
+			__vm_munmap(space, addr, length);
+			return error;
+		}
 	}
 
 	return addr;
@@ -328,20 +963,6 @@ unsigned long vm_mmap(unsigned long addr, unsigned long length, int prot,
 	TRACE("addr=0x%08x, length=0x%x, prot=0x%x, flags=0x%x, file=%p, off=0x%x",
 			addr, length, prot, flags, file, off);
 
-	if (flags & MAP_SHARED) {
-		panic("MAP_SHARED not implemented");
-	}
-
-	if (flags & MAP_LOCKED) {
-		panic("MAP_LOCKED not implemented");
-	}
-
-	// If addr is NULL then we should pick the address to map for the
-	// process.
-	if (!addr) {
-		panic("NULL addr not implemented");
-	}
-
 	if ((flags & MAP_PRIVATE) && (flags & MAP_SHARED)) {
 		return EINVAL;
 	}
@@ -358,6 +979,24 @@ unsigned long vm_mmap(unsigned long addr, unsigned long length, int prot,
 
 	length = PAGE_ALIGN_UP(length);
 
+	/*
+	 * If addr is NULL then we pick the address to map for the process.
+	 * Anonymous mappings big enough for a large page are aligned so that
+	 * page faults can map them with large pages.
+	 */
+	if (!addr) {
+		unsigned long align = PAGE_SIZE;
+
+		if ((flags & MAP_ANONYMOUS) && length >= MMU_LARGE_PAGE_SIZE)
+			align = MMU_LARGE_PAGE_SIZE;
+
+		addr = vm_find_free_range(&CURRENT_PROCESS->space, length,
+					  align, CONFIG_USER_MMAP_START,
+					  CONFIG_USER_VIRTUAL_END);
+		if (!addr)
+			return ENOMEM;
+	}
+
 	return __vm_mmap(addr, length, prot, flags, file, off);
 }
 
@@ -370,7 +1009,6 @@ int __vm_munmap(struct vm_space *space, unsigned long addr, unsigned long length
 {
 	struct vm_mapping *next;
 	struct vm_mapping *m;
-	unsigned long virt;
 
 	TRACE("space=%p, addr=0x%08x, length=0x%x", space, addr, length);
 
@@ -381,7 +1019,7 @@ int __vm_munmap(struct vm_space *space, unsigned long addr, unsigned long length
 
 	length = PAGE_ALIGN_UP(length);
 
-	m = find_first_overlapping(space, addr, length);
+	m = vm_find_first_overlapping(space, addr, length);
 	if (!m) {
 		return 0;
 	}
@@ -408,16 +1046,13 @@ int __vm_munmap(struct vm_space *space, unsigned long addr, unsigned long length
 
 		next->space = space;
 
-		list_insert_after(&space->mappings, m, next, link);
-
 		m->num_pages = (addr - m->address) / PAGE_SIZE;
+		vm_insert_mapping(space, next);
 
 		/*
 		 * Unmap the pages in the hardware virtual memory management.
 		 */
-		for (virt = addr; virt < addr + length; virt += PAGE_SIZE) {
-			vm_unmap_page(space, virt);
-		}
+		vm_unmap_range(space, addr, addr + length);
 	}
 	/*
 	 * In the normal case we are unmapping some set of mappings.
@@ -435,6 +1070,7 @@ int __vm_munmap(struct vm_space *space, unsigned long addr, unsigned long length
 
 				m->num_pages -=
 					(unmap_end - unmap_start) / PAGE_SIZE;
+				vm_mapping_changed(m);
 				m = list_next(m, link);
 			}
 			/*
@@ -449,6 +1085,7 @@ int __vm_munmap(struct vm_space *space, unsigned long addr, unsigned long length
 				m->num_pages -=
 					(unmap_end - unmap_start) / PAGE_SIZE;
 				m->address = unmap_end;
+				vm_mapping_changed(m);
 				m = list_next(m, link);
 			}
 			/*
@@ -459,7 +1096,7 @@ int __vm_munmap(struct vm_space *space, unsigned long addr, unsigned long length
 				unmap_end = M_END(m);
 
 				next = list_next(m, link);
-				list_remove(&space->mappings, m, link);
+				vm_remove_mapping(space, m);
 				free_vm_mapping(m);
 				m = next;
 			}
@@ -468,10 +1105,7 @@ int __vm_munmap(struct vm_space *space, unsigned long addr, unsigned long length
 			 * Unmap the pages in the hardware virtual memory
 			 * management.
 			 */
-			for (virt = unmap_start; virt < unmap_end;
-			     virt += PAGE_SIZE) {
-				vm_unmap_page(space, virt);
-			}
+			vm_unmap_range(space, unmap_start, unmap_end);
 		} while (m && check_overlap(addr, length, m->address,
 					    M_LENGTH(m)));
 	}
@@ -497,6 +1131,49 @@ int vm_munmap(unsigned long addr, unsigned long length)
 	return __vm_munmap(space, addr, length);
 }
 
+unsigned long sys_mmap(unsigned long addr, unsigned long length, int prot,
+		       int flags)
+{
+	struct vm_space *space = &CURRENT_PROCESS->space;
+
+	TRACE("addr=0x%08x, length=0x%x, prot=0x%x, flags=0x%x", addr, length,
+	      prot, flags);
+
+	/*
+	 * There are no file descriptors yet, so only anonymous memory can be
+	 * mapped from user space.
+	 */
+	if (!(flags & MAP_ANONYMOUS))
+		return EINVAL;
+
+	length = PAGE_ALIGN_UP(length);
+	if (!length)
+		return EINVAL;
+
+	/* a NULL address lets the kernel pick one */
+	if (addr) {
+		if (kernel_address(addr) || addr + length < addr ||
+		    addr + length > CONFIG_USER_VIRTUAL_END)
+			return EINVAL;
+
+		if (vm_find_first_overlapping(space, PAGE_ALIGN_DOWN(addr),
+					      length))
+			return EEXIST;
+	}
+
+	return vm_mmap(addr, length, prot, flags, NULL, 0);
+}
+
+int sys_munmap(unsigned long addr, unsigned long length)
+{
+	TRACE("addr=0x%08x, length=0x%x", addr, length);
+
+	if (kernel_address(addr))
+		return EINVAL;
+
+	return vm_munmap(addr, length);
+}
+
 #include <kernel/test.h>
 BEGIN_TEST(mmap_test)
 {
@@ -542,3 +1219,234 @@ BEGIN_TEST(mmap_test)
 #undef _UNMAP
 }
 END_TEST
+
+BEGIN_TEST(mapping_tree_test)
+{
+	struct vm_space *space = &CURRENT_PROCESS->space;
+	int prot = PROT_READ | PROT_WRITE;
+	int flags = MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS;
+	unsigned long base = 0x80000000;
+	unsigned long addr;
+	int error;
+
+	/*
+	 * Lots of one page mappings, each followed by an unmapped guard page.
+	 * Map them in a scattered order so the tree has to rebalance.
+	 */
+	for (addr = 0; addr < 1024; addr++) {
+		unsigned long i = (addr * 389) % 1024;
+
+		error = vm_mmap(base + i * 2 * PAGE_SIZE, PAGE_SIZE, prot,
+				flags, NULL, 0);
+		ASSERT(!(error % PAGE_SIZE));
+	}
+
+	for (addr = base; addr < base + 2048 * PAGE_SIZE; addr += PAGE_SIZE) {
+		struct vm_mapping *m = vm_find_mapping(space, addr + 42);
+
+		if ((addr - base) % (2 * PAGE_SIZE)) {
+			ASSERT_EQUALS(m, NULL);
+		}
+		else {
+			ASSERT_NOT_NULL(m);
+			ASSERT_EQUALS(m->address, addr);
+		}
+	}
+
+	ASSERT_EQUALS(vm_find_first_overlapping(space, base + PAGE_SIZE,
+						PAGE_SIZE), NULL);
+	ASSERT_EQUALS(vm_find_first_overlapping(space, base + PAGE_SIZE,
+						2 * PAGE_SIZE)->address,
+		      base + 2 * PAGE_SIZE);
+
+	error = vm_munmap(base, 2048 * PAGE_SIZE);
+	ASSERT(!error);
+
+	ASSERT_EQUALS(vm_find_mapping(space, base), NULL);
+}
+END_TEST
+
+BEGIN_TEST(fault_around_test)
+{
+	struct vfs_file *file = CURRENT_PROCESS->exec_file;
+	unsigned long fault_around = vm_fault_around;
+	unsigned long addr = 0x80000000;
+	unsigned long length, off, faults[2];
+	unsigned pass;
+	int error;
+
+	ASSERT_NOT_NULL(file);
+	length = PAGE_ALIGN_UP(umin(file->dirent->inode->length,
+				 32 * PAGE_SIZE));
+
+	/*
+	 * Read the file page by page, without and then with fault-around.
+	 * The first pass brings every page into the cache, so the second can
+	 * map them all on its first fault.
+	 */
+	for (pass = 0; pass < 2; pass++) {
+		unsigned long before = vm_stats.faults;
+		unsigned long sum = 0;
+
+		vm_fault_around = pass ? 16 : 1;
+
+		error = vm_mmap(addr, length, PROT_READ,
+				MAP_PRIVATE | MAP_FIXED, file, 0);
+		ASSERT(!(error % PAGE_SIZE));
+
+		for (off = 0; off < length; off += PAGE_SIZE)
+			sum += *((char *) (addr + off));
+
+		faults[pass] = vm_stats.faults - before;
+		INFO("fault-around %d: %d faults for %d pages (%d)",
+		     vm_fault_around, faults[pass], length / PAGE_SIZE, sum);
+
+		error = vm_munmap(addr, length);
+		ASSERT(!error);
+	}
+
+	vm_fault_around = fault_around;
+
+	ASSERT_EQUALS(faults[0], length / PAGE_SIZE);
+	if (length > PAGE_SIZE) {
+		ASSERT_LESS(faults[1], faults[0]);
+	}
+}
+END_TEST
+
+BEGIN_TEST(mmap_populate_test)
+{
+	struct vm_space *space = &CURRENT_PROCESS->space;
+	int prot = PROT_READ | PROT_WRITE;
+	int flags = MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS;
+	unsigned long addr = 0x80000000, length = 64 * PAGE_SIZE;
+	unsigned long rss = space->rss, faults, off;
+	int error;
+
+	error = vm_mmap(addr, length, prot, flags | MAP_POPULATE | MAP_LOCKED,
+			NULL, 0);
+	ASSERT(!(error % PAGE_SIZE));
+	ASSERT(M_LOCKED(vm_find_mapping(space, addr)));
+	ASSERT_EQUALS(space->rss - rss, length / PAGE_SIZE);
+
+	/* the pages are there already, writable */
+	faults = vm_stats.faults;
+	for (off = 0; off < length; off += PAGE_SIZE)
+		*((int *) (addr + off)) = 42;
+	ASSERT_EQUALS(vm_stats.faults, faults);
+
+	error = vm_munmap(addr, length);
+	ASSERT(!error);
+	ASSERT_EQUALS(space->rss, rss);
+}
+END_TEST
+
+BEGIN_TEST(mmap_shared_test)
+{
+	struct vm_space *space = &CURRENT_PROCESS->space;
+	int prot = PROT_READ | PROT_WRITE;
+	int flags = MAP_SHARED | MAP_FIXED | MAP_ANONYMOUS;
+	unsigned long addr = 0x80000000;
+	unsigned long dirty = page_cache_stats.dirty;
+	struct vm_mapping *m;
+	struct page *page;
+	int error;
+
+	error = vm_mmap(addr, 4 * PAGE_SIZE, prot, flags, NULL, 0);
+	ASSERT(!(error % PAGE_SIZE));
+
+	m = vm_find_mapping(space, addr);
+	ASSERT(M_SHARED(m));
+	ASSERT_NOT_NULL(m->file);
+
+	/*
+	 * Reading maps the shared page read-only, the write after it makes
+	 * that same page writable instead of copying it.
+	 */
+	ASSERT_EQUALS(*((int *) addr), 0);
+	*((int *) addr) = 42;
+
+	page = page_cache_lookup(m->file, 0);
+	ASSERT_EQUALS(page, __page(addr));
+	ASSERT_EQUALS(page_cache_stats.dirty, dirty + 1);
+	page_put(page);
+
+	/* the pages go away with the last mapping */
+	error = vm_munmap(addr, 4 * PAGE_SIZE);
+	ASSERT(!error);
+	ASSERT_EQUALS(page_cache_stats.dirty, dirty);
+}
+END_TEST
+
+BEGIN_TEST(free_range_test)
+{
+	struct vm_space *space = &CURRENT_PROCESS->space;
+	int prot = PROT_READ | PROT_WRITE;
+	int flags = MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS;
+	unsigned long base = 0x80000000;
+	unsigned long addr, merges;
+	unsigned i;
+	int error;
+
+#define P(_n) ((_n) * PAGE_SIZE)
+
+	/*
+	 * One page mappings every 8 pages, except for two missing ones that
+	 * leave a 23 page hole after the mapping at 99.
+	 */
+	for (i = 0; i < 256; i++) {
+		if (i == 100 || i == 101)
+			continue;
+
+		error = vm_mmap(base + P(i * 8), P(1), prot, flags, NULL, 0);
+		ASSERT(!(error % PAGE_SIZE));
+	}
+
+	ASSERT_EQUALS(vm_find_free_range(space, P(8), PAGE_SIZE, base,
+					 CONFIG_USER_VIRTUAL_END),
+		      base + P(99 * 8 + 1));
+
+	/* holes are cut down to [low, high) */
+	ASSERT_EQUALS(vm_find_free_range(space, P(4), PAGE_SIZE,
+					 base + P(900), CONFIG_USER_VIRTUAL_END),
+		      base + P(900));
+	ASSERT_EQUALS(vm_find_free_range(space, P(8), PAGE_SIZE, base,
+					 base + P(99 * 8 + 8)), 0);
+
+	/* past the last mapping */
+	ASSERT_EQUALS(vm_find_free_range(space, P(64), P(64), base,
+					 CONFIG_USER_VIRTUAL_END),
+		      base + P(256 * 8));
+
+	error = vm_munmap(base, P(256 * 8));
+	ASSERT(!error);
+
+	/*
+	 * Mapping right after, right before, and in between mappings of the
+	 * same kind extends them instead of adding new ones.
+	 */
+	merges = vm_stats.merges;
+	vm_mmap(base, P(1), prot, flags, NULL, 0);
+	vm_mmap(base + P(1), P(1), prot, flags, NULL, 0);
+	vm_mmap(base + P(4), P(1), prot, flags, NULL, 0);
+	vm_mmap(base + P(3), P(1), prot, flags, NULL, 0);
+	vm_mmap(base + P(2), P(1), prot, flags, NULL, 0);
+	ASSERT_EQUALS(vm_stats.merges - merges, 3);
+	ASSERT_EQUALS(vm_find_mapping(space, base + P(3))->address, base);
+	ASSERT_EQUALS(M_LENGTH(vm_find_mapping(space, base)), P(5));
+
+	error = vm_munmap(base, P(5));
+	ASSERT(!error);
+
+	/* the kernel picks the address */
+	addr = vm_mmap(0, P(3), prot, MAP_PRIVATE | MAP_ANONYMOUS, NULL, 0);
+	ASSERT(!(addr % PAGE_SIZE));
+	ASSERT_GREATEREQ(addr, CONFIG_USER_MMAP_START);
+	ASSERT_EQUALS(vm_find_mapping(space, addr)->address, addr);
+
+	error = vm_munmap(addr, P(3));
+	ASSERT(!error);
+
+#undef P
+}
+END_TEST
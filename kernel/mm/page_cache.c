@@ -0,0 +1,342 @@
+/**
+ * @file mm/page_cache.c
+ *
+ * @brief The page cache (see mm/page_cache.h).
+ */
+#include <mm/page_cache.h>
+#include <mm/pages.h>
+#include <mm/kmap.h>
+#include <mm/slab.h>
+
+#include <kernel/spinlock.h>
+#include <fs/vfs.h>
+
+#include <rbtree.h>
+#include <list.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+struct cached_page {
+	struct vfs_inode *inode;
+	unsigned long index;       /* offset in the file, in pages */
+	struct page *page;
+	bool dirty;                /* written through a shared mapping */
+	struct rb_node rb_node;    /* in inode->cached_pages */
+	list_link(struct cached_page) lru_link;
+};
+
+list_typedef(struct cached_page) cached_page_list_t;
+
+static struct kmem_cache cached_page_cache =
+	INITIALIZED_KMEM_CACHE("cached_page", sizeof(struct cached_page), 0,
+			       NULL);
+
+/*
+ * Every cached page, least recently looked up first. Nothing allocates
+ * while holding page_cache_lock, so the shrinker can take it.
+ */
+static cached_page_list_t lru = INITIALIZED_EMPTY_LIST;
+static struct spinlock page_cache_lock = INITIALIZED_SPINLOCK;
+
+struct page_cache_stats page_cache_stats;
+
+#define cached_page_entry(_rb) rb_entry(_rb, struct cached_page, rb_node)
+
+/**
+ * @brief Find the page at index in inode's cache.
+ *
+ * Assumes page_cache_lock is held.
+ */
+static struct cached_page *cache_find(struct vfs_inode *inode,
+				      unsigned long index)
+{
+	struct rb_node *rb = inode->cached_pages.node;
+
+	while (rb) {
+		struct cached_page *c = cached_page_entry(rb);
+
+		if (index < c->index)
+			rb = rb->left;
+		else if (index > c->index)
+			rb = rb->right;
+		else
+			return c;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Add c to its inode's cache, unless somebody else read the same
+ * page in first.
+ *
+ * Assumes page_cache_lock is held.
+ *
+ * @return the page that is in the cache now, c or the one already there.
+ */
+static struct cached_page *cache_insert(struct cached_page *c)
+{
+	struct rb_root *root = &c->inode->cached_pages;
+	struct rb_node **link = &root->node, *parent = NULL;
+
+	while (*link) {
+		struct cached_page *other = cached_page_entry(*link);
+
+		parent = *link;
+		if (c->index < other->index)
+			link = &parent->left;
+		else if (c->index > other->index)
+			link = &parent->right;
+		else
+			return other;
+	}
+
+	rb_link_node(&c->rb_node, parent, link);
+	rb_insert_color(&c->rb_node, root);
+	list_insert_tail(&lru, c, lru_link);
+	page_cache_stats.pages++;
+
+	return c;
+}
+
+/**
+ * @brief Allocate a page and fill it from the file.
+ */
+static int read_page(struct vfs_file *file, unsigned long off,
+		     struct page **pagep)
+{
+	struct page *page;
+	ssize_t n;
+	char *kvirt;
+
+	page = alloc_page();
+	if (!page)
+		return ENOMEM;
+
+	kvirt = kmap(page);
+	if (!kvirt) {
+		free_page(page);
+		return ENOMEM;
+	}
+
+	n = vfs_read_page(file, off, kvirt);
+	if (n < 0) {
+		kunmap(kvirt);
+		free_page(page);
+		return EFAULT;
+	}
+
+	/*
+	 * If a whole page wasn't read from the file (because it wasn't big
+	 * enough), copy 0's to the rest of the page.
+	 */
+	if (n < PAGE_SIZE)
+		memset(kvirt + n, 0, PAGE_SIZE - n);
+
+	kunmap(kvirt);
+
+	*pagep = page;
+	return 0;
+}
+
+struct page *page_cache_lookup(struct vfs_file *file, unsigned long off)
+{
+	struct vfs_inode *inode = file->dirent->inode;
+	struct cached_page *c;
+	struct page *page;
+	unsigned long flags;
+
+	TRACE("file=%p, off=0x%x", file, off);
+	ASSERT(!(off % PAGE_SIZE));
+
+	page = vfs_get_page(file, off);
+	if (page) {
+		page_cache_stats.in_place++;
+		return page;
+	}
+
+	spin_lock_irq(&page_cache_lock, &flags);
+
+	c = cache_find(inode, off / PAGE_SIZE);
+	if (c) {
+		page = c->page;
+		page_get(page);
+		list_remove(&lru, c, lru_link);
+		list_insert_tail(&lru, c, lru_link);
+		page_cache_stats.hits++;
+	}
+
+	spin_unlock_irq(&page_cache_lock, flags);
+
+	return page;
+}
+
+int page_cache_get(struct vfs_file *file, unsigned long off,
+		   struct page **pagep)
+{
+	struct cached_page *c, *cached;
+	unsigned long flags;
+	int error;
+
+	*pagep = page_cache_lookup(file, off);
+	if (*pagep)
+		return 0;
+
+	page_cache_stats.misses++;
+
+	/*
+	 * Read the page in without the lock held, then add it to the cache.
+	 */
+	c = kmem_cache_alloc(&cached_page_cache);
+	if (!c)
+		return ENOMEM;
+
+	error = read_page(file, off, &c->page);
+	if (error) {
+		kmem_cache_free(&cached_page_cache, c);
+		return error;
+	}
+
+	c->inode = file->dirent->inode;
+	c->index = off / PAGE_SIZE;
+	c->dirty = false;
+
+	spin_lock_irq(&page_cache_lock, &flags);
+	cached = cache_insert(c);
+	page_get(cached->page);
+	*pagep = cached->page;
+	spin_unlock_irq(&page_cache_lock, flags);
+
+	if (cached != c) {
+		free_page(c->page);
+		kmem_cache_free(&cached_page_cache, c);
+	}
+
+	return 0;
+}
+
+void page_cache_dirty(struct vfs_file *file, unsigned long off)
+{
+	struct vfs_inode *inode = file->dirent->inode;
+	struct cached_page *c;
+	unsigned long flags;
+
+	spin_lock_irq(&page_cache_lock, &flags);
+
+	c = cache_find(inode, off / PAGE_SIZE);
+	if (c && !c->dirty) {
+		c->dirty = true;
+		page_cache_stats.dirty++;
+	}
+
+	spin_unlock_irq(&page_cache_lock, flags);
+}
+
+/**
+ * @brief Take c out of the cache and drop the cache's reference to its page.
+ *
+ * Assumes page_cache_lock is held.
+ */
+static void cache_remove(struct cached_page *c)
+{
+	rb_erase(&c->rb_node, &c->inode->cached_pages);
+	list_remove(&lru, c, lru_link);
+	free_page(c->page);
+
+	if (c->dirty)
+		page_cache_stats.dirty--;
+	page_cache_stats.pages--;
+
+	kmem_cache_free(&cached_page_cache, c);
+}
+
+void page_cache_forget(struct vfs_inode *inode)
+{
+	unsigned long flags;
+
+	spin_lock_irq(&page_cache_lock, &flags);
+
+	while (inode->cached_pages.node)
+		cache_remove(cached_page_entry(inode->cached_pages.node));
+
+	spin_unlock_irq(&page_cache_lock, flags);
+}
+
+/**
+ * @brief Give back the cached pages that aren't mapped anywhere and
+ * haven't been written to.
+ */
+static unsigned long page_cache_shrink(void)
+{
+	struct cached_page *c, *next;
+	unsigned long freed = 0;
+	unsigned long flags;
+
+	spin_lock_irq(&page_cache_lock, &flags);
+
+	for (c = list_head(&lru); c; c = next) {
+		next = list_next(c, lru_link);
+
+		/*
+		 * The cache's own reference has to be the only one left. Dirty
+		 * pages have nowhere to be written back to, so they stay.
+		 */
+		if (c->page->count != 1 || c->dirty)
+			continue;
+
+		cache_remove(c);
+		page_cache_stats.evictions++;
+		freed++;
+	}
+
+	spin_unlock_irq(&page_cache_lock, flags);
+
+	return freed;
+}
+
+static struct page_shrinker page_cache_shrinker = {
+	.name = "page_cache",
+	.shrink = page_cache_shrink,
+};
+
+void page_cache_init(void)
+{
+	TRACE();
+	register_page_shrinker(&page_cache_shrinker);
+}
+
+void page_cache_dump(printf_f p)
+{
+	p("page cache: %d pages (%d dirty), %d hits, %d misses, %d in place, "
+	  "%d evictions\n", page_cache_stats.pages, page_cache_stats.dirty,
+	  page_cache_stats.hits, page_cache_stats.misses,
+	  page_cache_stats.in_place, page_cache_stats.evictions);
+}
+
+#include <kernel/test.h>
+#include <kernel/proc.h>
+BEGIN_TEST(page_cache_test)
+{
+	struct vfs_file *file = CURRENT_PROCESS->exec_file;
+	struct page *page, *again;
+	unsigned long found;
+
+	ASSERT_NOT_NULL(file);
+
+	ASSERT_EQUALS(page_cache_get(file, 0, &page), 0);
+
+	/*
+	 * The second lookup finds the same physical page, in the cache or in
+	 * the initrd.
+	 */
+	found = page_cache_stats.hits + page_cache_stats.in_place;
+	ASSERT_EQUALS(page_cache_get(file, 0, &again), 0);
+	ASSERT_EQUALS(page, again);
+	ASSERT_EQUALS(page_cache_stats.hits + page_cache_stats.in_place,
+		      found + 1);
+
+	page_put(again);
+	page_put(page);
+}
+END_TEST
@@ -7,20 +7,178 @@
 
 #include <mm/kmalloc.h>
 
+#include <arch/cpu.h>
+#include <arch/irq.h>
+
 #include <errno.h>
 #include <stddef.h>
 #include <assert.h>
 #include <string.h>
+#include <math.h>
 
-struct page *phys_pages;    /* All pages in physical memory */
+struct mem_section mem_sections[NR_SECTIONS]; /* struct pages, by section */
 struct page_zone *zones;  /* Physical memory divided up into zones */
 
+list_typedef(struct page_shrinker) page_shrinker_list_t;
+
+static page_shrinker_list_t shrinkers = INITIALIZED_EMPTY_LIST;
+static struct spinlock shrinkers_lock = INITIALIZED_SPINLOCK;
+
+/**
+ * @brief Return the smallest order such that a block of that order holds
+ * at least n pages.
+ */
+static inline unsigned order_of(unsigned long n)
+{
+	unsigned order = 0;
+
+	while ((1UL << order) < n)
+		order++;
+
+	return order;
+}
+
+/**
+ * @brief Put the block of 2^order pages starting at page on the zone's free
+ * list. The caller is responsible for coalescing.
+ *
+ * Assumes the zone lock is already held.
+ */
+static inline void push_free_block(struct page_zone *zone, struct page *page,
+				   unsigned order)
+{
+	ASSERT(!(page->flags & PG_BUDDY));
+
+	page->flags |= PG_BUDDY;
+	page->order = order;
+	list_insert_head(&zone->free_lists[order], page, free_link);
+}
+
+/**
+ * @brief Take the block headed by page off of the zone's free lists.
+ *
+ * Assumes the zone lock is already held.
+ */
+static inline void pop_free_block(struct page_zone *zone, struct page *page)
+{
+	ASSERT(page->flags & PG_BUDDY);
+
+	list_remove(&zone->free_lists[page->order], page, free_link);
+	page->flags &= ~PG_BUDDY;
+}
+
+/**
+ * @brief Return the block of 2^order pages starting at page to the zone,
+ * merging it with its buddy for as long as the buddy is also free.
+ *
+ * Buddies are found with the page frame number rather than the struct page,
+ * since the struct pages of different sections aren't contiguous. Blocks
+ * never straddle a section, so the pages within one block are.
+ *
+ * Assumes the zone lock is already held.
+ */
+static void __free_block(struct page_zone *zone, struct page *page,
+			 unsigned order)
+{
+	unsigned long pfn = page_pfn(page);
+
+	while (order < MAX_ORDER - 1) {
+		unsigned long buddy_pfn = pfn ^ (1UL << order);
+		struct page *buddy;
+
+		if (buddy_pfn < zone->start_pfn ||
+		    buddy_pfn + (1UL << order) > zone->end_pfn)
+			break;
+
+		buddy = page + ((long) buddy_pfn - (long) pfn);
+		if (!(buddy->flags & PG_BUDDY) || buddy->order != order)
+			break;
+
+		pop_free_block(zone, buddy);
+
+		if (buddy_pfn < pfn) {
+			page = buddy;
+			pfn = buddy_pfn;
+		}
+		order++;
+	}
+
+	push_free_block(zone, page, order);
+}
+
+/**
+ * @brief Give the page frames [pfn, pfn + n) of the zone back to its free
+ * lists, using the largest naturally aligned blocks possible.
+ *
+ * Assumes the zone lock is already held.
+ */
+static void __free_range(struct page_zone *zone, unsigned long pfn,
+			 unsigned long n)
+{
+	unsigned long end = pfn + n;
+
+	while (pfn < end) {
+		unsigned order = MAX_ORDER - 1;
+
+		while ((pfn & ((1UL << order) - 1)) ||
+		       pfn + (1UL << order) > end)
+			order--;
+
+		__free_block(zone, pfn_page(pfn), order);
+		pfn += 1UL << order;
+	}
+}
+
+/**
+ * @brief Initialize a zone spanning the physical addresses [start, end)
+ * and give it all the usable memory in that span.
+ */
+static void zone_init(struct page_zone *zone, const char *name,
+		      phys_addr_t start, phys_addr_t end)
+{
+	unsigned order;
+	int cpu;
+	int i;
+
+	zone->name = name;
+	zone->start_pfn = start / PAGE_SIZE;
+	zone->end_pfn = end / PAGE_SIZE;
+
+	for (order = 0; order < MAX_ORDER; order++)
+		list_init(&zone->free_lists[order]);
+
+	spin_lock_init(&zone->lock);
+
+	for (cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+		struct per_cpu_pages *pcp = &zone->pcp[cpu];
+
+		list_init(&pcp->list);
+		pcp->low = PCP_LOW;
+		pcp->high = PCP_HIGH;
+		pcp->batch = PCP_BATCH;
+	}
+
+	for (i = 0; i < mem_num_regions; i++) {
+		struct mem_region *r = &mem_regions[i];
+		size_t s = r->start > start ? r->start : start;
+		size_t e = r->end < end ? r->end : end;
+
+		if (s >= e)
+			continue;
+
+		__free_range(zone, s / PAGE_SIZE, (e - s) / PAGE_SIZE);
+		zone->num_pages += (e - s) / PAGE_SIZE;
+	}
+
+	zone->num_free = zone->num_pages;
+}
+
 /**
  * @brief Initialize all the page_zones.
  */
 void page_zones_init(void)
 {
-	struct page_zone *zone;
+	size_t normal_end;
 
 	zones = kmalloc(sizeof(struct page_zone) * MAX_ZONES);
 	ASSERT_NOT_NULL(zones);
@@ -28,32 +186,77 @@ void page_zones_init(void)
 	memset(zones, 0, sizeof(struct page_zone) * MAX_ZONES);
 
 	/*
-	 * We don't do anything fancy like NUMA. There is just one contiguous page
-	 * zone covering all of physical memory.
+	 * If memory is small, kdirect may end below ZONE_DMA_END and the
+	 * normal zone is empty.
 	 */
-	zone = zones;
-	zone->pages = phys_pages;
-	zone->num_pages = phys_mem_pages;
-	zone->num_free = phys_mem_pages;
-	zone->index = 0;
+	normal_end = (size_t) kdirect_end - (size_t) kdirect_start;
+	if (normal_end < ZONE_DMA_END)
+		normal_end = ZONE_DMA_END;
 
-	spin_lock_init(&zone->lock);
+	zone_init(&zones[ZONE_DMA], "DMA", 0, ZONE_DMA_END);
+	zone_init(&zones[ZONE_NORMAL], "Normal", ZONE_DMA_END, normal_end);
+	zone_init(&zones[ZONE_HIGH], "High", normal_end, phys_mem_bytes);
 }
 
-
 /**
- * @breif Initialize the physical page management system.
+ * @brief Allocate the struct pages for every section that contains usable
+ * RAM. All pages start out reserved, and then the usable ones are released.
  */
-void pages_init(void)
+static void mem_sections_init(void)
 {
-	phys_pages = kmalloc(sizeof(struct page) * phys_mem_pages);
-	ASSERT_NOT_NULL(phys_pages);
+	unsigned long num_sections = 0;
+	int i;
+
+	for (i = 0; i < mem_num_regions; i++) {
+		struct mem_region *r = &mem_regions[i];
+		unsigned long section;
+
+		for (section = r->start >> SECTION_SHIFT;
+		     section <= (r->end - 1) >> SECTION_SHIFT; section++) {
+			struct mem_section *ms = &mem_sections[section];
+			unsigned long j;
+
+			if (ms->pages)
+				continue;
+
+			ms->pages = kmalloc(sizeof(struct page) * PAGES_PER_SECTION);
+			ASSERT_NOT_NULL(ms->pages);
+
+			memset(ms->pages, 0, sizeof(struct page) * PAGES_PER_SECTION);
+
+			for (j = 0; j < PAGES_PER_SECTION; j++) {
+				ms->pages[j].flags = (section << PG_SECTION_SHIFT) |
+						     PG_RESERVED;
+				ms->pages[j].count = 1;
+			}
+
+			num_sections++;
+		}
+	}
 
-	memset(phys_pages, 0, sizeof(struct page) * phys_mem_pages);
+	for (i = 0; i < mem_num_regions; i++) {
+		struct mem_region *r = &mem_regions[i];
+		phys_addr_t addr;
 
-	INFO("phys_pages: %d pages (page list: %d KB total)",
-	     phys_mem_pages, phys_mem_pages * sizeof(struct page) / KB(1));
+		for (addr = r->start; addr < r->end; addr += PAGE_SIZE) {
+			struct page *page = page_struct(addr);
 
+			page->flags &= ~PG_RESERVED;
+			page->count = 0;
+		}
+	}
+
+	INFO("phys_pages: %d sections of %d MB (page list: %d KB total)",
+	     num_sections, SECTION_SIZE / MB(1),
+	     num_sections * PAGES_PER_SECTION * sizeof(struct page) / KB(1));
+}
+
+/**
+ * @breif Initialize the physical page management system.
+ */
+void pages_init(void)
+{
+	mem_sections_init();
 	page_zones_init();
 }
 
@@ -62,10 +265,9 @@ void pages_init(void)
  */
 bool zone_contains(struct page_zone *zone, size_t addr)
 {
-	size_t page_addr = PAGE_ALIGN_DOWN(addr);
+	unsigned long pfn = addr / PAGE_SIZE;
 
-	return ZONE_START_PAGE_ADDR(zone) <= page_addr &&
-		ZONE_END_PAGE_ADDR(zone)   >= page_addr;
+	return zone->start_pfn <= pfn && pfn < zone->end_pfn;
 }
 
 /**
@@ -76,7 +278,7 @@ struct page_zone *zone_containing(size_t addr)
 	struct page_zone *zone;
 
 	for (zone = zones; zone < zones + MAX_ZONES; zone++) {
-		if (zone && zone_contains(zone, addr)) {
+		if (zone_contains(zone, addr)) {
 			return zone;
 		}
 	}
@@ -84,105 +286,269 @@ struct page_zone *zone_containing(size_t addr)
 	return NULL;
 }
 
-static struct page *__alloc_pages_at(size_t addr, unsigned long n, struct page_zone *zone)
+/**
+ * @brief Find the free block that contains the page frame pfn.
+ *
+ * Assumes the zone lock is already held.
+ *
+ * @return The head page of the block, or NULL if the page is not free.
+ */
+static struct page *find_free_block(struct page_zone *zone, unsigned long pfn)
 {
+	struct page *page = pfn_page(pfn);
+	unsigned order;
+
+	for (order = 0; order < MAX_ORDER; order++) {
+		unsigned long head_pfn = pfn & ~((1UL << order) - 1);
+		struct page *head;
+
+		if (head_pfn < zone->start_pfn)
+			break;
+
+		head = page - (pfn - head_pfn);
+
+		if ((head->flags & PG_BUDDY) && head->order == order)
+			return head;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Remove the page frame pfn from the free block that contains it,
+ * giving the rest of the block back to the free lists.
+ *
+ * Assumes the zone lock is already held and that the page is free.
+ */
+static void carve_page(struct page_zone *zone, unsigned long pfn)
+{
+	struct page *head = find_free_block(zone, pfn);
+	unsigned long head_pfn;
+	unsigned order;
+
+	ASSERT_NOT_NULL(head);
+
+	order = head->order;
+	head_pfn = page_pfn(head);
+	pop_free_block(zone, head);
+
+	/*
+	 * Split the block in half until we are left with just the page we
+	 * want, freeing the half that doesn't contain the page each time.
+	 */
+	while (order > 0) {
+		unsigned long half = 1UL << --order;
+
+		if (pfn < head_pfn + half) {
+			push_free_block(zone, head + half, order);
+		}
+		else {
+			push_free_block(zone, head, order);
+			head += half;
+			head_pfn += half;
+		}
+	}
+}
+
+/**
+ * @brief Give up to n of the coldest pages on the per-cpu list back to the
+ * zone's free lists.
+ *
+ * Assumes irqs are disabled.
+ */
+static void pcp_drain(struct per_cpu_pages *pcp, struct page_zone *zone,
+		      unsigned long n)
+{
+	spin_lock(&zone->lock);
+
+	while (n-- && !list_empty(&pcp->list)) {
+		struct page *page = list_tail(&pcp->list);
+
+		list_remove(&pcp->list, page, free_link);
+		__free_block(zone, page, 0);
+		zone->num_free++;
+	}
+
+	spin_unlock(&zone->lock);
+
+	pcp->drains++;
+}
+
+/**
+ * @brief Reserve the page frames [pfn, pfn + n), which must all lie in the
+ * given zone. Reserved (non-RAM) pages in the range are skipped.
+ *
+ * @return false if any of the pages are already in use.
+ */
+static bool __alloc_pages_at(unsigned long pfn, unsigned long n,
+			     struct page_zone *zone)
+{
+	struct per_cpu_pages *pcp;
 	unsigned long flags;
-	struct page *page;
-	struct page *end;
-	struct page *p = NULL;
+	unsigned long end = pfn + n;
+	unsigned long i;
+	bool ret = false;
 
-	spin_lock_irq(&zone->lock, &flags);
+	disable_save_irqs(&flags);
+
+	/*
+	 * Pages sitting in the per-cpu lists are free but not in the buddy
+	 * free lists, so push them back to the zone before looking for the
+	 * range.
+	 */
+	pcp = &zone->pcp[cpu_id()];
+	if (!list_empty(&pcp->list))
+		pcp_drain(pcp, zone, list_size(&pcp->list));
+
+	spin_lock(&zone->lock);
 
-	end = page_struct(addr + (n * PAGE_SIZE));
+	for (i = pfn; i < end; i++) {
+		struct page *page = pfn_page(i);
 
-	for (page = page_struct(addr); page < end; page++) {
-		if (page->count)
+		if (!page)
 			goto out;
-	}
 
-	for (page = page_struct(addr); page < end; page++) {
-		page_get(page);
+		if (!(page->flags & PG_RESERVED) && page->count)
+			goto out;
 	}
 
-	zone->num_free -= n;
+	while (pfn < end) {
+		struct page *page = pfn_page(pfn);
+		struct page *head;
+		unsigned long block_end;
+
+		if (page->flags & PG_RESERVED) {
+			pfn++;
+			continue;
+		}
 
-	p = page_struct(addr);
+		head = find_free_block(zone, pfn);
+		block_end = page_pfn(head) + (1UL << head->order);
+
+		/*
+		 * Take the whole block if it lies entirely inside the range.
+		 * Otherwise just carve out the one page we need.
+		 */
+		if (head == page && block_end <= end) {
+			pop_free_block(zone, head);
+		}
+		else {
+			carve_page(zone, pfn);
+			block_end = pfn + 1;
+		}
+
+		for (; pfn < block_end; pfn++, page++) {
+			page_get(page);
+			zone->num_free--;
+		}
+	}
+
+	ret = true;
 
 out:
-	spin_unlock_irq(&zone->lock, flags);
-	return p;
+	spin_unlock(&zone->lock);
+	restore_irqs(flags);
+	return ret;
 }
 
 /**
  * @brief Attempt to allocate the n physical pages starting at address addr.
+ * The range may cross zones. Pages in the range that aren't usable RAM are
+ * left alone, but the range must not run into a section with no RAM at all.
  *
  * @param addr The physical address of the first page to reserve.
  * @param n The number of pages to allocate.
  */
 struct page *alloc_pages_at(size_t addr, unsigned long n)
 {
+	unsigned long pfn = addr / PAGE_SIZE;
+	unsigned long end = pfn + n;
+
 	TRACE("addr=0x%x, n=0x%x", addr, n);
 
 	ASSERT(IS_PAGE_ALIGNED(addr));
-	ASSERT_EQUALS(zone_containing(addr), zone_containing(addr + PAGE_SIZE * n));
 
-	return __alloc_pages_at(addr, n, zone_containing(addr));
+	while (pfn < end) {
+		struct page_zone *zone = zone_containing(pfn * PAGE_SIZE);
+		unsigned long count;
+
+		if (!zone)
+			goto fail;
+
+		count = umin(end, zone->end_pfn) - pfn;
+
+		if (!__alloc_pages_at(pfn, count, zone))
+			goto fail;
+
+		pfn += count;
+	}
+
+	return page_struct(addr);
+
+fail:
+	if (pfn > addr / PAGE_SIZE)
+		free_pages(page_struct(addr), pfn - addr / PAGE_SIZE);
+	return NULL;
 }
 
 /**
- * @brief Find n contiguous (unused) pages in the zone.
+ * @brief Take a free block of exactly 2^order pages off the zone's free
+ * lists, splitting a larger block if necessary.
  *
  * Assumes the zone lock is already held.
  */
-static struct page *find_contig_pages(unsigned long n, struct page_zone *zone)
+static struct page *__alloc_block(unsigned order, struct page_zone *zone)
 {
-	unsigned long num_contig;
-	struct page *start;
 	struct page *page;
+	unsigned o;
 
-	start = zone->pages + zone->index;
-	page = start;
-	num_contig = 0;
+	for (o = order; o < MAX_ORDER; o++) {
+		if (!list_empty(&zone->free_lists[o]))
+			break;
+	}
 
-	do {
-		/*
-		 * This page is in use.
-		 */
-		if (page->count) {
-			num_contig = 0;
-		}
-		else {
-			num_contig++;
+	if (o == MAX_ORDER)
+		return NULL;
 
-			if (num_contig == n) {
-				return page - (n - 1);
-			}
-		}
+	page = list_head(&zone->free_lists[o]);
+	pop_free_block(zone, page);
 
-		zone->index++;
-		if (zone->index == zone->num_pages) {
-			zone->index = 0;
-			num_contig = 0;
-		}
-		page = zone->pages + zone->index;
-	} while (page != start);
+	/*
+	 * Split the block, giving the upper half back each time, until it is
+	 * the size we want.
+	 */
+	while (o > order) {
+		o--;
+		push_free_block(zone, page + (1UL << o), o);
+	}
 
-	return NULL;
+	return page;
 }
 
-struct page *__alloc_pages(unsigned long n, struct page_zone *zone)
+static struct page *__alloc_pages(unsigned long n, struct page_zone *zone)
 {
 	unsigned long flags;
 	struct page *pages;
 	struct page *p;
+	unsigned order;
+
+	order = order_of(n);
+	if (order >= MAX_ORDER)
+		return NULL;
 
 	spin_lock_irq(&zone->lock, &flags);
 
-	pages = find_contig_pages(n, zone);
+	pages = __alloc_block(order, zone);
 	if (!pages) {
 		goto alloc_pages_out;
 	}
 
+	/*
+	 * Give back the tail of the block if n isn't a power of two.
+	 */
+	if (n < (1UL << order))
+		__free_range(zone, page_pfn(pages) + n, (1UL << order) - n);
+
 	for (p = pages; p < pages + n; p++) {
 		page_get(p);
 	}
@@ -195,33 +561,145 @@ alloc_pages_out:
 }
 
 /**
- * @brief Allocate n continuous pages.
+ * @brief Move a batch of pages from the zone's free lists onto the per-cpu
+ * list.
+ *
+ * Assumes irqs are disabled.
+ */
+static void pcp_refill(struct per_cpu_pages *pcp, struct page_zone *zone)
+{
+	unsigned long i;
+
+	spin_lock(&zone->lock);
+
+	for (i = 0; i < pcp->batch; i++) {
+		struct page *page = __alloc_block(0, zone);
+
+		if (!page)
+			break;
+
+		list_insert_tail(&pcp->list, page, free_link);
+		zone->num_free--;
+	}
+
+	spin_unlock(&zone->lock);
+
+	if (i)
+		pcp->refills++;
+}
+
+/**
+ * @brief Allocate a single page, from the per-cpu list if possible.
+ */
+static struct page *__alloc_page(struct page_zone *zone)
+{
+	struct per_cpu_pages *pcp;
+	struct page *page = NULL;
+	unsigned long flags;
+	bool hit;
+
+	disable_save_irqs(&flags);
+
+	pcp = &zone->pcp[cpu_id()];
+
+	/*
+	 * Only an allocation the list could serve without going to the zone
+	 * counts as a hit.
+	 */
+	hit = !list_empty(&pcp->list);
+
+	if ((unsigned long) list_size(&pcp->list) <= pcp->low)
+		pcp_refill(pcp, zone);
+
+	if (!list_empty(&pcp->list)) {
+		page = list_head(&pcp->list);
+		list_remove(&pcp->list, page, free_link);
+		page_get(page);
+		if (hit)
+			pcp->hits++;
+	}
+
+	restore_irqs(flags);
+	return page;
+}
+
+/**
+ * @brief Allocate n continuous pages from the given zone, or if it's out of
+ * memory, from the zones below it. Never calls the shrinkers.
  *
  * @return
  *    NULL if n contiguous pages could not be found
- *    0 otherwise
+ *    the first page otherwise
  */
-struct page *alloc_pages(unsigned long n)
+struct page *__alloc_zone_pages(int zone, unsigned long n)
 {
-	TRACE("n=%d", n);
+	TRACE("zone=%d, n=%d", zone, n);
 	ASSERT_NOTEQUALS(n, 0);
-	return __alloc_pages(n, zones);
+	ASSERT(zone >= 0 && zone < MAX_ZONES);
+
+	for (; zone >= 0; zone--) {
+		struct page *pages;
+
+		if (!zones[zone].num_pages)
+			continue;
+
+		if (n == 1)
+			pages = __alloc_page(&zones[zone]);
+		else
+			pages = __alloc_pages(n, &zones[zone]);
+
+		if (pages)
+			return pages;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Allocate n continuous pages from the given zone, or if it's out of
+ * memory, from the zones below it. If there still aren't enough free pages,
+ * ask the shrinkers for some memory back and try again.
+ *
+ * @return
+ *    NULL if n contiguous pages could not be found
+ *    the first page otherwise
+ */
+struct page *alloc_zone_pages(int zone, unsigned long n)
+{
+	struct page *pages;
+
+	pages = __alloc_zone_pages(zone, n);
+	if (pages)
+		return pages;
+
+	/*
+	 * Even if the shrinkers found nothing, draining the per-cpu lists
+	 * may have let enough free pages coalesce for a large block.
+	 */
+	shrink_pages();
+
+	return __alloc_zone_pages(zone, n);
 }
 
-void __free_pages(struct page *pages, unsigned long n, struct page_zone *zone)
+/**
+ * @brief Put a page whose last reference was just dropped on the head of
+ * the per-cpu list, draining the list if it has grown too long.
+ */
+static void __free_page(struct page *page, struct page_zone *zone)
 {
+	struct per_cpu_pages *pcp;
 	unsigned long flags;
-	struct page *p;
 
-	spin_lock_irq(&zone->lock, &flags);
+	disable_save_irqs(&flags);
 
-	for (p = pages; p < pages + n; p++) {
-		page_put(p);
-	}
+	pcp = &zone->pcp[cpu_id()];
 
-	zone->num_free += n;
+	list_insert_head(&pcp->list, page, free_link);
 
-	spin_unlock_irq(&zone->lock, flags);
+	if ((unsigned long) list_size(&pcp->list) > pcp->high)
+		pcp_drain(pcp, zone, pcp->batch);
+
+	restore_irqs(flags);
 }
 
 /**
@@ -229,6 +707,210 @@ void __free_pages(struct page *pages, unsigned long n, struct page_zone *zone)
  */
 void free_pages(struct page *pages, unsigned long n)
 {
+	unsigned long pfn = page_pfn(pages);
+	unsigned long end = pfn + n;
+	struct page_zone *zone = NULL;
+
 	TRACE("pages=%p, n=%d", pages, n);
-	__free_pages(pages, n, zone_containing(page_address(pages)));
+
+	for (; pfn < end; pfn++) {
+		struct page *p = pfn_page(pfn);
+
+		if (!p || (p->flags & PG_RESERVED))
+			continue;
+
+		ASSERT_GREATER(p->count, 0);
+
+		/*
+		 * Only give the page back to the allocator when the last
+		 * reference is dropped.
+		 */
+		if (atomic_dec(&p->count) != 1)
+			continue;
+
+		if (!zone || pfn >= zone->end_pfn)
+			zone = zone_containing(pfn * PAGE_SIZE);
+
+		__free_page(p, zone);
+	}
+}
+
+/**
+ * @brief Give every page on the per-cpu lists back to the zones.
+ */
+void drain_pages(void)
+{
+	struct page_zone *zone;
+	unsigned long flags;
+
+	disable_save_irqs(&flags);
+
+	for (zone = zones; zone < zones + MAX_ZONES; zone++) {
+		struct per_cpu_pages *pcp = &zone->pcp[cpu_id()];
+
+		if (!list_empty(&pcp->list))
+			pcp_drain(pcp, zone, list_size(&pcp->list));
+	}
+
+	restore_irqs(flags);
+}
+
+void register_page_shrinker(struct page_shrinker *shrinker)
+{
+	unsigned long flags;
+
+	spin_lock_irq(&shrinkers_lock, &flags);
+	list_insert_tail(&shrinkers, shrinker, link);
+	spin_unlock_irq(&shrinkers_lock, flags);
+}
+
+/**
+ * @brief Ask every shrinker to give back the memory it can spare, and
+ * flush the per-cpu lists so the freed pages can coalesce.
+ *
+ * The shrinkers are called without shrinkers_lock held, since they free
+ * memory. Shrinkers are never unregistered, so the list can be walked
+ * safely.
+ *
+ * @return The number of pages the shrinkers freed.
+ */
+unsigned long shrink_pages(void)
+{
+	struct page_shrinker *shrinker;
+	unsigned long freed = 0;
+
+	list_foreach(shrinker, &shrinkers, link) {
+		unsigned long n = shrinker->shrink();
+
+		if (n)
+			DEBUG("shrink_pages: %s freed %d pages",
+			      shrinker->name, n);
+		freed += n;
+	}
+
+	drain_pages();
+	return freed;
+}
+
+void pages_dump(printf_f p)
+{
+	struct page_zone *zone;
+	int cpu;
+
+	for (zone = zones; zone < zones + MAX_ZONES; zone++) {
+		p("zone %-6s 0x%09llx - 0x%09llx: %d pages, %d free\n",
+		  zone->name, (u64) zone->start_pfn * PAGE_SIZE,
+		  (u64) zone->end_pfn * PAGE_SIZE, zone->num_pages,
+		  zone->num_free);
+
+		for (cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+			struct per_cpu_pages *pcp = &zone->pcp[cpu];
+
+			p("  cpu %d: %d pages, %d hits, %d refills, %d drains\n",
+			  cpu, list_size(&pcp->list), pcp->hits, pcp->refills,
+			  pcp->drains);
+		}
+	}
+
+	zero_pool_dump(p);
+}
+
+#include <kernel/test.h>
+
+/*
+ * The linear scan the buddy allocator replaced, kept here so the benchmark
+ * below can compare against it. It walks physical memory from the start
+ * looking for n pages with no references.
+ */
+static struct page *scan_contig_pages(unsigned long n)
+{
+	unsigned long num_contig = 0;
+	unsigned long section;
+
+	for (section = 0; section < NR_SECTIONS; section++) {
+		struct page *pages = mem_sections[section].pages;
+		struct page *page;
+
+		if (!pages) {
+			num_contig = 0;
+			continue;
+		}
+
+		for (page = pages; page < pages + PAGES_PER_SECTION; page++) {
+			if (page->count) {
+				num_contig = 0;
+				continue;
+			}
+
+			if (++num_contig == n)
+				return page - (n - 1);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Compare the latency of alloc_page() against the old linear scan. The
+ * scan's cost depends on how much RAM is in the machine, so run this with
+ * different amounts of memory (e.g. 64MB, 512MB and 3GB) to see the
+ * difference.
+ */
+BEGIN_TEST(pages_bench)
+{
+#define BENCH_PAGES 256
+	struct page *pages[BENCH_PAGES];
+	u64 alloc_cycles = 0, scan_cycles = 0;
+	unsigned long flags;
+	u64 start;
+	int i;
+
+	for (i = 0; i < BENCH_PAGES; i++) {
+		start = rdtsc();
+		pages[i] = alloc_page();
+		alloc_cycles += rdtsc() - start;
+
+		ASSERT_NOT_NULL(pages[i]);
+	}
+
+	/*
+	 * Each scan has to walk past the pages we just allocated, as well as
+	 * everything else in use (e.g. kdirect), just like the old allocator
+	 * did once zone->index wrapped around.
+	 */
+	disable_save_irqs(&flags);
+	for (i = 0; i < BENCH_PAGES; i++) {
+		start = rdtsc();
+		ASSERT_NOT_NULL(scan_contig_pages(1));
+		scan_cycles += rdtsc() - start;
+	}
+	restore_irqs(flags);
+
+	for (i = 0; i < BENCH_PAGES; i++) {
+		free_page(pages[i]);
+	}
+
+	INFO("pages_bench: %d MB RAM", phys_mem_pages / (MB(1) / PAGE_SIZE));
+	INFO("pages_bench: alloc_page %llu cycles/alloc, scan %llu cycles/alloc",
+	     alloc_cycles / BENCH_PAGES, scan_cycles / BENCH_PAGES);
+	pages_dump(log);
+#undef BENCH_PAGES
+}
+END_TEST
+
+BEGIN_TEST(dma_zone_test)
+{
+	struct page *page;
+
+	/*
+	 * Most of the low 16MB is only reserved while the early heap might
+	 * need it, so there must be DMA pages left once we're booted.
+	 */
+	ASSERT_NOTEQUALS(0, zones[ZONE_DMA].num_free);
+
+	page = alloc_dma_pages(1);
+	ASSERT_NOT_NULL(page);
+	ASSERT_LESS(page_address(page), ZONE_DMA_END);
+	free_page(page);
 }
+END_TEST
@@ -0,0 +1,76 @@
+/**
+ * @file mm/shmem.c
+ *
+ * @brief Shared anonymous memory (see mm/shmem.h).
+ */
+#include <mm/shmem.h>
+#include <mm/page_cache.h>
+#include <mm/slab.h>
+
+#include <kernel/log.h>
+#include <fs/vfs.h>
+
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * The file, its dirent and its inode are allocated together and go away
+ * together.
+ */
+struct shmem {
+	struct vfs_file file;
+	struct vfs_dirent dirent;
+	struct vfs_inode inode;
+};
+
+static struct kmem_cache shmem_cache =
+	INITIALIZED_KMEM_CACHE("shmem", sizeof(struct shmem), 0, NULL);
+
+static ssize_t shmem_read(struct vfs_file *f, char *buf, size_t size,
+			  size_t off)
+{
+	(void) f; (void) buf; (void) size; (void) off;
+
+	/* nothing to read, the page cache fills the pages with zeros */
+	return 0;
+}
+
+static void shmem_release(struct vfs_file *f)
+{
+	struct shmem *shm = container_of(f, struct shmem, file);
+
+	page_cache_forget(&shm->inode);
+	kmem_cache_free(&shmem_cache, shm);
+}
+
+static struct vfs_file_ops shmem_fops = {
+	.read = shmem_read,
+	.release = shmem_release,
+};
+
+struct vfs_file *new_shmem_file(unsigned long length)
+{
+	struct shmem *shm;
+
+	TRACE("length=0x%x", length);
+
+	shm = kmem_cache_alloc(&shmem_cache);
+	if (!shm)
+		return NULL;
+
+	inode_init(&shm->inode, 0);
+	shm->inode.flags = VFS_FILE;
+	shm->inode.length = length;
+	shm->inode.fops = &shmem_fops;
+
+	dirent_init(&shm->dirent, "shmem");
+	shm->dirent.inode = &shm->inode;
+	shm->dirent.refs = 1;
+
+	memset(&shm->file, 0, sizeof(struct vfs_file));
+	shm->file.dirent = &shm->dirent;
+	shm->file.fops = &shmem_fops;
+	shm->file.refs = 1;
+
+	return &shm->file;
+}
@@ -0,0 +1,560 @@
+/**
+ * @file mm/slab.c
+ *
+ * @brief Object caches (see mm/slab.h).
+ *
+ * Slabs come from the kernel heap, and are aligned to their own size so the
+ * slab an object belongs to is found by rounding the object's address down.
+ * The slab header sits at the start of the slab, followed by the objects.
+ */
+#include <mm/slab.h>
+#include <mm/kmalloc.h>
+#include <mm/memory.h>
+#include <mm/pages.h>
+
+#include <arch/cpu.h>
+#include <arch/irq.h>
+
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+
+/*
+ * Slabs are grown (doubling from one page) until at most 1/8th of the slab
+ * is lost to the header and the space left over after the last object, or
+ * until they reach KMEM_MAX_SLAB_SIZE.
+ */
+#define KMEM_MAX_SLAB_SIZE (16 * PAGE_SIZE)
+
+/*
+ * Each cache keeps at most this many empty slabs around. The rest are
+ * given back to the kernel heap.
+ */
+#define KMEM_MAX_EMPTY_SLABS 1
+
+/*
+ * All caches that have been used, for kmem_cache_dump().
+ */
+static kmem_cache_list_t caches = INITIALIZED_EMPTY_LIST;
+static struct spinlock caches_lock = INITIALIZED_SPINLOCK;
+
+/*
+ * Set once the kernel heap's pages have been taken out of the page
+ * allocator, after which the struct page of every slab page records the
+ * slab's cache.
+ */
+static bool slab_pages_ready;
+
+/*
+ * Slabs are allocated from the kernel heap, so the heap counts them as in
+ * use even when all their objects are free. These let kmalloc_bytes_used()
+ * count the objects handed out instead of the slabs holding them.
+ */
+static size_t kmem_slab_bytes;    /* bytes of heap taken by slabs */
+static size_t kmem_object_bytes;  /* bytes of objects allocated */
+
+#define kheap_page(_addr) \
+	page_struct((size_t) (_addr) - CONFIG_KERNEL_VIRTUAL_START)
+
+#define free_ptr(_cache, _obj) \
+	((void **) ((char *) (_obj) + (_cache)->free_offset))
+
+#define obj_slab(_cache, _obj) \
+	((struct kmem_slab *) ALIGN_DOWN((size_t) (_obj), (_cache)->slab_size))
+
+/**
+ * @brief Work out the slab layout of a cache, and add it to the list of
+ * caches. Called with the cache's lock held, before its first slab is
+ * created.
+ */
+static void cache_setup(struct kmem_cache *cache)
+{
+	unsigned long flags;
+	size_t align, size;
+
+	align = cache->align > sizeof(void *) ? cache->align : sizeof(void *);
+	size = ALIGN_UP(cache->size, sizeof(void *));
+
+	/*
+	 * A constructed object has to keep its contents while it's free, so
+	 * the free list pointer goes after it.
+	 */
+	if (cache->ctor) {
+		cache->free_offset = size;
+		size += sizeof(void *);
+	}
+	else {
+		cache->free_offset = 0;
+	}
+
+	cache->stride = ALIGN_UP(size, align);
+	cache->offset = ALIGN_UP(sizeof(struct kmem_slab), align);
+
+	for (cache->slab_size = PAGE_SIZE;; cache->slab_size *= 2) {
+		size_t waste;
+
+		if (cache->slab_size < cache->offset + cache->stride)
+			continue;
+
+		cache->objs_per_slab =
+			(cache->slab_size - cache->offset) / cache->stride;
+		waste = cache->slab_size -
+			cache->objs_per_slab * cache->stride;
+
+		if (waste * 8 <= cache->slab_size ||
+		    cache->slab_size >= KMEM_MAX_SLAB_SIZE)
+			break;
+	}
+
+	spin_lock_irq(&caches_lock, &flags);
+	list_insert_tail(&caches, cache, cache_link);
+	spin_unlock_irq(&caches_lock, flags);
+}
+
+/**
+ * @brief Mark the pages of a slab as belonging to cache, or to no cache if
+ * cache is NULL.
+ */
+static void slab_set_pages(struct kmem_slab *slab, struct kmem_cache *cache)
+{
+	size_t addr, end = (size_t) slab + slab->cache->slab_size;
+
+	if (!slab_pages_ready)
+		return;
+
+	for (addr = (size_t) slab; addr < end; addr += PAGE_SIZE) {
+		struct page *page = kheap_page(addr);
+
+		if (cache) {
+			page->flags |= PG_SLAB;
+			page->slab_cache = cache;
+		}
+		else {
+			page->flags &= ~PG_SLAB;
+			page->slab_cache = NULL;
+		}
+	}
+}
+
+static inline kmem_slab_list_t *slab_list(struct kmem_cache *cache,
+					  struct kmem_slab *slab)
+{
+	if (slab->inuse == 0)
+		return &cache->empty;
+	if (slab->inuse == cache->objs_per_slab)
+		return &cache->full;
+	return &cache->partial;
+}
+
+/**
+ * @brief Allocate a new slab, construct all its objects and put it on the
+ * cache's empty list.
+ */
+static struct kmem_slab *cache_grow(struct kmem_cache *cache)
+{
+	struct kmem_slab *slab;
+	unsigned long i;
+
+	slab = kmemalign(cache->slab_size, cache->slab_size);
+	if (!slab)
+		return NULL;
+
+	slab->cache = cache;
+	slab->inuse = 0;
+	slab->free = NULL;
+	list_elem_init(slab, link);
+
+	/* build the free list backwards, so objects are handed out in order */
+	for (i = cache->objs_per_slab; i-- > 0;) {
+		void *obj = (char *) slab + cache->offset + i * cache->stride;
+
+		if (cache->ctor)
+			cache->ctor(obj);
+
+		*free_ptr(cache, obj) = slab->free;
+		slab->free = obj;
+	}
+
+	slab_set_pages(slab, cache);
+
+	list_insert_head(&cache->empty, slab, link);
+	cache->grown++;
+	kmem_slab_bytes += cache->slab_size;
+
+	return slab;
+}
+
+static void *slab_get_obj(struct kmem_cache *cache, struct kmem_slab *slab)
+{
+	kmem_slab_list_t *old = slab_list(cache, slab);
+	kmem_slab_list_t *new;
+	void *obj;
+
+	obj = slab->free;
+	slab->free = *free_ptr(cache, obj);
+	slab->inuse++;
+
+	new = slab_list(cache, slab);
+	if (new != old) {
+		list_remove(old, slab, link);
+		list_insert_head(new, slab, link);
+	}
+
+	return obj;
+}
+
+static void slab_put_obj(struct kmem_cache *cache, void *obj)
+{
+	struct kmem_slab *slab = obj_slab(cache, obj);
+	kmem_slab_list_t *old = slab_list(cache, slab);
+	kmem_slab_list_t *new;
+
+	ASSERT_EQUALS(slab->cache, cache);
+	ASSERT_GREATER(slab->inuse, 0);
+
+	*free_ptr(cache, obj) = slab->free;
+	slab->free = obj;
+	slab->inuse--;
+
+	new = slab_list(cache, slab);
+	if (new != old) {
+		list_remove(old, slab, link);
+		list_insert_head(new, slab, link);
+	}
+}
+
+/**
+ * @brief Give empty slabs beyond the first KMEM_MAX_EMPTY_SLABS back to
+ * the kernel heap.
+ */
+static void cache_reap(struct kmem_cache *cache, int keep)
+{
+	while (list_size(&cache->empty) > keep) {
+		struct kmem_slab *slab = list_tail(&cache->empty);
+
+		list_remove(&cache->empty, slab, link);
+		slab_set_pages(slab, NULL);
+		kfree(slab, cache->slab_size);
+		cache->reaped++;
+		kmem_slab_bytes -= cache->slab_size;
+	}
+}
+
+/**
+ * @brief Move up to KMEM_MAGAZINE_BATCH objects from the cache's slabs into
+ * a magazine. Partially used slabs are used up first.
+ */
+static void magazine_refill(struct kmem_cache *cache,
+			    struct kmem_magazine *mag)
+{
+	int i;
+
+	spin_lock(&cache->lock);
+
+	if (!cache->slab_size)
+		cache_setup(cache);
+
+	for (i = 0; i < KMEM_MAGAZINE_BATCH; i++) {
+		struct kmem_slab *slab;
+
+		if (!list_empty(&cache->partial))
+			slab = list_head(&cache->partial);
+		else if (!list_empty(&cache->empty))
+			slab = list_head(&cache->empty);
+		else if (!(slab = cache_grow(cache)))
+			break;
+
+		mag->objs[mag->avail++] = slab_get_obj(cache, slab);
+	}
+
+	spin_unlock(&cache->lock);
+}
+
+/**
+ * @brief Return the n coldest objects (the bottom of the stack) in a
+ * magazine to their slabs.
+ */
+static void magazine_drain(struct kmem_cache *cache, struct kmem_magazine *mag,
+			   unsigned long n)
+{
+	unsigned long i;
+
+	spin_lock(&cache->lock);
+
+	for (i = 0; i < n; i++)
+		slab_put_obj(cache, mag->objs[i]);
+
+	mag->avail -= n;
+	memmove(mag->objs, mag->objs + n, mag->avail * sizeof(void *));
+
+	cache_reap(cache, KMEM_MAX_EMPTY_SLABS);
+
+	spin_unlock(&cache->lock);
+}
+
+/**
+ * @brief Allocate an object from a cache.
+ *
+ * @return NULL if out of memory.
+ */
+void *kmem_cache_alloc(struct kmem_cache *cache)
+{
+	struct kmem_magazine *mag;
+	unsigned long flags;
+	void *obj = NULL;
+
+	disable_save_irqs(&flags);
+
+	mag = &cache->magazine[cpu_id()];
+
+	if (mag->avail)
+		cache->hits++;
+	else
+		magazine_refill(cache, mag);
+
+	if (mag->avail) {
+		obj = mag->objs[--mag->avail];
+		cache->allocs++;
+		cache->active++;
+		kmem_object_bytes += cache->size;
+	}
+
+	restore_irqs(flags);
+	return obj;
+}
+
+/**
+ * @brief Return an object to the cache it was allocated from.
+ */
+void kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+	struct kmem_magazine *mag;
+	unsigned long flags;
+
+	disable_save_irqs(&flags);
+
+	mag = &cache->magazine[cpu_id()];
+
+	if (mag->avail == KMEM_MAGAZINE_SIZE)
+		magazine_drain(cache, mag, KMEM_MAGAZINE_BATCH);
+
+	mag->objs[mag->avail++] = obj;
+	cache->frees++;
+	cache->active--;
+	kmem_object_bytes -= cache->size;
+
+	restore_irqs(flags);
+}
+
+/**
+ * @brief Create a cache of objects of the given size and alignment (0 for
+ * pointer alignment). ctor, if not NULL, is called on each object when its
+ * slab is created.
+ *
+ * @return NULL if out of memory.
+ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align, void (*ctor)(void *))
+{
+	struct kmem_cache *cache;
+
+	cache = kmalloc(sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	memset(cache, 0, sizeof(*cache));
+	cache->name = name;
+	cache->size = size;
+	cache->align = align;
+	cache->ctor = ctor;
+	spin_lock_init(&cache->lock);
+	list_init(&cache->partial);
+	list_init(&cache->full);
+	list_init(&cache->empty);
+
+	return cache;
+}
+
+/**
+ * @brief Destroy a cache made by kmem_cache_create(). Every object must
+ * have been freed.
+ */
+void kmem_cache_destroy(struct kmem_cache *cache)
+{
+	unsigned long flags;
+	int cpu;
+
+	disable_save_irqs(&flags);
+
+	for (cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+		struct kmem_magazine *mag = &cache->magazine[cpu];
+
+		if (mag->avail)
+			magazine_drain(cache, mag, mag->avail);
+	}
+
+	restore_irqs(flags);
+
+	ASSERT_EQUALS(cache->active, 0);
+	ASSERT(list_empty(&cache->partial));
+	ASSERT(list_empty(&cache->full));
+
+	spin_lock_irq(&cache->lock, &flags);
+	cache_reap(cache, 0);
+	spin_unlock_irq(&cache->lock, flags);
+
+	if (cache->slab_size) {
+		spin_lock_irq(&caches_lock, &flags);
+		list_remove(&caches, cache, cache_link);
+		spin_unlock_irq(&caches_lock, flags);
+	}
+
+	kfree(cache, sizeof(*cache));
+}
+
+/**
+ * @return The number of heap bytes held by slabs, used or not.
+ */
+size_t kmem_cache_slab_bytes(void)
+{
+	return kmem_slab_bytes;
+}
+
+/**
+ * @return The number of bytes in objects allocated from every cache.
+ */
+size_t kmem_cache_object_bytes(void)
+{
+	return kmem_object_bytes;
+}
+
+/**
+ * @return The cache obj was allocated from, or NULL if obj isn't in a slab.
+ */
+struct kmem_cache *kmem_cache_of(const void *obj)
+{
+	struct page *page;
+
+	if (!slab_pages_ready)
+		return NULL;
+
+	page = kheap_page(obj);
+	if (!page || !(page->flags & PG_SLAB))
+		return NULL;
+
+	return page->slab_cache;
+}
+
+static void init_slab_list_pages(struct kmem_cache *cache,
+				 kmem_slab_list_t *slabs)
+{
+	struct kmem_slab *slab;
+
+	list_foreach(slab, slabs, link)
+		slab_set_pages(slab, cache);
+}
+
+/**
+ * @brief Called once the kernel heap's pages belong to the kernel (see
+ * vm_init()). Records the cache of every slab created before then in the
+ * slab's struct pages.
+ */
+void kmem_cache_init_pages(void)
+{
+	struct kmem_cache *cache;
+	unsigned long flags;
+
+	spin_lock_irq(&caches_lock, &flags);
+
+	slab_pages_ready = true;
+
+	list_foreach(cache, &caches, cache_link) {
+		__spin_lock(&cache->lock);
+		init_slab_list_pages(cache, &cache->partial);
+		init_slab_list_pages(cache, &cache->full);
+		init_slab_list_pages(cache, &cache->empty);
+		__spin_unlock(&cache->lock);
+	}
+
+	spin_unlock_irq(&caches_lock, flags);
+}
+
+/**
+ * @brief Give the objects in this cpu's magazines and every empty slab
+ * back to the kernel heap. Called when memory is short.
+ */
+void kmem_cache_shrink(void)
+{
+	struct kmem_cache *cache;
+	unsigned long flags;
+
+	spin_lock_irq(&caches_lock, &flags);
+
+	list_foreach(cache, &caches, cache_link) {
+		struct kmem_magazine *mag = &cache->magazine[cpu_id()];
+
+		if (mag->avail)
+			magazine_drain(cache, mag, mag->avail);
+
+		spin_lock(&cache->lock);
+		cache_reap(cache, 0);
+		spin_unlock(&cache->lock);
+	}
+
+	spin_unlock_irq(&caches_lock, flags);
+}
+
+void kmem_cache_dump(printf_f p)
+{
+	struct kmem_cache *cache;
+	unsigned long flags;
+
+	spin_lock_irq(&caches_lock, &flags);
+
+	list_foreach(cache, &caches, cache_link) {
+		p("%-12s %d active, %d x %d byte objs per %d KB slab, "
+		  "slabs %d partial %d full %d empty\n",
+		  cache->name, cache->active, cache->objs_per_slab,
+		  cache->stride, cache->slab_size / KB(1),
+		  list_size(&cache->partial), list_size(&cache->full),
+		  list_size(&cache->empty));
+		p("%-12s %d allocs, %d frees, %d magazine hits, "
+		  "%d slabs grown, %d reaped\n",
+		  "", cache->allocs, cache->frees, cache->hits,
+		  cache->grown, cache->reaped);
+	}
+
+	spin_unlock_irq(&caches_lock, flags);
+}
+
+#include <kernel/test.h>
+BEGIN_TEST(kmem_cache_test)
+{
+#define N 200
+	static void *objs[N];
+	struct kmem_cache *cache;
+	int i;
+
+	cache = kmem_cache_create("test", 24, 0, NULL);
+	ASSERT_NOT_NULL(cache);
+
+	for (i = 0; i < N; i++) {
+		objs[i] = kmem_cache_alloc(cache);
+		ASSERT_NOT_NULL(objs[i]);
+		ASSERT_EQUALS((size_t) objs[i] % sizeof(void *), 0);
+		memset(objs[i], i, 24);
+	}
+
+	for (i = 0; i < N; i++)
+		ASSERT_EQUALS(*(unsigned char *) objs[i], (unsigned char) i);
+
+	for (i = 0; i < N; i += 2)
+		kmem_cache_free(cache, objs[i]);
+	for (i = 1; i < N; i += 2)
+		kmem_cache_free(cache, objs[i]);
+
+	kmem_cache_dump(log);
+	kmem_cache_destroy(cache);
+#undef N
+}
+END_TEST
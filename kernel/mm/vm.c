@@ -8,20 +8,21 @@
 
 #include <kernel/config.h>
 #include <mm/kmalloc.h>
+#include <mm/slab.h>
 
 #include <assert.h>
 #include <errno.h>
+#include <math.h>
 
 #include <arch/vm.h>
 #include <arch/fork.h>
 
 struct vm_space kernel_space;       /* an address space with only the kernel mapped */
-struct page *   kdirect_pages;      /* all the physical pages in the kernel's address space */
 unsigned long   kdirect_num_pages;  /* the number of pages in the kdirect region */
 
 void vm_init(void)
 {
-	struct page *page;
+	int ret;
 
 	TRACE();
 
@@ -31,25 +32,29 @@ void vm_init(void)
 	 */
 	kernel_space.mmu = new_address_space();
 	ASSERT_NOT_NULL(kernel_space.mmu);
-	list_init(&kernel_space.mappings);
+	vm_space_init_mappings(&kernel_space);
+
+	/*
+	 * Take the kernel image, boot modules and early heap out of the page
+	 * allocator. The rest of kdirect stays free for the heap to grow into.
+	 * kmalloc_late_init() gives back the part of the early heap that was
+	 * never used, which returns most of the low 16MB to ZONE_DMA.
+	 */
+	ASSERT_NOT_NULL(alloc_pages_at(0x0,
+		PAGE_ALIGN_UP(umax(kheap_start, BOOT_PAGING_SIZE)) / PAGE_SIZE));
 
 	/*
-	 * Direct map the kdirect region of virtual memory.
+	 * Direct map the kdirect region of virtual memory. It's all aligned
+	 * the same virtually and physically, so this uses 4MB pages for all
+	 * but a partial 4MB at the end.
 	 */
 	kdirect_num_pages = ((size_t) kdirect_end - (size_t) kdirect_start) /
 			    PAGE_SIZE;
-	kdirect_pages = alloc_pages_at(0x0, kdirect_num_pages);
-	ASSERT_NOT_NULL(kdirect_pages);
 
-	for (page = kdirect_pages; page < kdirect_pages + kdirect_num_pages;
-	     page++) {
-		size_t virt = (size_t) kdirect_start + page_address(page);
-		int ret;
-
-		ret = mmu_map_page(kernel_space.mmu, virt, page,
-				   VM_P | VM_S | VM_G | VM_R | VM_W);
-		ASSERT_EQUALS(0, ret);
-	}
+	ret = mmu_map_range(kernel_space.mmu, (unsigned long) kdirect_start, 0,
+			    kdirect_num_pages * PAGE_SIZE,
+			    VM_P | VM_S | VM_G | VM_R | VM_W);
+	ASSERT_EQUALS(0, ret);
 
 	/*
 	 * Finally switch off the boot virtual address space and into our new,
@@ -61,6 +66,8 @@ void vm_init(void)
 	 * Resize the kernel heap to match to new kernel address space.
 	 */
 	kmalloc_late_init();
+
+	mmu_init();
 }
 
 int vm_space_init(struct vm_space *space)
@@ -72,13 +79,16 @@ int vm_space_init(struct vm_space *space)
 	return vm_space_fork(space, &kernel_space);
 }
 
+static struct kmem_cache vm_mapping_cache =
+	INITIALIZED_KMEM_CACHE("vm_mapping", sizeof(struct vm_mapping), 0, NULL);
+
 struct vm_mapping *new_vm_mapping(unsigned long addr, unsigned long length,
 				  int vmflags, struct vfs_file *file,
 				  unsigned long off)
 {
 	struct vm_mapping *m;
 
-	m = kmalloc(sizeof(*m));
+	m = kmem_cache_alloc(&vm_mapping_cache);
 	if (!m)
 		return NULL;
 
@@ -95,7 +105,7 @@ struct vm_mapping *new_vm_mapping(unsigned long addr, unsigned long length,
 void free_vm_mapping(struct vm_mapping *m)
 {
 	cond_vfs_file_put(m->file);
-	kfree(m, sizeof(*m));
+	kmem_cache_free(&vm_mapping_cache, m);
 }
 
 static struct vm_mapping *vm_mapping_fork(struct vm_mapping *from)
@@ -110,6 +120,8 @@ int vm_space_fork(struct vm_space *to, struct vm_space *from)
 	struct vm_mapping *m;
 	int error;
 
+	vm_space_init_mappings(to);
+
 	to->mmu = new_address_space();
 	if (!to->mmu) {
 		return ENOMEM;
@@ -125,11 +137,13 @@ int vm_space_fork(struct vm_space *to, struct vm_space *from)
 		goto vm_fork_fail;
 	}
 
+	to->rss = from->rss;
+	to->faults = 0;
+
 	/*
 	 * Copy the vm_mappings between each.
 	 */
 	error = ENOMEM;
-	list_init(&to->mappings);
 	list_foreach(m, &from->mappings, link) {
 		struct vm_mapping *copy = vm_mapping_fork(m);
 
@@ -137,7 +151,7 @@ int vm_space_fork(struct vm_space *to, struct vm_space *from)
 			goto vm_fork_fail;
 
 		copy->space = to;
-		list_insert_tail(&to->mappings, copy, link);
+		vm_insert_mapping(to, copy);
 	}
 
 	return 0;
@@ -155,8 +169,15 @@ void vm_space_destroy(struct vm_space *space)
 	 */
 	swap_address_space(kernel_space.mmu);
 
+	/*
+	 * Page tables still shared with another process (e.g. we're exiting
+	 * right after a fork) can just be handed over rather than copied and
+	 * emptied one page at a time.
+	 */
+	release_shared_page_tables(space->mmu);
+
 	while (!list_empty(&space->mappings)) {
-		struct vm_mapping *m = list_dequeue(&space->mappings, link);
+		struct vm_mapping *m = list_head(&space->mappings);
 
 		/* frees the mapping */
 		__vm_munmap(space, m->address, M_LENGTH(m));
@@ -182,6 +203,7 @@ int vm_map_page(struct vm_space *space, unsigned long virt, int flags)
 	}
 
 	tlb_invalidate(virt, PAGE_SIZE);
+	space->rss++;
 
 	return 0;
 }
@@ -192,11 +214,34 @@ void vm_unmap_page(struct vm_space *space, unsigned long virt)
 
 	page = mmu_unmap_page(space->mmu, virt);
 	if (page) {
+		if (page != zero_page)
+			space->rss--;
 		free_page(page);
 		tlb_invalidate(virt, PAGE_SIZE);
 	}
 }
 
+static void unmap_range_put(struct page *page, unsigned long virt,
+			    void *arg)
+{
+	struct vm_space *space = arg;
+
+	(void) virt;
+
+	if (page != zero_page)
+		space->rss--;
+	free_page(page);
+}
+
+/**
+ * @brief Unmap and drop the pages in [start, end).
+ */
+void vm_unmap_range(struct vm_space *space, unsigned long start,
+		    unsigned long end)
+{
+	mmu_unmap_range(space->mmu, start, end, unmap_range_put, space);
+}
+
 void vm_dump_maps(printf_f p, struct vm_space *space)
 {
 	struct vm_mapping *m;
@@ -204,7 +249,7 @@ void vm_dump_maps(printf_f p, struct vm_space *space)
 	TRACE("space=%p", space);
 
 	list_foreach(m, &space->mappings, link) {
-		p("0x%08x - 0x%08x %c%c%c%c%c%c%c",
+		p("0x%08x - 0x%08x %c%c%c%c%c%c%c%c%c",
 				m->address, M_END(m),
 				m->flags & VM_R ? 'r' : '-',
 				m->flags & VM_W ? 'w' : '-',
@@ -212,10 +257,144 @@ void vm_dump_maps(printf_f p, struct vm_space *space)
 				m->flags & VM_U ? 'u' : '-',
 				m->flags & VM_S ? 's' : '-',
 				m->flags & VM_G ? 'g' : '-',
-				m->flags & VM_P ? 'p' : '-');
+				m->flags & VM_P ? 'p' : '-',
+				m->flags & VM_L ? 'l' : '-',
+				m->flags & VM_SHARED ? 'S' : '-');
 		if (m->file) {
 			p(" %s 0x%x", m->file->dirent->name, m->foff);
 		}
 		p("\n");
 	}
+	p("rss: %d pages\n", space->rss);
+}
+
+#include <kernel/test.h>
+#include <kernel/proc.h>
+#include <arch/cpu.h>
+#include <stdlib.h>
+
+/*
+ * Fork a parent with 1MB to 256MB resident, copying the page tables (as
+ * fork used to) and sharing them. 256MB fits in the default 1GB qemu.sh
+ * machine. Large pages are turned off so the memory is mapped by page
+ * tables at all.
+ */
+BEGIN_TEST(fork_bench)
+{
+	static const unsigned long sizes[] = { MB(1), MB(64), MB(256) };
+	int prot = PROT_READ | PROT_WRITE;
+	int flags = MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS;
+	unsigned long addr = 0x80000000;
+	bool share = vm_share_page_tables;
+	bool large_pages = vm_large_pages;
+	unsigned i;
+
+	vm_large_pages = false;
+
+	for (i = 0; i < 2 * sizeof(sizes) / sizeof(sizes[0]); i++) {
+		unsigned long size = sizes[i / 2];
+		unsigned long rss = CURRENT_PROCESS->space.rss;
+		struct vm_space child;
+		unsigned long off;
+		u64 start, end;
+		int error;
+
+		vm_share_page_tables = i % 2;
+
+		if (size / PAGE_SIZE > (zones[ZONE_HIGH].num_free +
+					    zones[ZONE_NORMAL].num_free) / 2) {
+			INFO("fork %d MB: skipped, not enough memory",
+			     size / MB(1));
+			continue;
+		}
+
+		error = vm_mmap(addr, size, prot, flags, NULL, 0);
+		ASSERT(!(error % PAGE_SIZE));
+
+		for (off = 0; off < size; off += PAGE_SIZE)
+			*((int *) (addr + off)) = 42;
+
+		start = rdtsc();
+		error = vm_space_fork(&child, &CURRENT_PROCESS->space);
+		end = rdtsc();
+		ASSERT(!error);
+
+		INFO("fork %d MB, %s page tables: %d cycles", size / MB(1),
+		     vm_share_page_tables ? "shared" : "copied",
+		     (unsigned long) (end - start));
+
+		/* destroying an address space switches to the kernel's */
+		vm_space_destroy(&child);
+		swap_address_space(CURRENT_PROCESS->space.mmu);
+
+		start = rdtsc();
+		error = vm_munmap(addr, size);
+		end = rdtsc();
+		ASSERT(!error);
+		ASSERT_EQUALS(CURRENT_PROCESS->space.rss, rss);
+
+		INFO("munmap %d MB: %d cycles", size / MB(1),
+		     (unsigned long) (end - start));
+	}
+
+	vm_share_page_tables = share;
+	vm_large_pages = large_pages;
+}
+END_TEST
+
+/*
+ * Random reads over a buffer much larger than the TLB covers with 4KB
+ * pages, with and without large pages.
+ */
+BEGIN_TEST(large_page_bench)
+{
+	const unsigned long size = MB(256);
+	const unsigned long reads = 1 << 20;
+	int prot = PROT_READ | PROT_WRITE;
+	int flags = MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS;
+	unsigned long addr = 0x80000000;
+	bool large_pages = vm_large_pages;
+	int pass, passes = 2;
+
+	if (size / PAGE_SIZE > (zones[ZONE_HIGH].num_free +
+				zones[ZONE_NORMAL].num_free) / 2) {
+		INFO("large pages: skipped, not enough memory");
+		passes = 0;
+	}
+
+	for (pass = 0; pass < passes; pass++) {
+		unsigned long large_maps = vm_stats.large_page_maps;
+		unsigned long off, i, sum = 0;
+		u64 start, end;
+		int error;
+
+		vm_large_pages = pass;
+
+		error = vm_mmap(addr, size, prot, flags, NULL, 0);
+		ASSERT(!(error % PAGE_SIZE));
+
+		for (off = 0; off < size; off += PAGE_SIZE)
+			*((int *) (addr + off)) = 1;
+
+		if (pass)
+			ASSERT_EQUALS(vm_stats.large_page_maps - large_maps,
+				      size / MMU_LARGE_PAGE_SIZE);
+
+		start = rdtsc();
+		for (i = 0; i < reads; i++) {
+			off = ((unsigned long) rand() * PAGE_SIZE) % size;
+			sum += *((int *) (addr + off));
+		}
+		end = rdtsc();
+		ASSERT_EQUALS(sum, reads);
+
+		INFO("%s pages: %d cycles per random read", pass ? "4MB" : "4KB",
+		     (unsigned long) (end - start) / reads);
+
+		error = vm_munmap(addr, size);
+		ASSERT(!error);
+	}
+
+	vm_large_pages = large_pages;
 }
+END_TEST
@@ -0,0 +1,347 @@
+/**
+ * @file mm/vmalloc.c
+ *
+ * @brief Virtually contiguous kernel allocations (see mm/vmalloc.h).
+ *
+ * Every allocation gets an area of the vmalloc region, followed by an
+ * unmapped guard page so overruns fault instead of corrupting the next
+ * area. The areas are kept in a red-black tree ordered by address.
+ *
+ * The pages are mapped without the global bit, so a single tlb_flush()
+ * invalidates all of them. vfree() unmaps and frees the pages right away.
+ * mmu_unmap_range() invalidates the entries eagerly only when kernel_space
+ * is the live address space; other address spaces may still hold stale TLB
+ * entries for the area. To cover those, the area stays in the tree, marked
+ * lazy, so its addresses aren't handed out again. Once enough lazy areas
+ * have built up, or the region is full, they are all purged with one
+ * flush.
+ */
+#include <mm/vmalloc.h>
+#include <mm/memory.h>
+#include <mm/pages.h>
+#include <mm/slab.h>
+#include <mm/vm.h>
+
+#include <kernel/spinlock.h>
+#include <arch/vm.h>
+
+#include <rbtree.h>
+#include <list.h>
+#include <stddef.h>
+#include <assert.h>
+
+char *vmalloc_start;
+char *vmalloc_end;
+
+extern struct vm_space kernel_space;
+
+#define VMALLOC_VM_FLAGS (VM_S | VM_P | VM_R | VM_W)
+
+/*
+ * Purge the lazy areas once they cover this many pages.
+ */
+#define VMALLOC_LAZY_MAX 2048
+
+struct vmalloc_area {
+	unsigned long addr;
+	unsigned long num_pages;   /* mapped pages, not counting the guard */
+	bool lazy;                 /* freed, waiting for a TLB flush */
+	struct rb_node rb_node;
+	list_link(struct vmalloc_area) lazy_link;
+};
+
+list_typedef(struct vmalloc_area) vmalloc_area_list_t;
+
+static struct kmem_cache vmalloc_area_cache =
+	INITIALIZED_KMEM_CACHE("vmalloc_area", sizeof(struct vmalloc_area), 0,
+			       NULL);
+
+static struct rb_root areas = INITIALIZED_RB_ROOT;
+static vmalloc_area_list_t lazy_areas = INITIALIZED_EMPTY_LIST;
+static unsigned long lazy_pages;
+static struct spinlock vmalloc_lock = INITIALIZED_SPINLOCK;
+
+static unsigned long vmalloc_purges;
+
+#define area_entry(_rb) rb_entry(_rb, struct vmalloc_area, rb_node)
+
+/* The end of an area, including its guard page. */
+#define area_end(_a) ((_a)->addr + ((_a)->num_pages + 1) * PAGE_SIZE)
+
+void vmalloc_init(void)
+{
+	int error;
+
+	TRACE();
+
+	error = mmu_alloc_page_tables(kernel_space.mmu,
+				      (unsigned long) vmalloc_start,
+				      (unsigned long) vmalloc_end);
+	if (error)
+		panic("Failed to allocate the vmalloc page tables.");
+}
+
+/**
+ * @brief Find the lowest free range of num_pages pages plus a guard page,
+ * and reserve it for area.
+ *
+ * Assumes vmalloc_lock is held.
+ *
+ * @return false if the vmalloc region has no room.
+ */
+static bool area_insert(struct vmalloc_area *area)
+{
+	unsigned long size = (area->num_pages + 1) * PAGE_SIZE;
+	unsigned long addr = (unsigned long) vmalloc_start;
+	struct rb_node *rb, **link, *parent = NULL;
+
+	for (rb = rb_first(&areas); rb; rb = rb_next(rb)) {
+		struct vmalloc_area *a = area_entry(rb);
+
+		if (a->addr - addr >= size)
+			break;
+
+		addr = area_end(a);
+	}
+
+	if ((unsigned long) vmalloc_end - addr < size)
+		return false;
+
+	area->addr = addr;
+
+	link = &areas.node;
+	while (*link) {
+		parent = *link;
+		if (addr < area_entry(parent)->addr)
+			link = &parent->left;
+		else
+			link = &parent->right;
+	}
+
+	rb_link_node(&area->rb_node, parent, link);
+	rb_insert_color(&area->rb_node, &areas);
+
+	return true;
+}
+
+/**
+ * @brief Find the area starting at addr.
+ *
+ * Assumes vmalloc_lock is held.
+ */
+static struct vmalloc_area *area_find(unsigned long addr)
+{
+	struct rb_node *rb = areas.node;
+
+	while (rb) {
+		struct vmalloc_area *a = area_entry(rb);
+
+		if (addr < a->addr)
+			rb = rb->left;
+		else if (addr > a->addr)
+			rb = rb->right;
+		else
+			return a;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Invalidate the TLB entries of every lazy area at once, and give
+ * their addresses back.
+ *
+ * Assumes vmalloc_lock is held.
+ */
+static void purge_lazy_areas(void)
+{
+	struct vmalloc_area *area;
+
+	tlb_flush();
+
+	while (!list_empty(&lazy_areas)) {
+		area = list_head(&lazy_areas);
+		list_remove(&lazy_areas, area, lazy_link);
+		rb_erase(&area->rb_node, &areas);
+		kmem_cache_free(&vmalloc_area_cache, area);
+	}
+
+	lazy_pages = 0;
+	vmalloc_purges++;
+}
+
+static void area_put_page(struct page *page, unsigned long virt, void *arg)
+{
+	(void) virt;
+	(void) arg;
+	free_page(page);
+}
+
+/**
+ * @brief Unmap and free the first num_pages pages of an area, and put the
+ * area on the lazy list.
+ */
+static void area_release(struct vmalloc_area *area, unsigned long num_pages)
+{
+	unsigned long flags;
+
+	mmu_unmap_range(kernel_space.mmu, area->addr,
+			area->addr + num_pages * PAGE_SIZE, area_put_page, NULL);
+
+	spin_lock_irq(&vmalloc_lock, &flags);
+
+	area->lazy = true;
+	list_insert_tail(&lazy_areas, area, lazy_link);
+	lazy_pages += area->num_pages + 1;
+
+	if (lazy_pages >= VMALLOC_LAZY_MAX)
+		purge_lazy_areas();
+
+	spin_unlock_irq(&vmalloc_lock, flags);
+}
+
+/**
+ * @brief Allocate size bytes of virtually contiguous kernel memory.
+ *
+ * @return NULL if out of memory or out of vmalloc address space.
+ */
+void *vmalloc(size_t size)
+{
+	struct vmalloc_area *area;
+	unsigned long flags;
+	unsigned long i;
+	bool ok;
+
+	TRACE("size=0x%x", size);
+
+	if (!size)
+		return NULL;
+
+	area = kmem_cache_alloc(&vmalloc_area_cache);
+	if (!area)
+		return NULL;
+
+	area->num_pages = PAGE_ALIGN_UP(size) / PAGE_SIZE;
+	area->lazy = false;
+
+	spin_lock_irq(&vmalloc_lock, &flags);
+
+	ok = area_insert(area);
+	if (!ok && lazy_pages) {
+		purge_lazy_areas();
+		ok = area_insert(area);
+	}
+
+	spin_unlock_irq(&vmalloc_lock, flags);
+
+	if (!ok) {
+		kmem_cache_free(&vmalloc_area_cache, area);
+		return NULL;
+	}
+
+	/*
+	 * The addresses were either never mapped or purged since, so they
+	 * can't be in the TLB and nothing needs invalidating.
+	 */
+	for (i = 0; i < area->num_pages; i++) {
+		struct page *page = alloc_page();
+
+		if (!page)
+			goto fail;
+
+		if (mmu_map_page(kernel_space.mmu, area->addr + i * PAGE_SIZE,
+				 page, VMALLOC_VM_FLAGS)) {
+			free_page(page);
+			goto fail;
+		}
+	}
+
+	return (void *) area->addr;
+
+fail:
+	area_release(area, i);
+	return NULL;
+}
+
+/**
+ * @brief Free memory allocated with vmalloc().
+ */
+void vfree(void *addr)
+{
+	struct vmalloc_area *area;
+	unsigned long flags;
+
+	TRACE("addr=%p", addr);
+
+	if (!addr)
+		return;
+
+	spin_lock_irq(&vmalloc_lock, &flags);
+	area = area_find((unsigned long) addr);
+	spin_unlock_irq(&vmalloc_lock, flags);
+
+	if (!area || area->lazy)
+		panic("vfree: %p wasn't allocated by vmalloc", addr);
+
+	area_release(area, area->num_pages);
+}
+
+void vmalloc_dump(printf_f p)
+{
+	struct rb_node *rb;
+	unsigned long flags;
+
+	spin_lock_irq(&vmalloc_lock, &flags);
+
+	for (rb = rb_first(&areas); rb; rb = rb_next(rb)) {
+		struct vmalloc_area *a = area_entry(rb);
+
+		p("0x%08x - 0x%08x %d pages%s\n", a->addr, area_end(a),
+		  a->num_pages, a->lazy ? " (lazy)" : "");
+	}
+
+	p("%d lazy pages, %d purges\n", lazy_pages, vmalloc_purges);
+
+	spin_unlock_irq(&vmalloc_lock, flags);
+}
+
+#include <kernel/test.h>
+BEGIN_TEST(vmalloc_test)
+{
+	unsigned long purges = vmalloc_purges;
+	unsigned long i;
+	size_t size = MB(1) + 3;
+	char *buf, *again;
+
+	buf = vmalloc(size);
+	ASSERT_NOT_NULL(buf);
+	ASSERT(buf >= vmalloc_start && buf + size <= vmalloc_end);
+
+	for (i = 0; i < size; i++)
+		buf[i] = (char) i;
+	for (i = 0; i < size; i++)
+		ASSERT_EQUALS(buf[i], (char) i);
+
+	vfree(buf);
+
+	/*
+	 * The freed addresses aren't reused until the lazy areas are purged.
+	 */
+	again = vmalloc(PAGE_SIZE);
+	ASSERT_NOT_NULL(again);
+	if (vmalloc_purges == purges)
+		ASSERT(again < buf || again >= buf + size);
+	vfree(again);
+
+	/*
+	 * Free enough to force a purge.
+	 */
+	for (i = 0; i < 2 * VMALLOC_LAZY_MAX / 256; i++) {
+		buf = vmalloc(MB(1));
+		ASSERT_NOT_NULL(buf);
+		vfree(buf);
+	}
+
+	ASSERT_GREATER(vmalloc_purges, purges);
+}
+END_TEST
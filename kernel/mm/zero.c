@@ -0,0 +1,149 @@
+/**
+ * @file mm/zero.c
+ *
+ * @brief A pool of pages that have already been filled with zeros.
+ *
+ * Demand-zero faults (anonymous memory, bss) need a page full of zeros.
+ * Zeroing the page inside the fault puts the cost of writing 4KB right on
+ * the fault's latency, so instead we keep a small pool of pages that were
+ * zeroed ahead of time.
+ *
+ * The kernel has no idle thread to do this work in. The nearest thing to
+ * idle time it has is a thread calling yield() because it has nothing to
+ * do, so the pool is topped up a few pages at a time from sys_yield(), in
+ * process context, rather than from the timer interrupt.
+ */
+#include <mm/pages.h>
+#include <mm/kmap.h>
+
+#include <kernel/spinlock.h>
+
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+/*
+ * The pool is refilled up to ZERO_POOL_HIGH pages, at most ZERO_POOL_BATCH
+ * pages per yield. Refilling stops while free memory is low so the pool
+ * doesn't compete with real allocations.
+ */
+#define ZERO_POOL_HIGH     64
+#define ZERO_POOL_BATCH    4
+#define ZERO_POOL_MIN_FREE (4 * ZERO_POOL_HIGH)
+
+static page_list_t zero_pool = INITIALIZED_EMPTY_LIST;
+static struct spinlock zero_pool_lock = INITIALIZED_SPINLOCK;
+
+static unsigned long zero_pool_hits;    /* served from the pool */
+static unsigned long zero_pool_misses;  /* pool was empty, zeroed in place */
+static unsigned long zero_pool_filled;  /* pages zeroed by the refill */
+
+/**
+ * @brief Fill a page with zeros.
+ *
+ * @return 0 on success.
+ */
+static int zero_page(struct page *page)
+{
+	void *virt;
+
+	virt = kmap_atomic(page);
+	bzero(virt, PAGE_SIZE);
+	kunmap_atomic(virt);
+
+	return 0;
+}
+
+/**
+ * @brief Allocate a page that is filled with zeros.
+ *
+ * @return NULL if out of memory.
+ */
+struct page *alloc_zeroed_page(void)
+{
+	struct page *page = NULL;
+	unsigned long flags;
+
+	spin_lock_irq(&zero_pool_lock, &flags);
+
+	if (!list_empty(&zero_pool)) {
+		page = list_head(&zero_pool);
+		list_remove(&zero_pool, page, free_link);
+		zero_pool_hits++;
+	}
+	else {
+		zero_pool_misses++;
+	}
+
+	spin_unlock_irq(&zero_pool_lock, flags);
+
+	if (page)
+		return page;
+
+	page = alloc_page();
+	if (!page)
+		return NULL;
+
+	if (zero_page(page)) {
+		free_page(page);
+		return NULL;
+	}
+
+	return page;
+}
+
+/**
+ * @brief Return the number of free pages alloc_page() can draw on, which
+ * is every zone, since it falls back from ZONE_HIGH to the ones below.
+ */
+static unsigned long zero_pool_free_pages(void)
+{
+	unsigned long free = 0;
+	int i;
+
+	for (i = 0; i <= ZONE_HIGH; i++)
+		free += zones[i].num_free;
+
+	return free;
+}
+
+/**
+ * @brief Zero up to ZERO_POOL_BATCH more pages into the pool. Called from
+ * sys_yield(), never from interrupt context.
+ */
+void zero_pool_refill(void)
+{
+	unsigned long flags;
+	int i;
+
+	for (i = 0; i < ZERO_POOL_BATCH; i++) {
+		struct page *page;
+
+		if (list_size(&zero_pool) >= ZERO_POOL_HIGH)
+			break;
+
+		if (zero_pool_free_pages() < ZERO_POOL_MIN_FREE)
+			break;
+
+		page = alloc_page();
+		if (!page)
+			break;
+
+		if (zero_page(page)) {
+			free_page(page);
+			break;
+		}
+
+		spin_lock_irq(&zero_pool_lock, &flags);
+		list_insert_head(&zero_pool, page, free_link);
+		zero_pool_filled++;
+		spin_unlock_irq(&zero_pool_lock, flags);
+	}
+}
+
+void zero_pool_dump(printf_f p)
+{
+	p("zero pool: %d pages, %d hits, %d misses, %d filled\n",
+	  list_size(&zero_pool), zero_pool_hits, zero_pool_misses,
+	  zero_pool_filled);
+}
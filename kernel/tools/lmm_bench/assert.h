@@ -0,0 +1,15 @@
+/*
+ * Host stand-in for the kernel's assert.h, just enough for the LMM sources.
+ */
+#ifndef __LMM_BENCH_ASSERT_H__
+#define __LMM_BENCH_ASSERT_H__
+
+#include_next <assert.h>
+#include <stdio.h>
+
+#define ASSERT(expression) assert(expression)
+
+#define INFO(_fmt, ...)	 printf("I "_fmt"\n", ##__VA_ARGS__)
+#define TRACE(_fmt, ...) do { } while (0)
+
+#endif /* !__LMM_BENCH_ASSERT_H__ */
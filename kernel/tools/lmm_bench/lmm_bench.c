@@ -0,0 +1,277 @@
+/*
+ * Stress test and benchmark for the LMM allocator, built for the host.
+ *
+ * Runs the kernel's mm/lmm sources unchanged against a large malloc()ed
+ * arena. The stress phase does random (aligned) allocations and frees,
+ * checking every block against a shadow map of the arena and the free
+ * memory count against lmm_avail(). The benchmark phase fragments the
+ * arena the way many small, long lived kmallocs do, then times page
+ * aligned allocations on top of it.
+ *
+ *	make ARCH=x86 lmm_bench
+ *	tools/lmm_bench/lmm_bench [iterations [seed]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mm/lmm.h>
+#include <mm/lmm_types.h>
+
+#define ARENA_SIZE	(64UL << 20)
+#define MAX_BLOCKS	16384
+#define PAGE		4096
+
+struct block {
+	void *addr;
+	vm_size_t size;
+};
+
+static lmm_t lmm = LMM_INITIALIZER;
+static struct lmm_region region;
+
+static char *arena;
+static unsigned char *shadow;	/* one byte per ALIGN_SIZE granule */
+
+static struct block blocks[MAX_BLOCKS];
+static unsigned long nr_blocks;
+
+static unsigned long failures;
+
+#define fail(_fmt, ...) do {						\
+		fprintf(stderr, "FAIL: "_fmt"\n", ##__VA_ARGS__);	\
+		failures++;						\
+	} while (0)
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The granules of the arena covered by [addr, addr + size).  */
+static void granules(void *addr, vm_size_t size,
+		     unsigned long *first, unsigned long *last)
+{
+	vm_offset_t ofs = (char *)addr - arena;
+
+	*first = ofs / ALIGN_SIZE;
+	*last = (ofs + size - 1) / ALIGN_SIZE;
+}
+
+static void mark(void *addr, vm_size_t size)
+{
+	unsigned long g, first, last;
+
+	granules(addr, size, &first, &last);
+	for (g = first; g <= last; g++) {
+		if (shadow[g])
+			fail("block %p+%lu overlaps a live block",
+			     addr, (unsigned long)size);
+		shadow[g] = 1;
+	}
+}
+
+static void unmark(void *addr, vm_size_t size)
+{
+	unsigned long g, first, last;
+
+	granules(addr, size, &first, &last);
+	for (g = first; g <= last; g++)
+		shadow[g] = 0;
+}
+
+/* Free memory the allocator should have, given the live blocks.  */
+static vm_size_t expected_avail(void)
+{
+	unsigned long g;
+	vm_size_t used = 0;
+
+	for (g = 0; g < ARENA_SIZE / ALIGN_SIZE; g++)
+		used += shadow[g];
+
+	return ARENA_SIZE - used * ALIGN_SIZE;
+}
+
+static vm_size_t random_size(void)
+{
+	switch (rand() % 4) {
+	case 0:
+		return 1 + rand() % 64;
+	case 1:
+		return 1 + rand() % 1024;
+	case 2:
+		return PAGE;
+	default:
+		return 1 + rand() % (4 * PAGE);
+	}
+}
+
+static int alloc_one(void)
+{
+	vm_size_t size = random_size();
+	int align_bits = 0;
+	vm_offset_t align_ofs = 0;
+	void *addr;
+
+	if (rand() % 2) {
+		align_bits = rand() % 17;
+		if (rand() % 8 == 0)
+			align_ofs = rand() & (((vm_offset_t)1 << align_bits) - 1);
+	}
+
+	addr = lmm_alloc_aligned(&lmm, size, 0, align_bits, align_ofs);
+	if (!addr)
+		return 0;
+
+	if ((char *)addr < arena || (char *)addr + size > arena + ARENA_SIZE)
+		fail("block %p+%lu is outside the arena",
+		     addr, (unsigned long)size);
+	if ((((vm_offset_t)addr - align_ofs) &
+	     (((vm_offset_t)1 << align_bits) - 1)) != 0)
+		fail("block %p is not aligned to %d bits + 0x%lx",
+		     addr, align_bits, (unsigned long)align_ofs);
+
+	mark(addr, size);
+	memset(addr, 0xa5, size);
+
+	blocks[nr_blocks].addr = addr;
+	blocks[nr_blocks].size = size;
+	nr_blocks++;
+
+	return 1;
+}
+
+static void free_one(unsigned long i)
+{
+	unmark(blocks[i].addr, blocks[i].size);
+	lmm_free(&lmm, blocks[i].addr, blocks[i].size);
+
+	blocks[i] = blocks[--nr_blocks];
+}
+
+static void free_all(void)
+{
+	while (nr_blocks)
+		free_one(nr_blocks - 1);
+}
+
+static void stress(unsigned long iterations)
+{
+	unsigned long i, allocs = 0, frees = 0, misses = 0;
+	double start = now();
+
+	for (i = 0; i < iterations; i++) {
+		if (nr_blocks < MAX_BLOCKS && (unsigned long)rand() % MAX_BLOCKS >= nr_blocks) {
+			if (alloc_one())
+				allocs++;
+			else
+				misses++;
+		}
+		else {
+			free_one(rand() % nr_blocks);
+			frees++;
+		}
+
+		if (i % 50000 == 0 && lmm_avail(&lmm, 0) != expected_avail())
+			fail("lmm_avail() is 0x%lx, expected 0x%lx",
+			     (unsigned long)lmm_avail(&lmm, 0),
+			     (unsigned long)expected_avail());
+	}
+
+	printf("stress: %lu allocs, %lu frees, %lu failed allocs, %lu live, "
+	       "%.0f ns/op\n", allocs, frees, misses, nr_blocks,
+	       (now() - start) * 1e9 / iterations);
+
+	free_all();
+	if (lmm_avail(&lmm, 0) != ARENA_SIZE)
+		fail("0x%lx bytes free after freeing everything",
+		     (unsigned long)lmm_avail(&lmm, 0));
+}
+
+/*
+ * Leave the arena full of small holes between small live blocks, then
+ * time page aligned page allocations, which the holes can't satisfy.
+ */
+static void bench_fragmented(unsigned long pages)
+{
+	unsigned long i, holes = 0;
+	void **page_blocks;
+	double start, elapsed;
+
+	while (nr_blocks < MAX_BLOCKS) {
+		void *addr = lmm_alloc(&lmm, 200, 0);
+
+		if (!addr)
+			break;
+		blocks[nr_blocks].addr = addr;
+		blocks[nr_blocks].size = 200;
+		nr_blocks++;
+	}
+
+	/* Free every other block, from the end so indexes stay put.  */
+	for (i = nr_blocks & ~1UL; i > 0; i -= 2) {
+		lmm_free(&lmm, blocks[i - 2].addr, blocks[i - 2].size);
+		blocks[i - 2] = blocks[--nr_blocks];
+		holes++;
+	}
+
+	page_blocks = calloc(pages, sizeof(*page_blocks));
+
+	start = now();
+	for (i = 0; i < pages; i++) {
+		page_blocks[i] = lmm_alloc_aligned(&lmm, PAGE, 0, 12, 0);
+		if (!page_blocks[i])
+			break;
+	}
+	elapsed = now() - start;
+	pages = i;
+
+	printf("fragmented: %lu holes, %lu page allocs, %.0f ns/alloc\n",
+	       holes, pages, elapsed * 1e9 / (pages ? pages : 1));
+
+	for (i = 0; i < pages; i++)
+		lmm_free(&lmm, page_blocks[i], PAGE);
+	free(page_blocks);
+
+	for (i = 0; i < nr_blocks; i++)
+		lmm_free(&lmm, blocks[i].addr, blocks[i].size);
+	nr_blocks = 0;
+
+	if (lmm_avail(&lmm, 0) != ARENA_SIZE)
+		fail("0x%lx bytes free after freeing everything",
+		     (unsigned long)lmm_avail(&lmm, 0));
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+	unsigned seed = argc > 2 ? strtoul(argv[2], NULL, 0) : (unsigned)time(NULL);
+
+	printf("seed %u, ALIGN_SIZE %lu\n", seed, (unsigned long)ALIGN_SIZE);
+	srand(seed);
+
+	arena = aligned_alloc(1 << 20, ARENA_SIZE);
+	shadow = calloc(ARENA_SIZE / ALIGN_SIZE, 1);
+	if (!arena || !shadow) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	lmm_add_region(&lmm, &region, arena, ARENA_SIZE, 0, 0);
+	lmm_add_free(&lmm, arena, ARENA_SIZE);
+
+	stress(iterations);
+	bench_fragmented(8192);
+
+	if (failures) {
+		printf("%lu failures\n", failures);
+		return 1;
+	}
+
+	printf("ok\n");
+	return 0;
+}
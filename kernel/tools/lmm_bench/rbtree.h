@@ -0,0 +1,5 @@
+/*
+ * The kernel's rbtree.h, without putting the rest of inc/lib on the
+ * include path.
+ */
+#include "../../inc/lib/rbtree.h"
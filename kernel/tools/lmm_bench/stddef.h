@@ -0,0 +1,12 @@
+/*
+ * Host stand-in for the kernel's stddef.h, just enough for the LMM sources.
+ * The system headers include stddef.h for bits of it at a time, so pass
+ * every include through.
+ */
+#include_next <stddef.h>
+
+#ifndef container_of
+#define container_of(ptr, struct_type, struct_member)                     \
+	((struct_type *)((char *)(ptr) -                                  \
+			 __builtin_offsetof(struct_type, struct_member)))
+#endif
@@ -0,0 +1,13 @@
+/*
+ * Host stand-in for the kernel's types.h, just enough for the LMM sources.
+ */
+#ifndef __LMM_BENCH_TYPES_H__
+#define __LMM_BENCH_TYPES_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uintptr_t vm_offset_t;
+typedef uintptr_t vm_size_t;
+
+#endif /* !__LMM_BENCH_TYPES_H__ */
@@ -1,3 +1,3 @@
 #!/bin/bash
 
-qemu-system-i386 -m 1024 -serial stdio -display none -cdrom OS.iso -enable-kvm
+qemu-system-i386 -m ${MEM:-1024} -serial stdio -display none -cdrom OS.iso -enable-kvm
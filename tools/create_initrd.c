@@ -39,6 +39,31 @@ do { \
 	} \
 } while (0)
 
+/*
+ * Round up to the next multiple of INITRD_DATA_ALIGN.
+ */
+#define DATA_ALIGN(_off) \
+	(((_off) + INITRD_DATA_ALIGN - 1) & ~(INITRD_DATA_ALIGN - 1))
+
+/*
+ * Write zeros up to offset <to> in the ramdisk.
+ */
+void pad_to(FILE *stream, unsigned to)
+{
+	static const char zeros[BUFSIZ];
+	long pos = ftell(stream);
+
+	while (pos < (long) to) {
+		unsigned n = to - pos;
+
+		if (n > sizeof(zeros))
+			n = sizeof(zeros);
+
+		WRITE(zeros, n, stream);
+		pos += n;
+	}
+}
+
 void copy_file(FILE *to, FILE *from)
 {
 #define BUFSIZE 128
@@ -96,8 +121,12 @@ int main(int argc, char **argv)
 	hdr.nfiles = nfiles;
 	WRITE(&hdr, sizeof(struct initrd_hdr), rdisk);
 
+	/*
+	 * Every file's data starts on a page boundary, so the kernel can map
+	 * it straight from the ramdisk.
+	 */
 	data_start = sizeof(struct initrd_hdr) + nfiles * sizeof(struct initrd_file);
-	data_offset = data_start;
+	data_offset = DATA_ALIGN(data_start);
 
 	/*
 	 * First write out all the files headers to the ramdisk
@@ -128,12 +157,13 @@ int main(int argc, char **argv)
 				rfile.name, rfile.length, rfile.data);
 		WRITE(&rfile, sizeof(struct initrd_file), rdisk);
 
-		data_offset += rfile.length;
+		data_offset = DATA_ALIGN(data_offset + rfile.length);
 	}
 
 	/*
 	 * Then write the actual file data to the ramdisk
 	 */
+	data_offset = DATA_ALIGN(data_start);
 	for (i = 0; i < nfiles; i++) {
 		char *fname = fnames[i];
 		FILE *f = fopen(fname, "r");
@@ -141,7 +171,10 @@ int main(int argc, char **argv)
 			fail("Couldn't open file %s to write data.", fname);
 		}
 
+		pad_to(rdisk, data_offset);
 		copy_file(rdisk, f);
+
+		data_offset = DATA_ALIGN(ftell(rdisk));
 	}
 
 	return 0;
@@ -1,6 +1,8 @@
 #ifndef __MORIDIN_SYSCALL_H__
 #define __MORIDIN_SYSCALL_H__
 
+#include <stddef.h>
+
 /*
  * Syscalls provided by the moridin kernel that aren't part of the
  * standard C library.
@@ -8,4 +10,26 @@
 
 int yield(void);
 
+#define PROT_EXEC   (1 << 0)
+#define PROT_READ   (1 << 1)
+#define PROT_WRITE  (1 << 2)
+#define PROT_NONE   (1 << 3)
+
+#define MAP_SHARED    (1 << 0)
+#define MAP_PRIVATE   (1 << 1)
+#define MAP_ANONYMOUS (1 << 2)
+#define MAP_LOCKED    (1 << 3)
+#define MAP_FIXED     (1 << 4)
+#define MAP_POPULATE  (1 << 5)
+
+#define MAP_FAILED ((void *) -1)
+
+/*
+ * Map anonymous memory at addr. There are no file descriptors yet, so
+ * unlike POSIX mmap() this takes no file: flags must include
+ * MAP_ANONYMOUS.
+ */
+void *mmap(void *addr, size_t length, int prot, int flags);
+int munmap(void *addr, size_t length);
+
 #endif /* !__MORIDIN_SYSCALL_H__ */
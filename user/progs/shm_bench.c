@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <moridin/syscall.h>
+
+#define CHECK(_condition) do {						\
+	int __condition = (_condition);					\
+									\
+	if (__condition)						\
+		break;							\
+									\
+	printf("FAILED: %s [%d]\n", #_condition, __condition);		\
+	exit(42);							\
+} while (0)
+
+#define SHM_ADDR   ((void *) 0x80000000)
+#define RING_SIZE  (64 * 1024)
+#define CHUNK_SIZE 4096
+#define TOTAL_SIZE (16 * 1024 * 1024)
+
+/*
+ * A ring buffer in shared memory. There is a single producer and a single
+ * consumer, and only one CPU, so plain volatile counters are enough.
+ */
+struct ring {
+	volatile uint32_t head; /* bytes written by the producer */
+	volatile uint32_t tail; /* bytes read by the consumer */
+	char data[RING_SIZE];
+};
+
+static inline uint64_t rdtsc(void)
+{
+	uint32_t lo, hi;
+
+	__asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t) hi << 32) | lo;
+}
+
+static void produce(struct ring *ring)
+{
+	uint32_t written = 0;
+	int i;
+
+	while (written < TOTAL_SIZE) {
+		if (ring->head - ring->tail > RING_SIZE - CHUNK_SIZE) {
+			yield();
+			continue;
+		}
+
+		for (i = 0; i < CHUNK_SIZE; i++)
+			ring->data[(written + i) % RING_SIZE] =
+				(char) (written + i);
+
+		written += CHUNK_SIZE;
+		ring->head = written;
+	}
+}
+
+static uint32_t consume(struct ring *ring)
+{
+	uint32_t read = 0, errors = 0;
+	int i;
+
+	while (read < TOTAL_SIZE) {
+		if (ring->head == read) {
+			yield();
+			continue;
+		}
+
+		for (i = 0; i < CHUNK_SIZE; i++)
+			if (ring->data[(read + i) % RING_SIZE] !=
+			    (char) (read + i))
+				errors++;
+
+		read += CHUNK_SIZE;
+		ring->tail = read;
+	}
+
+	return errors;
+}
+
+/* stream data from a child to its parent through shared memory */
+int main(int argc, char **argv)
+{
+	(void) argc; (void) argv;
+	struct ring *ring;
+	uint64_t start, end;
+	uint32_t errors, kcycles;
+	int status, ret;
+
+	ring = mmap(SHM_ADDR, sizeof(struct ring), PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_ANONYMOUS | MAP_FIXED);
+	CHECK(ring != MAP_FAILED);
+
+	start = rdtsc();
+
+	ret = fork();
+	CHECK(ret >= 0);
+
+	if (!ret) {
+		produce(ring);
+		return 0;
+	}
+
+	errors = consume(ring);
+	end = rdtsc();
+
+	while (wait(&status))
+		yield();
+
+	CHECK(errors == 0);
+
+	/*
+	 * Scale the cycle count down with shifts so the rest of the
+	 * arithmetic is 32 bit; user programs are not linked against libgcc.
+	 * A "kcycle" here is 2^10 cycles and an "Mcycle" 2^20.
+	 */
+	kcycles = (uint32_t) ((end - start) >> 10);
+	if (!kcycles)
+		kcycles = 1;
+	printf("shm_bench: %d KB in %d Mcycles, %d bytes per kcycle "
+	       "(1 Mcycle = 2^20 cycles)\n",
+	       TOTAL_SIZE / 1024, (int) ((end - start) >> 20),
+	       (int) (TOTAL_SIZE / kcycles));
+
+	CHECK(munmap(ring, sizeof(struct ring)) == 0);
+
+	return 0;
+}
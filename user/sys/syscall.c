@@ -6,6 +6,8 @@
 #include <stdint.h>
 #include <errno.h>
 
+#include <moridin/syscall.h>
+
 #include "syscall_internal.h"
 
 #define SYSCALL_ERROR( _ret ) ({					\
@@ -47,6 +49,26 @@ int wait(int *status)
 	return SYSCALL_ERROR(SYSCALL1(SYS_WAIT, status));
 }
 
+void *mmap(void *addr, size_t length, int prot, int flags)
+{
+	unsigned long ret;
+
+	ret = (unsigned long) SYSCALL4(SYS_MMAP, addr, length, prot, flags);
+
+	/* errors come back as codes smaller than a page */
+	if (ret < 4096) {
+		errno = ret;
+		return MAP_FAILED;
+	}
+
+	return (void *) ret;
+}
+
+int munmap(void *addr, size_t length)
+{
+	return SYSCALL_ERROR(SYSCALL2(SYS_MUNMAP, addr, length));
+}
+
 extern char _end;		/* Defined by the linker */
 size_t sbrk(int incr)
 {
@@ -7,6 +7,8 @@
 #define SYS_YIELD  3
 #define SYS_EXIT   4
 #define SYS_WAIT   5
+#define SYS_MMAP   6
+#define SYS_MUNMAP 7
 
 int __syscall(int system_call, void *arg1, void *arg2, void *arg3, void *arg4);
 